@@ -0,0 +1,173 @@
+// AM modulator for wwvsim
+// Turns the rendered audio into complex baseband for an SDR: full carrier
+// AM, offset from zero by a whole number of hertz, at a whole multiple of the
+// audio sample rate. Like the dither, the result depends only on each
+// sample's position in time, so intervals can be modulated in any order.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "wwvsim.h"
+
+#define AM_HALF 16      // Interpolation filter half-width in audio samples
+#define AM_CUTOFF 0.92  // Fraction of the audio Nyquist rate passed
+#define AM_BETA 8.0     // Kaiser window parameter, ~80 dB stopband
+#define AM_CHUNK 4096   // Output samples per pass
+#define AM_TABLE 1024   // Minimum carrier table length, so runs through it are long
+#define AM_MAX_INTERP 64 // So a pass covers at least 64 audio samples
+
+static long gcd(long a,long b){
+  while(b != 0){
+    long const t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Set up a modulator producing 'rate' complex samples per second, with the
+// carrier at 'carrier' Hz and 'depth' modulation (1.0 = 100%) at audio full scale
+// Return NULL on error
+struct wwvsim_am *wwvsim_am_create(int rate,int carrier,float depth){
+  if(rate < Samprate || rate % Samprate != 0 || rate / Samprate > AM_MAX_INTERP){
+    fprintf(stderr,"IQ sample rate %d must be a multiple of %d, up to %d\n",rate,Samprate,AM_MAX_INTERP * Samprate);
+    return NULL;
+  }
+  if(2L * abs(carrier) >= rate){
+    fprintf(stderr,"Carrier offset %d Hz outside +/- %d Hz\n",carrier,rate/2);
+    return NULL;
+  }
+  if(!(depth >= 0 && depth <= 1)){
+    fprintf(stderr,"Modulation depth %g out of range 0-1\n",depth);
+    return NULL;
+  }
+  struct wwvsim_am *am = calloc(1,sizeof(*am));
+  if(am == NULL)
+    return NULL;
+  am->rate = rate;
+  am->interp = rate / Samprate;
+  am->carrier = carrier;
+  am->depth = depth;
+  am->level = 1 / (1 + depth); // Full modulation peaks at full scale
+  am->half = am->interp > 1 ? AM_HALF : 0;
+
+  // Carrier phase is exact: it repeats every 'period' samples
+  am->period = rate / gcd(abs(carrier),rate);
+  am->length = am->period * ((AM_TABLE + am->period - 1) / am->period);
+  am->carrier_table = malloc(2 * am->length * sizeof(*am->carrier_table));
+  if(am->carrier_table == NULL)
+    goto fail;
+  for(int i=0; i < am->length; i++){
+    double const phase = 2 * M_PI * (((int64_t)carrier * i) % rate) / rate;
+    am->carrier_table[2*i] = cos(phase);
+    am->carrier_table[2*i+1] = sin(phase);
+  }
+  if(am->interp == 1)
+    return am;
+
+  // Polyphase interpolator: output phase p of audio sample i is the sum of
+  // taps[p][k] * audio[i - half + 1 + k], windowed sinc normalized to unity gain
+  int const ntaps = 2 * am->half;
+  am->taps = malloc(am->interp * ntaps * sizeof(*am->taps));
+  if(am->taps == NULL)
+    goto fail;
+  double const norm = bessel_i0(AM_BETA);
+  for(int p=0; p < am->interp; p++){
+    float *t = am->taps + p * ntaps;
+    double sum = 0;
+    for(int k=0; k < ntaps; k++){
+      double const d = k - am->half + 1 - (double)p / am->interp;
+      double const r = d / am->half;
+      double const window = fabs(r) < 1 ? bessel_i0(AM_BETA * sqrt(1 - r*r)) / norm : 0;
+      double const arg = M_PI * AM_CUTOFF * d;
+      t[k] = window * (d == 0 ? 1.0 : sin(arg)/arg);
+      sum += t[k];
+    }
+    for(int k=0; k < ntaps; k++)
+      t[k] /= sum;
+  }
+  return am;
+ fail:
+  wwvsim_am_destroy(am);
+  return NULL;
+}
+
+void wwvsim_am_destroy(struct wwvsim_am *am){
+  if(am == NULL)
+    return;
+  free(am->taps);
+  free(am->carrier_table);
+  free(am);
+}
+
+int wwvsim_am_rate(struct wwvsim_am const *am){
+  return am->rate;
+}
+
+// Audio samples needed on each side of an interval to modulate it
+int wwvsim_am_margin(struct wwvsim_am const *am){
+  return am->half;
+}
+
+// Envelope for output sample 'j' from interpolated audio 'a', limited so it
+// can't go negative; stored twice to line up with the I/Q pairs
+static inline void set_gain(struct wwvsim_am const *am,float *gain,int j,float a){
+  a = a > 1 ? 1 : a < -1 ? -1 : a;
+  gain[2*j] = gain[2*j+1] = am->level * (1 + am->depth * a);
+}
+
+// Modulate 'n' audio samples starting at sample number 'position' into n * interp
+// interleaved I/Q pairs. audio[-margin] through audio[n + margin - 1] must be valid
+void wwvsim_am_modulate(struct wwvsim_am const *am,float *iq,float const *audio,int n,int64_t position){
+  int const interp = am->interp;
+  int const ntaps = 2 * am->half;
+  int const chunk = AM_CHUNK / interp; // Audio samples per pass
+  float gain[2*AM_CHUNK];
+
+  for(int start = 0; start < n; start += chunk){
+    int const m = n - start < chunk ? n - start : chunk;
+    float const *x = audio + start;
+
+    if(interp == 1){
+      for(int i=0; i < m; i++)
+	set_gain(am,gain,i,x[i]);
+    } else {
+      // One output phase at a time, four audio samples at once
+      float const *x0 = x - am->half + 1;
+      for(int p=0; p < interp; p++){
+	float const *t = am->taps + p * ntaps;
+	int i = 0;
+	for(; i + 4 <= m; i += 4){
+	  v4sf acc = {0,0,0,0};
+	  for(int k=0; k < ntaps; k++)
+	    acc += t[k] * load4(x0 + i + k);
+	  for(int l=0; l < 4; l++)
+	    set_gain(am,gain,(i + l) * interp + p,acc[l]);
+	}
+	for(; i < m; i++){
+	  float acc = 0;
+	  for(int k=0; k < ntaps; k++)
+	    acc += t[k] * x0[i + k];
+	  set_gain(am,gain,i * interp + p,acc);
+	}
+      }
+    }
+    // Times the carrier, in runs through its table
+    int const len = 2 * m * interp;
+    int64_t const out = (position + start) * interp;
+    float *o = iq + 2 * (int64_t)start * interp;
+    for(int j = 0; j < len;){
+      int const phase = (out + j/2) % am->period;
+      int const run = 2 * (am->length - phase) < len - j ? 2 * (am->length - phase) : len - j;
+      float const *c = am->carrier_table + 2 * phase;
+      int r = 0;
+      for(; r + 4 <= run; r += 4)
+	store4(o + j + r,load4(gain + j + r) * load4(c + r));
+      for(; r < run; r++)
+	o[j + r] = gain[j + r] * c[r];
+      j += run;
+    }
+  }
+}
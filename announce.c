@@ -0,0 +1,861 @@
+// Speech synthesis for wwvsim voice announcements
+//
+// A station only ever speaks 1440 distinct time announcements plus a few
+// fixed messages, so synthesized PCM is kept in an in-memory LRU in front of
+// a persistent on-disk cache. Entries are keyed by TTS backend, voice, sample rate
+// and text. Once the disk cache is warm no synthesizer is run at all.
+//
+// A prefetch scheduler renders the announcements for the next few minutes
+// on background threads, so building a minute normally finds its speech
+// already in memory.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <math.h>
+
+#include "wwvsim.h"
+
+char const *Cache_dir = NULL;
+long Cache_mem_limit = 32L * 1024 * 1024; // About 75 time announcements of ~4.5 s, 16-bit at 48 kHz
+bool Splice_speech = false;
+
+enum speech_state {
+  SPEECH_PENDING, // Being rendered
+  SPEECH_READY,
+  SPEECH_FAILED,
+};
+
+// One synthesized utterance
+struct speech {
+  struct speech *hnext;       // Hash chain
+  struct speech *prev,*next;  // LRU list, most recently used at head
+  uint64_t hash;
+  char *key;                  // engine, voice, sample rate and text
+  enum speech_state state;
+  int refs;                   // Users; not evicted while nonzero
+  int16_t *samples;
+  int length;                 // Samples
+};
+
+#define SPEECH_HASH 1024
+static struct speech *Speech_hash[SPEECH_HASH];
+static struct speech *Lru_head, *Lru_tail;
+static long Lru_bytes;
+static pthread_mutex_t Speech_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Speech_cond = PTHREAD_COND_INITIALIZER; // Signalled when a render finishes
+
+// Prefetch queue
+struct prefetch {
+  struct prefetch *next;
+  char *text;
+  bool female;
+};
+static struct prefetch *Prefetch_head, *Prefetch_tail;
+static pthread_mutex_t Prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Prefetch_cond = PTHREAD_COND_INITIALIZER;
+static bool Prefetch_running;
+
+// On-disk cache file header; followed by the key and then the PCM
+#define CACHE_MAGIC "WWVS"
+#define CACHE_VERSION 1
+struct cache_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t samprate;
+  uint32_t keylen;
+  uint32_t samples;
+};
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(char const *s){
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while(*s != '\0'){
+    h ^= (uint8_t)*s++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Name of the on-disk cache file for a key; caller must free
+static char *cache_filename(uint64_t hash){
+  char *name = NULL;
+  if(Cache_dir == NULL || asprintf(&name,"%s/%016llx.pcm",Cache_dir,(unsigned long long)hash) == -1)
+    return NULL;
+  return name;
+}
+
+// Look for an utterance in the disk cache
+// Return number of samples, or -1 if absent or unreadable
+static int cache_read(uint64_t hash,char const *key,int16_t **samples){
+  *samples = NULL;
+  char *name = cache_filename(hash);
+  if(name == NULL)
+    return -1;
+
+  int r = -1;
+  char *stored_key = NULL;
+  FILE *fp = fopen(name,"r");
+  if(fp == NULL)
+    goto done;
+
+  struct cache_header hdr;
+  size_t const keylen = strlen(key);
+  if(fread(&hdr,sizeof(hdr),1,fp) != 1
+     || memcmp(hdr.magic,CACHE_MAGIC,sizeof(hdr.magic)) != 0
+     || hdr.version != CACHE_VERSION
+     || hdr.samprate != (uint32_t)Samprate
+     || hdr.keylen != keylen
+     || hdr.samples == 0)
+    goto done;
+
+  // Guard against hash collisions
+  stored_key = malloc(keylen);
+  if(stored_key == NULL || fread(stored_key,1,keylen,fp) != keylen || memcmp(stored_key,key,keylen) != 0)
+    goto done;
+
+  int16_t *buffer = malloc(hdr.samples * sizeof(*buffer));
+  if(buffer == NULL)
+    goto done;
+  if(fread(buffer,sizeof(*buffer),hdr.samples,fp) != hdr.samples){
+    free(buffer);
+    goto done;
+  }
+  *samples = buffer;
+  r = hdr.samples;
+
+ done:;
+  if(fp != NULL)
+    fclose(fp);
+  free(stored_key);
+  free(name);
+  return r;
+}
+
+// Store an utterance in the disk cache. Written to a temporary and renamed
+// so a concurrent or interrupted writer never leaves a partial entry
+static void cache_write(uint64_t hash,char const *key,int16_t const *samples,int length){
+  char *name = cache_filename(hash);
+  char *tempname = NULL;
+  if(name == NULL || asprintf(&tempname,"%s.XXXXXX",name) == -1)
+    goto done;
+
+  int fd = mkstemp(tempname);
+  if(fd == -1)
+    goto done;
+
+  FILE *fp = fdopen(fd,"w");
+  if(fp == NULL){
+    close(fd);
+    unlink(tempname);
+    goto done;
+  }
+  struct cache_header hdr;
+  memcpy(hdr.magic,CACHE_MAGIC,sizeof(hdr.magic));
+  hdr.version = CACHE_VERSION;
+  hdr.samprate = Samprate;
+  hdr.keylen = strlen(key);
+  hdr.samples = length;
+
+  bool ok = fwrite(&hdr,sizeof(hdr),1,fp) == 1
+    && fwrite(key,1,hdr.keylen,fp) == hdr.keylen
+    && fwrite(samples,sizeof(*samples),length,fp) == (size_t)length;
+  if(fclose(fp) != 0)
+    ok = false;
+  if(!ok || rename(tempname,name) != 0){
+    fprintf(stderr,"Can't write speech cache %s: %s\n",name,strerror(errno));
+    unlink(tempname);
+  }
+ done:;
+  free(tempname);
+  free(name);
+}
+
+// LRU maintenance; caller holds Speech_mutex
+static void lru_unlink(struct speech *sp){
+  if(sp->prev)
+    sp->prev->next = sp->next;
+  else
+    Lru_head = sp->next;
+  if(sp->next)
+    sp->next->prev = sp->prev;
+  else
+    Lru_tail = sp->prev;
+  sp->prev = sp->next = NULL;
+}
+
+static void lru_push(struct speech *sp){
+  sp->prev = NULL;
+  sp->next = Lru_head;
+  if(Lru_head)
+    Lru_head->prev = sp;
+  else
+    Lru_tail = sp;
+  Lru_head = sp;
+}
+
+static void speech_free(struct speech *sp){
+  struct speech **spp = &Speech_hash[sp->hash % SPEECH_HASH];
+  while(*spp != sp)
+    spp = &(*spp)->hnext;
+  *spp = sp->hnext;
+  lru_unlink(sp);
+  Lru_bytes -= sp->length * sizeof(*sp->samples);
+  free(sp->samples);
+  free(sp->key);
+  free(sp);
+}
+
+// Evict least recently used entries down to the memory limit, skipping any in use
+// Failures hold no samples and stay until retried, so a waiter always sees them
+// Caller holds Speech_mutex
+static void lru_trim(void){
+  struct speech *sp = Lru_tail;
+  while(Lru_bytes > Cache_mem_limit && sp != NULL){
+    struct speech *prev = sp->prev;
+    if(sp->refs == 0 && sp->state == SPEECH_READY)
+      speech_free(sp);
+    sp = prev;
+  }
+}
+
+// Look up a key in memory; caller holds Speech_mutex
+static struct speech *speech_find(uint64_t hash,char const *key){
+  for(struct speech *sp = Speech_hash[hash % SPEECH_HASH]; sp != NULL; sp = sp->hnext){
+    if(sp->hash == hash && strcmp(sp->key,key) == 0)
+      return sp;
+  }
+  return NULL;
+}
+
+// Find an utterance in memory, the disk cache or, failing those, the synthesizer
+// The entry is returned with a reference that must be dropped with speech_release()
+// When it isn't already present, or failed before and nobody is looking at the
+// failure, it is rendered in the calling thread; otherwise if 'wait' is set,
+// wait for another thread's render in progress to finish
+static struct speech *speech_get(char const *text,bool female,bool wait){
+  char *key = NULL;
+  if(asprintf(&key,"%s\n%s\n%d\n%s",tts_name(),tts_voice(female),Samprate,text) == -1)
+    return NULL;
+
+  uint64_t const hash = fnv1a(key);
+  pthread_mutex_lock(&Speech_mutex);
+  struct speech *sp = speech_find(hash,key);
+  if(sp != NULL && (sp->state != SPEECH_FAILED || sp->refs > 0)){
+    free(key);
+    lru_unlink(sp);
+    lru_push(sp);
+    sp->refs++;
+    while(wait && sp->state == SPEECH_PENDING)
+      pthread_cond_wait(&Speech_cond,&Speech_mutex);
+    pthread_mutex_unlock(&Speech_mutex);
+    return sp;
+  }
+  if(sp != NULL){
+    // Failed last time; try again, and anyone else waits for us
+    free(key);
+    key = sp->key;
+    lru_unlink(sp);
+    lru_push(sp);
+    sp->state = SPEECH_PENDING;
+    sp->refs = 1;
+    pthread_mutex_unlock(&Speech_mutex);
+  } else {
+    // Create a placeholder so other threads wait for us instead of repeating the work
+    sp = calloc(1,sizeof(*sp));
+    if(sp == NULL){
+      pthread_mutex_unlock(&Speech_mutex);
+      free(key);
+      return NULL;
+    }
+    sp->hash = hash;
+    sp->key = key;
+    sp->state = SPEECH_PENDING;
+    sp->refs = 1;
+    sp->hnext = Speech_hash[hash % SPEECH_HASH];
+    Speech_hash[hash % SPEECH_HASH] = sp;
+    lru_push(sp);
+    pthread_mutex_unlock(&Speech_mutex);
+  }
+
+  int16_t *samples = NULL;
+  int length = cache_read(hash,key,&samples);
+  if(length > 0){
+    if(Verbose)
+      fprintf(stderr,"speech cache hit: %s\n",text);
+  } else if((length = tts_synthesize(text,female,&samples)) > 0)
+    cache_write(hash,key,samples,length);
+
+  pthread_mutex_lock(&Speech_mutex);
+  if(length > 0){
+    sp->samples = samples;
+    sp->length = length;
+    sp->state = SPEECH_READY;
+    Lru_bytes += length * sizeof(*samples);
+    lru_trim();
+  } else
+    sp->state = SPEECH_FAILED;
+  pthread_cond_broadcast(&Speech_cond);
+  pthread_mutex_unlock(&Speech_mutex);
+  return sp;
+}
+
+static void prefetch_queue(char const *text,bool female,bool urgent);
+
+// Like speech_get(), but never render in the calling thread. Wait no later than
+// 'deadline' for the prefetch threads, jumping the queue if need be.
+// Returns NULL when the speech isn't ready in time; the render continues
+// in the background so the cache has it next time. A failed render is
+// returned at once, as SPEECH_FAILED
+static struct speech *speech_wait(char const *text,bool female,struct timespec const *deadline){
+  if(deadline == NULL || !Prefetch_running)
+    return speech_get(text,female,true);
+
+  char *key = NULL;
+  if(asprintf(&key,"%s\n%s\n%d\n%s",tts_name(),tts_voice(female),Samprate,text) == -1)
+    return NULL;
+  uint64_t const hash = fnv1a(key);
+
+  struct speech *sp = NULL;
+  bool queued = false;
+  pthread_mutex_lock(&Speech_mutex);
+  while(true){
+    sp = speech_find(hash,key);
+    if(sp != NULL && sp->state != SPEECH_PENDING){
+      lru_unlink(sp);
+      lru_push(sp);
+      sp->refs++;
+      break;
+    }
+    if(sp == NULL && !queued){
+      pthread_mutex_unlock(&Speech_mutex);
+      prefetch_queue(text,female,true);
+      queued = true;
+      pthread_mutex_lock(&Speech_mutex);
+      continue;
+    }
+    if(pthread_cond_timedwait(&Speech_cond,&Speech_mutex,deadline) == ETIMEDOUT){
+      sp = NULL;
+      atomic_fetch_add(&Stats.late_speech,1);
+      if(Verbose)
+	fprintf(stderr,"Speech not ready by deadline, skipped: %s\n",text);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&Speech_mutex);
+  free(key);
+  return sp;
+}
+
+// A failure stays in place, for any thread still waiting on it, until the
+// next speech_get() tries again
+static void speech_release(struct speech *sp){
+  pthread_mutex_lock(&Speech_mutex);
+  if(--sp->refs == 0)
+    lru_trim();
+  pthread_mutex_unlock(&Speech_mutex);
+}
+
+// Pick a default cache directory and make sure it exists
+// $WWVSIM_CACHE, then $XDG_CACHE_HOME/wwvsim, then $HOME/.cache/wwvsim
+void speech_cache_init(void){
+  static char *dir; // Persists for program lifetime
+
+  if(Cache_dir == NULL){
+    char const *env;
+    if((env = getenv("WWVSIM_CACHE")) != NULL)
+      dir = strdup(env);
+    else if((env = getenv("XDG_CACHE_HOME")) != NULL){
+      if(asprintf(&dir,"%s/wwvsim",env) == -1)
+	dir = NULL;
+    } else if((env = getenv("HOME")) != NULL){
+      char *parent = NULL;
+      if(asprintf(&parent,"%s/.cache",env) != -1){
+	mkdir(parent,0755);
+	if(asprintf(&dir,"%s/wwvsim",parent) == -1)
+	  dir = NULL;
+	free(parent);
+      }
+    }
+    Cache_dir = dir;
+  }
+  if(Cache_dir == NULL)
+    return;
+
+  if(mkdir(Cache_dir,0755) != 0 && errno != EEXIST){
+    fprintf(stderr,"Can't create speech cache directory %s: %s; disk cache disabled\n",Cache_dir,strerror(errno));
+    Cache_dir = NULL;
+  } else if(access(Cache_dir,W_OK|X_OK) != 0){
+    fprintf(stderr,"Speech cache directory %s not writeable; disk cache disabled\n",Cache_dir);
+    Cache_dir = NULL;
+  } else if(Verbose)
+    fprintf(stderr,"Speech cache in %s\n",Cache_dir);
+}
+
+// Station IDs and other recorded .raw files are 16-bit mono at ASSET_RATE
+// Each is converted to Samprate when first played and kept, since the same
+// few play every hour; a file that changes is loaded again
+#define ASSET_RATE 48000
+#define ASSET_MAX_SECONDS 61
+
+struct asset {
+  struct asset *next;
+  char *file;
+  off_t size;
+  time_t mtime;
+  int16_t *samples;           // At Samprate
+  int length;
+};
+
+static struct asset *Assets;
+static pthread_mutex_t Asset_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Read and convert an audio file into 'a'
+// Return 0 on success, -1 on error
+static int asset_load(struct asset *a,FILE *fp){
+  int const max = ASSET_MAX_SECONDS * ASSET_RATE;
+  int16_t *raw = malloc(max * sizeof(*raw));
+  float *pcm = malloc(max * sizeof(*pcm));
+  int const length = (raw != NULL && pcm != NULL) ? (int)fread(raw,sizeof(*raw),max,fp) : -1;
+  for(int i=0; i < length; i++)
+    pcm[i] = raw[i] * (1.0f / 32768);
+  free(raw);
+  int16_t *samples = NULL;
+  int const r = length > 0 ? resample_pcm(&samples,pcm,length,ASSET_RATE) : -1;
+  free(pcm);
+  if(r <= 0){
+    free(samples);
+    return -1;
+  }
+  free(a->samples);
+  a->samples = samples;
+  a->length = r;
+  return 0;
+}
+
+// Insert PCM audio file into audio output at specified offset
+// Return number of samples, or -1 on error
+int announce_audio_file(int16_t *output, int length, char const *file, int startms){
+  if(startms < 0 || startms >= 1000*length)
+    return -1;
+
+  FILE *fp = fopen(file,"r");
+  if(fp == NULL)
+    return -1;
+  struct stat st;
+  if(fstat(fileno(fp),&st) != 0){
+    fclose(fp);
+    return -1;
+  }
+  int r = -1;
+  pthread_mutex_lock(&Asset_mutex);
+  struct asset *a;
+  for(a = Assets; a != NULL; a = a->next){
+    if(strcmp(a->file,file) == 0)
+      break;
+  }
+  if(a == NULL && (a = calloc(1,sizeof(*a))) != NULL){
+    if((a->file = strdup(file)) == NULL){
+      free(a);
+      a = NULL;
+    } else {
+      a->next = Assets;
+      Assets = a;
+    }
+  }
+  if(a == NULL)
+    goto done;
+  if(a->samples == NULL || a->size != st.st_size || a->mtime != st.st_mtime){
+    if(asset_load(a,fp) != 0)
+      goto done;
+    a->size = st.st_size;
+    a->mtime = st.st_mtime;
+    if(Verbose)
+      fprintf(stderr,"Loaded %s, %d samples\n",file,a->length);
+  }
+  r = length * Samprate - ms_samples(startms);
+  if(r > a->length)
+    r = a->length;
+  memcpy(output + ms_samples(startms),a->samples,r * sizeof(*output));
+ done:;
+  pthread_mutex_unlock(&Asset_mutex);
+  fclose(fp);
+  return r;
+}
+
+// Synthesize a text announcement and insert into output buffer
+// Fail if the speech isn't available by 'deadline' (NULL: wait as long as it takes)
+// Return number of samples inserted
+int announce_text(int16_t *output,int length,char const *message,int startms,bool female,struct timespec const *deadline){
+  if(startms < 0 || startms >= 1000*length)
+    return -1;
+
+  struct speech *sp = speech_wait(message,female,deadline);
+  if(sp == NULL)
+    return -1;
+  int r = -1;
+  if(sp->state == SPEECH_FAILED){
+    atomic_fetch_add(&Stats.failed_speech,1);
+    if(Verbose)
+      fprintf(stderr,"Speech synthesis failed, skipped: %s\n",message);
+  } else if(sp->state == SPEECH_READY){
+    int samples = length * Samprate - ms_samples(startms);
+    if(samples > sp->length)
+      samples = sp->length;
+    memcpy(output + ms_samples(startms),sp->samples,samples * sizeof(*output));
+    r = samples;
+  }
+  speech_release(sp);
+  return r;
+}
+
+char *chomp(char *str){
+  char *cp = strchr(str,'\n');
+  if(cp != NULL)
+    *cp = '\0';
+  cp = strchr(str,'\r');
+  if(cp != NULL)
+    *cp = '\0';
+  return str;
+}
+
+// Read an announcement text file, relative to Libdir unless it's an absolute path
+// Return malloc'ed contents, or NULL on error
+static char *read_text_file(char const *file){
+  char *fullname = NULL;
+  char *text = NULL;
+  FILE *fp = NULL;
+
+  int asr = -1;
+  if(file[0] == '/')
+    asr = asprintf(&fullname,"%s",file); // Leading slash indicates absolute path name
+  else
+    asr = asprintf(&fullname,"%s/%s",Libdir,file); // Otherwise relative to library directory
+
+  if(asr == -1 || !fullname)
+    goto done; // asprintf failed for some reason
+
+  chomp(fullname);
+  // Read the whole file; its contents are the cache key
+  if((fp = fopen(fullname,"r")) == NULL)
+    goto done;
+  size_t size = 0;
+  if(getdelim(&text,&size,'\0',fp) <= 0){
+    free(text);
+    text = NULL;
+  }
+ done:;
+  if(fp)
+    fclose(fp);
+  free(fullname);
+  return text;
+}
+
+// Synthesize the contents of a text file and insert into output buffer
+int announce_text_file(int16_t *output,int length,char const *file,int startms,bool female,struct timespec const *deadline){
+  char *text = read_text_file(file);
+  if(text == NULL)
+    return -1;
+  int const r = announce_text(output,length,text,startms,female,deadline);
+  free(text);
+  return r;
+}
+
+// Concatenative time announcements
+// Each voice's words are rendered once (through the cache, so normally never
+// after the first run) and every announcement is spliced from them in memory
+enum {
+  CLIP_AT_THE_TONE,
+  CLIP_NUMBER,                  // 0-59 follow
+  CLIP_HOUR = CLIP_NUMBER + 60,
+  CLIP_HOURS,
+  CLIP_MINUTE,
+  CLIP_MINUTES,
+  CLIP_UTC,
+  NCLIPS
+};
+
+struct clip {
+  int16_t *samples;
+  int length;
+};
+
+static struct clip Clips[2][NCLIPS]; // Indexed by female
+static atomic_bool Clips_loaded[2];   // Set once the voice's clips are complete; never cleared
+static pthread_mutex_t Clips_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CLIP_THRESHOLD 300 // Silence trimming threshold, about -40 dBFS
+#define CLIP_EDGE_MS 3     // Fade at trimmed edges
+#define CLIP_XFADE_MS 8    // Crossfade between words spoken without a pause
+
+static char const *clip_text(int n,char *buf,int size){
+  switch(n){
+  case CLIP_AT_THE_TONE:
+    return "At the tone";
+  case CLIP_HOUR:
+    return "hour";
+  case CLIP_HOURS:
+    return "hours";
+  case CLIP_MINUTE:
+    return "minute";
+  case CLIP_MINUTES:
+    return "minutes";
+  case CLIP_UTC:
+    return "Coordinated Universal Time";
+  default:
+    snprintf(buf,size,"%d",n - CLIP_NUMBER);
+    return buf;
+  }
+}
+
+// Copy synthesized speech without its leading and trailing silence,
+// with short fades at the cut points
+static int clip_trim(struct clip *clip,int16_t const *samples,int length){
+  int start = 0;
+  while(start < length && abs(samples[start]) < CLIP_THRESHOLD)
+    start++;
+  int end = length;
+  while(end > start && abs(samples[end-1]) < CLIP_THRESHOLD)
+    end--;
+  if(end <= start)
+    return -1; // All silence?
+
+  int const edge = ms_samples(CLIP_EDGE_MS);
+  start = start > edge ? start - edge : 0;
+  end = end + edge < length ? end + edge : length;
+
+  clip->length = end - start;
+  clip->samples = malloc(clip->length * sizeof(*clip->samples));
+  if(clip->samples == NULL)
+    return -1;
+  memcpy(clip->samples,samples + start,clip->length * sizeof(*clip->samples));
+  for(int i=0; i < edge && i < clip->length; i++){
+    float const g = (float)i / edge;
+    clip->samples[i] *= g;
+    clip->samples[clip->length - 1 - i] *= g;
+  }
+  return 0;
+}
+
+// Render (or fetch from the cache) the clip set for one voice
+// Generators may be created on any thread, so only one does the work
+int announce_clips_init(bool female){
+  if(atomic_load(&Clips_loaded[female]))
+    return 0;
+  pthread_mutex_lock(&Clips_mutex);
+  if(atomic_load(&Clips_loaded[female])){
+    pthread_mutex_unlock(&Clips_mutex);
+    return 0;
+  }
+
+  // Let the prefetch threads render them in parallel
+  for(int n=0; n < NCLIPS; n++){
+    char buf[16];
+    announce_prefetch(clip_text(n,buf,sizeof(buf)),female);
+  }
+  int r = 0;
+  for(int n=0; n < NCLIPS && r == 0; n++){
+    char buf[16];
+    struct speech *sp = speech_get(clip_text(n,buf,sizeof(buf)),female,true);
+    if(sp == NULL)
+      r = -1;
+    else {
+      if(sp->state != SPEECH_READY || clip_trim(&Clips[female][n],sp->samples,sp->length) != 0)
+	r = -1;
+      speech_release(sp);
+    }
+  }
+  if(r != 0){
+    for(int n=0; n < NCLIPS; n++){
+      free(Clips[female][n].samples);
+      Clips[female][n].samples = NULL;
+      Clips[female][n].length = 0;
+    }
+  } else
+    atomic_store(&Clips_loaded[female],true); // Publishes the clips
+  pthread_mutex_unlock(&Clips_mutex);
+  return r;
+}
+
+// Splice clips into 'output' (which has room for 'room' samples) with a pause
+// of gap_ms[i] before clip i, or a crossfade when the gap is zero
+// Return number of samples written
+static int clip_splice(int16_t *output,int room,struct clip const * const *seq,int const *gap_ms,int count){
+  int pos = 0;
+  int const xfade = ms_samples(CLIP_XFADE_MS);
+  for(int i=0; i < count; i++){
+    struct clip const *clip = seq[i];
+    int overlap = 0;
+    if(gap_ms[i] > 0){
+      for(int j=0; j < ms_samples(gap_ms[i]) && pos < room; j++)
+	output[pos++] = 0;
+    } else if(i > 0){
+      overlap = xfade;
+      if(overlap > clip->length)
+	overlap = clip->length;
+      if(overlap > seq[i-1]->length)
+	overlap = seq[i-1]->length;
+      pos -= overlap;
+    }
+    for(int j=0; j < clip->length && pos + j < room; j++){
+      if(j < overlap){
+	// Raised cosine; the previous word's tail is already in the buffer
+	float const g = 0.5 - 0.5 * cos(M_PI * j / overlap);
+	output[pos + j] = output[pos + j] * (1-g) + clip->samples[j] * g;
+      } else
+	output[pos + j] = clip->samples[j];
+    }
+    pos += clip->length;
+  }
+  return pos < room ? pos : room;
+}
+
+// Text of a time announcement; caller must free
+static char *time_text(int hour,int minute){
+  char *message = NULL;
+  if(asprintf(&message,"At the tone, %d %s %d %s Coordinated Universal Time",
+	      hour,hour == 1 ? "hour" : "hours",
+	      minute,minute == 1 ? "minute" : "minutes") == -1)
+    return NULL;
+  return message;
+}
+
+// Announce the time, either spliced from the clip set or as one synthesized sentence
+int announce_time(int16_t *output,int length,int hour,int minute,int startms,bool female,struct timespec const *deadline){
+  if(startms < 0 || startms >= 1000*length)
+    return -1;
+
+  if(Splice_speech && atomic_load(&Clips_loaded[female])){
+    struct clip const * const clips = Clips[female];
+    struct clip const * const seq[] = {
+      &clips[CLIP_AT_THE_TONE],
+      &clips[CLIP_NUMBER + hour],
+      &clips[hour == 1 ? CLIP_HOUR : CLIP_HOURS],
+      &clips[CLIP_NUMBER + minute],
+      &clips[minute == 1 ? CLIP_MINUTE : CLIP_MINUTES],
+      &clips[CLIP_UTC],
+    };
+    int const gap_ms[] = { 0, 250, 0, 120, 0, 200 }; // Pause after "At the tone," and between fields
+    return clip_splice(output + ms_samples(startms),length * Samprate - ms_samples(startms),seq,gap_ms,sizeof(seq)/sizeof(seq[0]));
+  }
+  char *message = time_text(hour,minute);
+  if(message == NULL)
+    return -1;
+  int const r = announce_text(output,length,message,startms,female,deadline);
+  free(message);
+  return r;
+}
+
+// Background rendering of upcoming announcements
+static void *prefetch_thread(void *arg){
+  pthread_setname("prefetch");
+  while(true){
+    pthread_mutex_lock(&Prefetch_mutex);
+    while(Prefetch_head == NULL)
+      pthread_cond_wait(&Prefetch_cond,&Prefetch_mutex);
+    struct prefetch *pf = Prefetch_head;
+    Prefetch_head = pf->next;
+    if(Prefetch_head == NULL)
+      Prefetch_tail = NULL;
+    pthread_mutex_unlock(&Prefetch_mutex);
+
+    struct speech *sp = speech_get(pf->text,pf->female,false);
+    if(sp != NULL)
+      speech_release(sp);
+    free(pf->text);
+    free(pf);
+  }
+  return NULL;
+}
+
+// Start 'threads' prefetch threads, normally one per synthesizer worker
+int announce_prefetch_init(int threads){
+  if(threads < 1)
+    threads = 1;
+  for(int i=0; i < threads; i++){
+    pthread_t t;
+    if(pthread_create(&t,NULL,prefetch_thread,NULL) != 0)
+      return -1;
+    pthread_detach(t);
+  }
+  Prefetch_running = true;
+  return 0;
+}
+
+// Queue text for rendering into the cache, urgent requests first
+static void prefetch_queue(char const *text,bool female,bool urgent){
+  struct prefetch *pf = calloc(1,sizeof(*pf));
+  if(pf == NULL)
+    return;
+  pf->text = strdup(text);
+  pf->female = female;
+  if(pf->text == NULL){
+    free(pf);
+    return;
+  }
+  pthread_mutex_lock(&Prefetch_mutex);
+  if(urgent){
+    pf->next = Prefetch_head;
+    Prefetch_head = pf;
+    if(Prefetch_tail == NULL)
+      Prefetch_tail = pf;
+  } else {
+    if(Prefetch_tail)
+      Prefetch_tail->next = pf;
+    else
+      Prefetch_head = pf;
+    Prefetch_tail = pf;
+  }
+  pthread_cond_signal(&Prefetch_cond);
+  pthread_mutex_unlock(&Prefetch_mutex);
+}
+
+// Queue text for rendering into the cache ahead of need
+void announce_prefetch(char const *text,bool female){
+  if(Prefetch_running)
+    prefetch_queue(text,female,false);
+}
+
+// Queue the speech for 'count' minutes starting at hour:minute:
+// the time announcement each minute and any text announcement in its tone slot
+// Minutes already cached or in progress cost only a lookup
+void announce_schedule(bool wwvh,int hour,int minute,int count){
+  bool const female = wwvh;
+  for(int i=0; i < count; i++){
+    // Raw audio files pre-empt text files, as in gen_tone_or_announcement()
+    char *name = NULL;
+    if(asprintf(&name,"%s/%s/%d.raw",Libdir,wwvh ? "wwvh" : "wwv",minute) != -1 && access(name,R_OK) != 0){
+      free(name);
+      name = NULL;
+      if(asprintf(&name,"%s/%s/%d.txt",Libdir,wwvh ? "wwvh" : "wwv",minute) != -1 && access(name,R_OK) == 0){
+	char *text = read_text_file(name);
+	if(text != NULL)
+	  announce_prefetch(text,female);
+	free(text);
+      }
+    }
+    free(name);
+
+    // Advance; each minute announces the next
+    if(++minute == 60){
+      minute = 0;
+      if(++hour == 24)
+	hour = 0;
+    }
+    if(!Splice_speech || !atomic_load(&Clips_loaded[female])){
+      char *text = time_text(hour,minute);
+      if(text != NULL)
+	announce_prefetch(text,female);
+      free(text);
+    }
+  }
+}
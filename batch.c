@@ -0,0 +1,239 @@
+// Offline rendering for wwvsim
+// Produces hours or days of audio as fast as the machine allows. Worker
+// threads, one per core, take the interval a minute at a time and render
+// the minutes in parallel; the calling thread writes them out in order as
+// they finish.
+// Nothing waits on the clock, and speech is always rendered in full.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+#define BATCH_AHEAD 2 // Minutes each worker may run ahead of the writer
+
+struct job {
+  int64_t start; // Broadcast sample number
+  int samples;   // Audio samples
+  void *buffer;  // Up to one minute in the output format
+  bool done;
+  bool failed;   // Couldn't be rendered
+};
+
+// Each worker's scratch, allocated before any starts
+struct worker {
+  pthread_t thread;
+  float *bus;    // Receiver output, with the modulator's margins
+  float *iq;     // A second of I/Q, or NULL for audio
+};
+
+static pthread_mutex_t Batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Batch_cond = PTHREAD_COND_INITIALIZER; // Job finished or slot freed
+static struct job *Jobs; // Ring of 'Window' slots, minute n in slot n % Window
+static int Window;
+static struct wwvsim_receiver const *Receiver;
+static enum wwvsim_format Format;
+static bool Dither;
+static struct wwvsim_am const *Am; // I/Q output if not NULL
+static int Interp;          // Output samples per audio sample
+static int Channels;        // Audio channels
+static int Frame;           // Bytes per output sample
+static int Job_max;         // Audio samples per job
+static int64_t Next_sample; // Start of the next job
+static int64_t End_sample;  // End of the interval
+static long Next;           // Next job to hand out
+static long Written;        // Jobs written
+
+static void *batch_worker(void *arg){
+  pthread_setname("render");
+  struct worker const *worker = arg;
+  int const margin = Am != NULL ? wwvsim_am_margin(Am) : 0;
+  float *bus = worker->bus;
+  float *iq = worker->iq;
+
+  while(1){
+    pthread_mutex_lock(&Batch_mutex);
+    while(Next_sample < End_sample && Next >= Written + Window)
+      pthread_cond_wait(&Batch_cond,&Batch_mutex);
+    if(Next_sample >= End_sample){
+      pthread_mutex_unlock(&Batch_mutex);
+      break;
+    }
+    // Up to the end of the minute
+    struct job *j = &Jobs[Next++ % Window];
+    int64_t end = wwvsim_receiver_next_minute(Receiver,Next_sample);
+    if(end > End_sample)
+      end = End_sample;
+    if(end > Next_sample + Job_max)
+      end = Next_sample + Job_max;
+    j->start = Next_sample;
+    j->samples = end - Next_sample;
+    Next_sample = end;
+    pthread_mutex_unlock(&Batch_mutex);
+
+    int64_t const start = monotonic_ns();
+    j->failed = wwvsim_receiver_render(Receiver,bus,j->start - margin,j->start + j->samples + margin) != 0;
+    hist_add(&Stats.render_minute,(monotonic_ns() - start) / 1000);
+    trace_event("render",start);
+    if(!j->failed && Am == NULL)
+      wwvsim_quantize(j->buffer,Format,Dither,bus,j->samples * Channels,j->start * Channels);
+    else if(!j->failed){
+      // A second at a time through the modulator
+      for(int done = 0; done < j->samples; done += Samprate){
+	int const n = j->samples - done < Samprate ? j->samples - done : Samprate;
+	wwvsim_am_modulate(Am,iq,bus + margin + done,n,j->start + done);
+	wwvsim_quantize((char *)j->buffer + (size_t)done * Interp * Frame,Format,Dither,iq,2 * n * Interp,2 * (j->start + done) * Interp);
+      }
+    }
+
+    pthread_mutex_lock(&Batch_mutex);
+    j->done = true;
+    pthread_cond_broadcast(&Batch_cond);
+    pthread_mutex_unlock(&Batch_mutex);
+  }
+  return NULL;
+}
+
+// Render samples [t0,t1) from receiver 'r' to the file 'output' ("-" for stdout)
+// as audio, or as I/Q from modulator 'am' if it isn't NULL (one channel only)
+// Return 0 on success, -1 on error
+int batch_render(struct wwvsim_receiver const *r,int64_t t0,int64_t t1,char const *output,enum wwvsim_format format,bool dither,struct wwvsim_am const *am){
+  int ret = -1;
+  FILE *fp = NULL;
+  struct worker *workers = NULL;
+  int nthreads = 0;
+
+  if(strcmp(output,"-") == 0){
+    if(isatty(fileno(stdout))){
+      fprintf(stderr,"Won't send PCM to a terminal\n");
+      return -1;
+    }
+    fp = stdout;
+  } else if((fp = fopen(output,"w")) == NULL){
+    fprintf(stderr,"Can't create %s: %s\n",output,strerror(errno));
+    return -1;
+  }
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if(ncpu < 1)
+    ncpu = 1;
+
+  Receiver = r;
+  Format = format;
+  Dither = dither;
+  Am = am;
+  Interp = am != NULL ? am->interp : 1;
+  Channels = wwvsim_receiver_channels(r);
+  Frame = wwvsim_format_size(format) * (am != NULL ? 2 : Channels);
+  Job_max = 61 * Samprate / Interp; // Keeps the buffers at a minute of audio
+  Next_sample = t0;
+  End_sample = t1;
+  Next = Written = 0;
+  Window = BATCH_AHEAD * ncpu;
+  Jobs = calloc(Window,sizeof(*Jobs));
+  workers = calloc(ncpu,sizeof(*workers));
+  if(Jobs == NULL || workers == NULL)
+    goto nomem;
+  for(int i=0; i < Window; i++){
+    if((Jobs[i].buffer = malloc((size_t)Job_max * Interp * Frame)) == NULL)
+      goto nomem;
+  }
+  // A worker that couldn't get these would take no jobs, and with none
+  // taking any the writer would wait forever
+  int const margin = am != NULL ? wwvsim_am_margin(am) : 0;
+  for(int i=0; i < ncpu; i++){
+    if((workers[i].bus = malloc((Job_max + 2 * margin) * Channels * sizeof(*workers[i].bus))) == NULL)
+      goto nomem;
+    if(am != NULL && (workers[i].iq = malloc(2 * Interp * Samprate * sizeof(*workers[i].iq))) == NULL)
+      goto nomem;
+  }
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC,&begin);
+  for(; nthreads < ncpu; nthreads++){
+    if(pthread_create(&workers[nthreads].thread,NULL,batch_worker,&workers[nthreads]) != 0)
+      break;
+  }
+  if(nthreads == 0)
+    goto done;
+
+  // Write minutes in order as they complete
+  long samples = 0;
+  for(long n=0; ; n++){
+    struct job *j = &Jobs[n % Window];
+    pthread_mutex_lock(&Batch_mutex);
+    while(!j->done && !(Next_sample >= End_sample && n >= Next))
+      pthread_cond_wait(&Batch_cond,&Batch_mutex);
+    pthread_mutex_unlock(&Batch_mutex);
+    if(!j->done)
+      break; // All written
+
+    int64_t const start = monotonic_ns();
+    size_t const written = j->failed ? 0 : fwrite(j->buffer,Frame,(size_t)j->samples * Interp,fp);
+    hist_add(&Stats.output_write,(monotonic_ns() - start) / 1000);
+    trace_event("write",start);
+    if(written != (size_t)j->samples * Interp){
+      if(j->failed)
+	fprintf(stderr,"Rendering failed at sample %lld\n",(long long)j->start);
+      else
+	fprintf(stderr,"Write to %s failed: %s\n",output,strerror(errno));
+      // Let the workers run out of work
+      pthread_mutex_lock(&Batch_mutex);
+      End_sample = Next_sample;
+      pthread_cond_broadcast(&Batch_cond);
+      pthread_mutex_unlock(&Batch_mutex);
+      goto done;
+    }
+    samples += j->samples;
+    pthread_mutex_lock(&Batch_mutex);
+    j->done = false;
+    Written++;
+    pthread_cond_broadcast(&Batch_cond);
+    pthread_mutex_unlock(&Batch_mutex);
+  }
+  if(fflush(fp) != 0){
+    fprintf(stderr,"Write to %s failed: %s\n",output,strerror(errno));
+    goto done;
+  }
+  struct timespec finish;
+  clock_gettime(CLOCK_MONOTONIC,&finish);
+  double const elapsed = (finish.tv_sec - begin.tv_sec) + 1e-9 * (finish.tv_nsec - begin.tv_nsec);
+  double const minutes = (double)samples / (60 * Samprate);
+  fprintf(stderr,"%.1f minutes (%ld samples) in %.2f s on %d threads: %.1f minutes/s, %.0fx real time\n",
+	  minutes,samples,elapsed,nthreads,minutes / elapsed,(double)samples / Samprate / elapsed);
+  if(Stats.late_speech > 0)
+    fprintf(stderr,"%ld announcements missing\n",(long)Stats.late_speech);
+  if(Stats.failed_speech > 0)
+    fprintf(stderr,"%ld announcements failed\n",(long)Stats.failed_speech);
+  ret = 0;
+  goto done;
+
+ nomem:
+  fprintf(stderr,"Can't allocate batch buffers\n");
+ done:;
+  for(int i=0; i < nthreads; i++)
+    pthread_join(workers[i].thread,NULL);
+  if(workers != NULL){
+    for(int i=0; i < ncpu; i++){
+      free(workers[i].bus);
+      free(workers[i].iq);
+    }
+    free(workers);
+  }
+  if(Jobs != NULL){
+    for(int i=0; i < Window; i++)
+      free(Jobs[i].buffer);
+    free(Jobs);
+    Jobs = NULL;
+  }
+  if(fp != NULL && fp != stdout && fclose(fp) != 0 && ret == 0){
+    fprintf(stderr,"Write to %s failed: %s\n",output,strerror(errno));
+    ret = -1;
+  }
+  return ret;
+}
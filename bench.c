@@ -0,0 +1,277 @@
+// Benchmarks for wwvsim
+// Times each stage on its own: the time code, the tone and silence
+// primitives, whole minutes with and without an HF channel, and speech
+// synthesis with each backend, cold (first phrase after starting it) and
+// warm. One JSON object per line on stdout, for scripts to compare runs.
+// Then renders fixed minutes with fixed seeds and checks a checksum of each
+// against the ones recorded here, so an optimization can be shown to change
+// nothing but the speed. Needs no sound device or network.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "wwvsim.h"
+
+#define BENCH_PHRASES 8 // Warm synthesis runs per backend
+
+static int Minutes = 30;        // Whole minutes to time
+static bool No_speech = false;
+
+static double now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+static int compare_double(void const *a,void const *b){
+  double const x = *(double const *)a, y = *(double const *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Print the timings of 'calls' calls, each producing 'samples' samples,
+// with any extra fields
+static void report(char const *name,double *ns,int calls,int64_t samples,char const *extra){
+  double total = 0;
+  for(int i=0; i < calls; i++)
+    total += ns[i];
+  qsort(ns,calls,sizeof(*ns),compare_double);
+  double const p50 = ns[calls / 2];
+  double const p99 = ns[(calls * 99) / 100 < calls ? (calls * 99) / 100 : calls - 1];
+  double const audio = (double)calls * samples;
+  printf("{\"bench\":\"%s\",\"kernel\":\"%s\",\"samprate\":%d,\"calls\":%d,\"samples_per_call\":%lld,"
+	 "\"ns_per_sample\":%.6g,\"minutes_per_s\":%.6g,\"p50_ns\":%.0f,\"p99_ns\":%.0f%s%s}\n",
+	 name,osc_name(),Samprate,calls,(long long)samples,
+	 total / audio,audio / (60.0 * Samprate) / (total * 1e-9),p50,p99,
+	 extra != NULL ? "," : "",extra != NULL ? extra : "");
+  fflush(stdout);
+}
+
+static void bench_timecode(void){
+  int const calls = 100000;
+  double *ns = malloc(calls * sizeof(*ns));
+  uint8_t code[61];
+  for(int i=0; i < calls; i++){
+    double const t = now_ns();
+    maketimecode(code,(i % 15) - 7,i & 1,2025,1 + i % 12,1 + i % 28,i % 24,i % 60);
+    ns[i] = now_ns() - t;
+  }
+  report("maketimecode",ns,calls,60 * Samprate,NULL); // One per minute of audio
+  free(ns);
+}
+
+// A second of each primitive, as the templates use them
+static void bench_primitives(void){
+  int const calls = 2000;
+  double *ns = malloc(calls * sizeof(*ns));
+  float *buffer = calloc(Samprate,sizeof(*buffer));
+
+  for(int i=0; i < calls; i++){
+    double const t = now_ns();
+    overlay_tone(buffer,0,1000,1000,1.0);
+    ns[i] = now_ns() - t;
+  }
+  report("overlay_tone",ns,calls,Samprate,NULL);
+  for(int i=0; i < calls; i++){
+    double const t = now_ns();
+    add_tone(buffer,0,1000,100,0.5);
+    ns[i] = now_ns() - t;
+  }
+  report("add_tone",ns,calls,Samprate,NULL);
+  for(int i=0; i < calls; i++){
+    double const t = now_ns();
+    overlay_silence(buffer,0,1000);
+    ns[i] = now_ns() - t;
+  }
+  report("overlay_silence",ns,calls,Samprate,NULL);
+  free(buffer);
+  free(ns);
+}
+
+// Whole minutes in sequence from 2025-06-30 22:00, through the end of the
+// day's leap second, each minute rendered separately
+static void bench_minutes(char const *name,struct wwvsim_channel const *channel){
+  struct wwvsim_params params = { .dut1 = -5, .leap = 1, .leap_year = 2025, .leap_month = 6, .no_voice = true };
+  struct wwvsim *w = wwvsim_create(&params);
+  struct wwvsim_path path = { w, 1.0, 0, channel };
+  struct wwvsim_receiver *r = wwvsim_receiver_create(&path,1,false);
+  float *buffer = malloc(61 * Samprate * sizeof(*buffer));
+  double *ns = malloc(Minutes * sizeof(*ns));
+  int64_t t0 = wwvsim_utc(w,2025,6,30,22,0,0);
+  int64_t samples = 0;
+  for(int i=0; i < Minutes; i++){
+    int64_t const t1 = wwvsim_receiver_next_minute(r,t0);
+    double const t = now_ns();
+    if(wwvsim_receiver_render(r,buffer,t0,t1) != 0)
+      exit(1);
+    ns[i] = now_ns() - t;
+    samples += t1 - t0;
+    t0 = t1;
+  }
+  report(name,ns,Minutes,samples / Minutes,NULL);
+  free(ns);
+  free(buffer);
+  wwvsim_receiver_destroy(r);
+  wwvsim_destroy(w);
+}
+
+// Each backend: the first phrase after starting it, then more
+static void bench_speech(void){
+  for(int b=0; tts_backend(b) != NULL; b++){
+    char const *name = tts_backend(b);
+    char extra[200];
+    snprintf(extra,sizeof(extra),"\"backend\":\"%s\"",name);
+    double t = now_ns();
+    if(tts_init(name) != 0){
+      printf("{\"bench\":\"tts_cold\",%s,\"available\":false}\n",extra);
+      continue;
+    }
+    tts_start(false);
+    double ns[BENCH_PHRASES];
+    int64_t samples = 0;
+    int calls = 0;
+    for(int i=0; i <= BENCH_PHRASES; i++){
+      char text[100];
+      snprintf(text,sizeof(text),"At the tone, %d hours %d minutes Coordinated Universal Time",(7 * i) % 24,(13 * i) % 60);
+      if(i > 0)
+	t = now_ns();
+      int16_t *pcm = NULL;
+      int const n = tts_synthesize(text,false,&pcm);
+      double const elapsed = now_ns() - t;
+      free(pcm);
+      if(n <= 0)
+	break;
+      if(i == 0){
+	report("tts_cold",(double[]){ elapsed },1,n,extra);
+      } else {
+	ns[calls++] = elapsed;
+	samples += n;
+      }
+    }
+    if(calls > 0)
+      report("tts_warm",ns,calls,samples / calls,extra);
+    else
+      printf("{\"bench\":\"tts_warm\",%s,\"available\":false}\n",extra);
+  }
+}
+
+// Minutes with a fixed outcome: no speech, fixed seeds, 48 kHz
+struct scenario {
+  char const *name;
+  struct wwvsim_params params;
+  bool channel;
+};
+static struct scenario const Scenarios[] = {
+  { "wwv-leap", { .dut1 = -5, .leap = 1, .leap_year = 2025, .leap_month = 6, .no_voice = true }, false },
+  { "wwvh-moderate", { .wwvh = true, .dut1 = 3, .no_voice = true }, true },
+};
+#define GOLDEN_MINUTES 4 // From 2025-06-30 23:57
+
+// Recorded checksums of the s16 output, which depend on the tone kernel
+// Kernels not listed are reported but not checked
+static struct {
+  char const *kernel;
+  char const *scenario;
+  uint64_t sums[GOLDEN_MINUTES];
+} const Golden[] = {
+  { "avx2", "wwv-leap",
+    { 0x5d76cb615834eba9ULL, 0x42801a58c18e87cfULL, 0x62c4a1d93af8d484ULL, 0x878530e02c99b465ULL } },
+  { "avx2", "wwvh-moderate",
+    { 0x6662a4b2bbe6e2c2ULL, 0xce31bc726d0c16e7ULL, 0x78abfbd93049a266ULL, 0x368a7ca53d08db1aULL } },
+  { "scalar", "wwv-leap",
+    { 0x4cc8afc32084d3f5ULL, 0xf0b0c7d58be25689ULL, 0xb9dc02c1e2cd5506ULL, 0x7bc6ea9bf0346dcaULL } },
+  { "scalar", "wwvh-moderate",
+    { 0xbcdecf1ec2654596ULL, 0xc6168d5c2f992d88ULL, 0x157d8b811367dcb7ULL, 0x1b498051533e8e55ULL } },
+};
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(void const *data,size_t len,uint64_t h){
+  uint8_t const *p = data;
+  for(size_t i=0; i < len; i++){
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Return the number of mismatches
+static int check_golden(void){
+  if(Samprate != 48000){
+    fprintf(stderr,"Checksums are recorded at 48000 Hz only\n");
+    return 0;
+  }
+  struct wwvsim_channel const channel = { .spread_ms = 1, .doppler_hz = 0.5, .noise = true, .snr_db = 30, .qrn_rate = 1, .qrn_db = 6, .seed = 1 };
+  float *buffer = malloc(61 * Samprate * sizeof(*buffer));
+  int16_t *pcm = malloc(61 * Samprate * sizeof(*pcm));
+  int mismatches = 0;
+  for(size_t s=0; s < sizeof(Scenarios)/sizeof(Scenarios[0]); s++){
+    struct scenario const *sc = &Scenarios[s];
+    struct wwvsim *w = wwvsim_create(&sc->params);
+    struct wwvsim_path path = { w, 1.0, 0, sc->channel ? &channel : NULL };
+    struct wwvsim_receiver *r = wwvsim_receiver_create(&path,1,false);
+    uint64_t const *golden = NULL;
+    for(size_t g=0; g < sizeof(Golden)/sizeof(Golden[0]); g++){
+      if(strcmp(Golden[g].kernel,osc_name()) == 0 && strcmp(Golden[g].scenario,sc->name) == 0)
+	golden = Golden[g].sums;
+    }
+    int64_t t0 = wwvsim_utc(w,2025,6,30,23,57,0);
+    for(int m=0; m < GOLDEN_MINUTES; m++){
+      int64_t const t1 = wwvsim_receiver_next_minute(r,t0);
+      if(wwvsim_receiver_render(r,buffer,t0,t1) != 0)
+	exit(1);
+      wwvsim_quantize(pcm,WWVSIM_FORMAT_S16,true,buffer,t1 - t0,t0);
+      uint64_t const sum = fnv1a(pcm,(t1 - t0) * sizeof(*pcm),0xcbf29ce484222325ULL);
+      char const *result = golden == NULL ? "none" : golden[m] == sum ? "ok" : "mismatch";
+      if(golden != NULL && golden[m] != sum)
+	mismatches++;
+      printf("{\"checksum\":\"%s\",\"kernel\":\"%s\",\"minute\":%d,\"samples\":%lld,\"fnv1a\":\"%016llx\",\"golden\":\"%s\"}\n",
+	     sc->name,osc_name(),m,(long long)(t1 - t0),(unsigned long long)sum,result);
+      t0 = t1;
+    }
+    wwvsim_receiver_destroy(r);
+    wwvsim_destroy(w);
+  }
+  free(buffer);
+  free(pcm);
+  return mismatches;
+}
+
+int main(int argc,char *argv[]){
+  struct wwvsim_setup setup = { .no_voice = true };
+  int c;
+  while((c = getopt(argc,argv,"r:m:S")) != EOF){
+    switch(c){
+    case 'r':
+      setup.samprate = strtol(optarg,NULL,0);
+      break;
+    case 'm':
+      Minutes = strtol(optarg,NULL,0);
+      break;
+    case 'S':
+      No_speech = true;
+      break;
+    default:
+      fprintf(stderr,"Usage: %s [-r samprate] [-m minutes to time] [-S (skip speech)]\n",argv[0]);
+      exit(1);
+    }
+  }
+  if(Minutes < 1)
+    Minutes = 1;
+  // Speech is timed through the synthesizers directly, without the caches
+  if(wwvsim_init(&setup) != 0)
+    exit(1);
+
+  bench_timecode();
+  bench_primitives();
+  bench_minutes("minute",NULL);
+  struct wwvsim_channel const channel = { .spread_ms = 1, .doppler_hz = 0.5, .noise = true, .snr_db = 20, .seed = 1 };
+  bench_minutes("minute_channel",&channel);
+  if(!No_speech)
+    bench_speech();
+  int const mismatches = check_golden();
+  exit(mismatches == 0 ? 0 : 1);
+}
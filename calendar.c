@@ -0,0 +1,169 @@
+// Broadcast calendar for wwvsim
+// Finds the minute of the broadcast containing any instant in constant
+// time: its date, its length with any leap second, DUT1 and the leap second
+// warning. Instants are broadcast sample numbers, counted from
+// 1970-01-01 00:00:00 UTC at Samprate and including the configured leap
+// second, if any. Earlier leap seconds are ignored, as in UNIX time.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "wwvsim.h"
+
+// Applies only to non-leap years; you need special tests for February in leap year
+int const Days_in_month[] = { // Index 1 = January, 12 = December
+  0,31,28,31,30,31,30,31,31,30,31,30,31
+};
+
+// Days in the year before the first of each month, non-leap years
+static int const Days_before_month[] = { // Index 1 = January, 12 = December
+  0,0,31,59,90,120,151,181,212,243,273,304,334
+};
+
+/* Determine day of year when daylight savings time starts
+   Only US rules are needed, since WWV/WWVH are American stations
+   US rules last changed in 2007 to 2nd sunday of March to first sunday in November
+   Always lasts for 238 days (34 weeks)
+   Pattern repeats every 28 years (7 days in week x 4 years in leap year cycle)
+   Hopefully DST will be abolished before long!
+                                          2007: 3/11 (70)    2008: 3/9  (69)
+   2009: 3/8  (67)     2010: 3/14 (73)    2011: 3/13 (72)    2012: 3/11 (71)
+   2013: 3/10 (69)     2014: 3/9  (68)    2015: 3/8  (67)    2016: 3/13 (73)
+   2017: 3/12 (71)     2018: 3/11 (70)    2019: 3/10 (69)    2020: 3/8  (68)
+   2021: 3/14 (73)     2022: 3/13 (72)    2023: 3/12 (71)    2024: 3/10 (70)
+   2025: 3/9  (68)     2026: 3/8  (67)    2027: 3/14 (73)    2028: 3/12 (72)
+   2029: 3/11 (70)     2030: 3/10 (69)    2031: 3/9  (68)    2032: 3/14 (74)
+
+   2033: 3/13 (72)     2034: 3/12 (71)    2035: 3/11 (70)    2036: 3/9  (69)
+   2037: 3/8  (67)     2038: 3/14 (73)    2039: 3/13 (72)    2040: 3/11 (71)
+   2041: 3/10 (69)     2042: 3/9  (68)    2043: 3/8  (67)    2044: 3/13 (73)
+   2045: 3/12 (71)     2046: 3/11 (70)    2047: 3/10 (69)    2048: 3/8  (68)
+   2049: 3/14 (73)     2050: 3/13 (72)    2051: 3/12 (71)    2052: 3/10 (70)
+   2053: 3/9  (68)     2054: 3/8  (67)    2055: 3/14 (73)    2056: 3/12 (72)
+   2057: 3/11 (70)     2058: 3/10 (69)    2059: 3/9  (68)    2060: 3/14 (74)
+*/
+// Day DST starts, as above, for 2007-2099
+#define DST_FIRST_YEAR 2007
+static uint8_t const Dst_start[] = {
+  70,69,67,73,72,71,69,68,67,73,  // 2007
+  71,70,69,68,73,72,71,70,68,67,  // 2017
+  73,72,70,69,68,74,72,71,70,69,  // 2027
+  67,73,72,71,69,68,67,73,71,70,  // 2037
+  69,68,73,72,71,70,68,67,73,72,  // 2047
+  70,69,68,74,72,71,70,69,67,73,  // 2057
+  72,71,69,68,67,73,71,70,69,68,  // 2067
+  73,72,71,70,68,67,73,72,70,69,  // 2077
+  68,74,72,71,70,69,67,73,72,71,  // 2087
+  69,68,67,                       // 2097
+};
+#define DST_LAST_YEAR (DST_FIRST_YEAR + (int)sizeof(Dst_start) - 1)
+
+// Is specified year a leap year?
+bool is_leap_year(int y){
+  if((y % 4) != 0)
+    return false; // Ordinary year; example: 2017
+  if((y % 100) != 0)
+    return true; // Examples: 1956, 2004 (i.e., most leap years)
+  if((y % 400) != 0)
+    return false; // Examples: 1900, 2100 (the big exception to the usual rule; non-leap US presidential election years)
+  return true; // Example: 2000 (the exception to the exception)
+}
+
+// Day of year DST starts, or -1 if the 2007 rules don't cover 'year'
+// Years past the table are worked out a year at a time from 2005
+int dst_start_doy(int year){
+  if(year < DST_FIRST_YEAR)
+    return -1;
+  if(year <= DST_LAST_YEAR)
+    return Dst_start[year - DST_FIRST_YEAR];
+  int r = 72;  // DST would have started on day 72 in year 2005 if rule had been in effect then
+  for(int ytmp = 2005; ytmp < year; ytmp++){
+    r -= 1 + is_leap_year(ytmp);
+    if(r < 67) // Never before day 67
+      r += 7;
+  }
+  if(r == 67 && is_leap_year(year)) // day 67 is 1st sunday in march
+    r += 7;
+  return r;
+}
+
+int day_of_year(int year,int month,int day){
+  // don't use doy in tm struct in case date was manually overridden
+  // (Bug found and reported by Jayson Smith jaybird@bluegrasspals.com)
+  return Days_before_month[month] + day + (month > 2 && is_leap_year(year));
+}
+
+// Set up a broadcast for 'wwvh' or WWV with UT1 - UTC 'dut1' tenths of a second.
+// 'leap' is +1 or -1 for a leap second at the end of the first June or December
+// on or after 'year'/'month', after which DUT1 steps by 'leap' seconds; 0 for none
+void broadcast_init(struct broadcast *b,bool wwvh,int dut1,int leap,int year,int month){
+  b->wwvh = wwvh;
+  b->dut1 = dut1;
+  b->leap = leap;
+  b->leap_minute = 0;
+  if(leap != 0){
+    struct tm tm = {
+      .tm_year = year - 1900, .tm_mon = month <= 6 ? 5 : 11, .tm_mday = month <= 6 ? 30 : 31,
+      .tm_hour = 23, .tm_min = 59,
+    };
+    b->leap_minute = timegm(&tm);
+  }
+}
+
+// Broadcast sample number at UNIX time 't'
+int64_t broadcast_sample(struct broadcast const *b,time_t t){
+  int64_t n = (int64_t)t * Samprate;
+  if(b->leap != 0 && t >= b->leap_minute + 60)
+    n += (int64_t)b->leap * Samprate;
+  return n;
+}
+
+// Broadcast sample number at a UTC time; 'second' may be 60 during a positive leap second
+int64_t broadcast_utc(struct broadcast const *b,int year,int month,int day,int hour,int minute,int second){
+  struct tm tm = {
+    .tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day,
+    .tm_hour = hour, .tm_min = minute, .tm_sec = second < 60 ? second : 59,
+  };
+  int64_t n = broadcast_sample(b,timegm(&tm));
+  if(second >= 60)
+    n += Samprate;
+  return n;
+}
+
+static int64_t floor_div(int64_t a,int64_t b){
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Describe the minute containing broadcast sample 'n'
+void broadcast_minute(struct broadcast const *b,int64_t n,struct minute_state *m){
+  int64_t const minute = 60LL * Samprate;
+  int64_t const leap_start = (int64_t)b->leap_minute * Samprate;
+
+  m->length = 60;
+  if(b->leap == 0 || n < leap_start){
+    int64_t const k = floor_div(n,minute);
+    m->start = k * 60;
+    m->sample = k * minute;
+  } else if(n < leap_start + (60 + b->leap) * Samprate){
+    m->start = b->leap_minute;
+    m->sample = leap_start;
+    m->length = 60 + b->leap; // This minute ends with a leap second!
+  } else {
+    int64_t const k = floor_div(n - b->leap * Samprate,minute);
+    m->start = k * 60;
+    m->sample = k * minute + b->leap * Samprate;
+  }
+  struct tm tm;
+  gmtime_r(&m->start,&tm);
+  m->year = tm.tm_year + 1900;
+  m->month = tm.tm_mon + 1;
+  m->day = tm.tm_mday;
+  m->hour = tm.tm_hour;
+  m->minute = tm.tm_min;
+  m->wwvh = b->wwvh;
+
+  bool const before = b->leap == 0 || m->start <= b->leap_minute;
+  m->leap_pending = b->leap != 0 && before;
+  m->dut1 = before ? b->dut1 : b->dut1 + 10 * b->leap;
+}
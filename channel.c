@@ -0,0 +1,280 @@
+// HF channel simulator for wwvsim
+// Watterson's model: the signal arrives over one or two rays, each a
+// complex tap with Rayleigh fading and a Gaussian Doppler spectrum, the
+// second delayed by the spread. Here the AM signal passes through the rays
+// at complex baseband, picks up Gaussian noise and impulsive static (QRN),
+// and is envelope detected. The carrier is taken out, as by a receiver's
+// DC block, and an AGC brings the carrier averaged over the last CH_AGC_MS
+// back to its unfaded level, up to CH_MAX_GAIN; fading faster than that
+// comes through, as does the noise in a deep fade.
+// Like the dither, everything depends only on the seed and each sample's
+// position in time: each ray is a sum of sinusoids at seeded random Doppler
+// frequencies, and the noise comes from hashing the sample number. So an
+// interval comes out the same whenever, and on whatever thread, it's rendered.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "wwvsim.h"
+
+#define CH_SINES 16        // Sinusoids per ray
+#define CH_STEP 32         // Samples between evaluations of the rays, interpolated in between
+#define CH_CHUNK 4096      // Samples per pass, a multiple of CH_STEP
+// Grid points for a chunk and the AGC's look back, at the highest sample rate
+#define CH_MAX_POINTS ((CH_AGC_MS * (MAX_SAMPRATE / 1000) + CH_STEP - 1) / CH_STEP + CH_CHUNK / CH_STEP + 2)
+#define CH_MAX_GAIN 31.6f  // AGC limit, 30 dB
+#define CH_AGC_MS 50       // AGC averaging time
+#define CH_NOISE_BW 3000   // Bandwidth for the signal to noise ratio, Hz
+#define CH_QRN_SLOT_MS 10  // At most one static crash starts in each slot
+#define CH_QRN_DECAY_MS 1  // Time constant of a crash
+#define CH_QRN_LENGTH 5    // Crash length in time constants, less than a slot
+
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+// Clamp negative lanes to zero
+static inline v4sf positive(v4sf x){
+  v4sf const zero = {0,0,0,0};
+  return (v4sf)((v4si)x & (x > zero));
+}
+
+struct ray {
+  double freq[CH_SINES];   // Hz
+  double phase[CH_SINES];  // Cycles
+  float amp;
+};
+
+struct channel {
+  int rays;
+  int delay;               // Samples between the rays
+  bool fading;
+  struct ray ray[2];
+  float sigma;             // Noise standard deviation in each of I and Q, 0 for none
+  double qrn_prob;         // Chance of a crash in a slot
+  float qrn_amp;           // Peak crash amplitude
+  int qrn_slot, qrn_decay, qrn_length; // Samples
+  uint64_t noise_key, qrn_key;
+  int agc_points;          // Grid points averaged by the AGC, less one
+};
+
+// Uniform on (0,1) from a key and an index
+static double uniform(uint64_t key,uint64_t n){
+  return ((mix64(key ^ mix64(n)) >> 11) + 0.5) * 0x1p-53;
+}
+
+// Pair of independent unit normals from a key and an index (Box-Muller)
+static inline void normal2(uint64_t key,uint64_t n,float *a,float *b){
+  uint64_t const r = mix64(key ^ mix64(n));
+  float const u1 = ((uint32_t)r + 0.5f) * 0x1p-32f;
+  float const u2 = (uint32_t)(r >> 32) * 0x1p-32f;
+  float const m = sqrtf(-2 * logf(u1));
+  float const phi = 2 * (float)M_PI * u2;
+  *a = m * cosf(phi);
+  *b = m * sinf(phi);
+}
+
+struct channel *channel_create(struct wwvsim_channel const *spec,uint64_t salt){
+  if(!(spec->spread_ms >= 0 && spec->spread_ms <= 10) || !(spec->doppler_hz >= 0 && spec->doppler_hz <= 50)){
+    fprintf(stderr,"Channel spread %g ms or Doppler %g Hz out of range 0-10 ms, 0-50 Hz\n",spec->spread_ms,spec->doppler_hz);
+    return NULL;
+  }
+  if(spec->qrn_rate < 0 || spec->qrn_rate > 1000 / CH_QRN_SLOT_MS){
+    fprintf(stderr,"QRN rate %g out of range 0-%d per second\n",spec->qrn_rate,1000 / CH_QRN_SLOT_MS);
+    return NULL;
+  }
+  struct channel *ch = calloc(1,sizeof(*ch));
+  if(ch == NULL)
+    return NULL;
+  uint64_t const key = mix64(spec->seed ^ mix64(salt));
+  ch->delay = lrint(spec->spread_ms * Samprate / 1000);
+  ch->rays = ch->delay > 0 ? 2 : 1;
+  ch->fading = spec->doppler_hz > 0;
+  // Each ray's spectrum is Gaussian with a two-sided spread of twice its standard deviation
+  for(int r=0; r < ch->rays; r++){
+    struct ray *ray = &ch->ray[r];
+    ray->amp = ch->fading ? sqrt(1.0 / (CH_SINES * ch->rays)) : sqrt(1.0 / ch->rays);
+    for(int k=0; k < CH_SINES; k++){
+      uint64_t const n = 2 * (r * CH_SINES + k);
+      double const g = sqrt(-2 * log(uniform(key,n))) * cos(2 * M_PI * uniform(key,n+1));
+      ray->freq[k] = g * spec->doppler_hz / 2;
+      ray->phase[k] = uniform(key ^ 1,n);
+    }
+  }
+  if(spec->noise){
+    // Carrier power is 1, less fading
+    double const power = pow(10.,-spec->snr_db / 10) * Samprate / CH_NOISE_BW;
+    ch->sigma = sqrt(power / 2);
+  }
+  ch->qrn_slot = ms_samples(CH_QRN_SLOT_MS);
+  ch->qrn_decay = ms_samples(CH_QRN_DECAY_MS);
+  ch->qrn_length = CH_QRN_LENGTH * ch->qrn_decay;
+  ch->qrn_prob = spec->qrn_rate * CH_QRN_SLOT_MS / 1000;
+  ch->qrn_amp = pow(10.,spec->qrn_db / 20);
+  ch->agc_points = (ms_samples(CH_AGC_MS) + CH_STEP - 1) / CH_STEP;
+  ch->noise_key = mix64(key ^ 2);
+  ch->qrn_key = mix64(key ^ 3);
+  return ch;
+}
+
+void channel_destroy(struct channel *ch){
+  free(ch);
+}
+
+// Input samples needed before each output sample
+int channel_lead(struct channel const *ch){
+  return ch->rays > 1 ? ch->delay : 0;
+}
+
+// Tap of one ray at grid point 'k', CH_STEP samples apart
+static void ray_tap(struct ray const *ray,bool fading,int64_t k,float *re,float *im){
+  if(!fading){
+    *re = ray->amp;
+    *im = 0;
+    return;
+  }
+  double const t = (double)k * CH_STEP / Samprate;
+  double sr = 0, si = 0;
+  for(int i=0; i < CH_SINES; i++){
+    double const cycles = ray->freq[i] * t;
+    double const phi = 2 * M_PI * (cycles - floor(cycles) + ray->phase[i]);
+    sr += cos(phi);
+    si += sin(phi);
+  }
+  *re = sr * ray->amp;
+  *im = si * ray->amp;
+}
+
+// Add the static crashes falling in samples [position,position+n) to the noise
+static void add_qrn(struct channel const *ch,float *ni,float *nq,int n,int64_t position){
+  if(ch->qrn_prob <= 0)
+    return;
+  // A crash starting in the previous slot may run into this one
+  int64_t const first = (position - ch->qrn_length) / ch->qrn_slot;
+  int64_t const last = (position + n - 1) / ch->qrn_slot;
+  for(int64_t slot = first; slot <= last; slot++){
+    if(uniform(ch->qrn_key,3*slot) >= ch->qrn_prob)
+      continue;
+    // Random start within the slot; peak from 20 dB below the set level up to it
+    int64_t const start = slot * ch->qrn_slot + (int64_t)(uniform(ch->qrn_key,3*slot+1) * ch->qrn_slot);
+    float const amp = ch->qrn_amp * powf(10.f,-uniform(ch->qrn_key,3*slot+2));
+    int64_t const a = start > position ? start : position;
+    int64_t const b = start + ch->qrn_length < position + n ? start + ch->qrn_length : position + n;
+    for(int64_t s = a; s < b; s++){
+      float i, q;
+      normal2(ch->qrn_key ^ 4,s,&i,&q);
+      float const env = amp * expf(-(float)(s - start) / ch->qrn_decay);
+      ni[s - position] += env * i;
+      nq[s - position] += env * q;
+    }
+  }
+}
+
+// Pass 'n' samples of audio 'in', broadcast sample number 'position' onward,
+// through the channel into 'out'. in[-channel_lead()] onward must be valid
+void channel_apply(struct channel const *ch,float *out,float const *in,int n,int64_t position){
+  float gr[2][CH_CHUNK], gi[2][CH_CHUNK]; // Ray taps at each sample
+  float ni[CH_CHUNK], nq[CH_CHUNK];       // Noise
+  float agc[CH_CHUNK];                    // Receiver gain
+  float const *delayed = in - ch->delay;
+
+  // Grid points for a chunk, and the AGC's look back
+  float grid_re[2][CH_MAX_POINTS], grid_im[2][CH_MAX_POINTS], gain[CH_MAX_POINTS];
+  float *re[2] = { grid_re[0], grid_re[1] };
+  float *im[2] = { grid_im[0], grid_im[1] };
+
+  for(int start = 0; start < n; start += CH_CHUNK){
+    int const m = n - start < CH_CHUNK ? n - start : CH_CHUNK;
+    int64_t const p = position + start;
+
+    // Taps on a fixed grid of sample numbers, linearly interpolated
+    // The AGC holds the carrier averaged over the preceding CH_AGC_MS at full scale
+    int64_t const k0 = p / CH_STEP - ch->agc_points;
+    int const points = (p + m - 1) / CH_STEP + 2 - k0;
+    for(int r=0; r < ch->rays; r++){
+      for(int k=0; k < points; k++)
+	ray_tap(&ch->ray[r],ch->fading,k0 + k,&re[r][k],&im[r][k]);
+    }
+    float *carrier = gain; // Magnitudes first, then each gain in place once it's past its window
+    for(int k=0; k < points; k++){
+      float cr = re[0][k], ci = im[0][k];
+      if(ch->rays > 1){
+	cr += re[1][k];
+	ci += im[1][k];
+      }
+      carrier[k] = sqrtf(cr * cr + ci * ci);
+    }
+    // Summed the same way wherever the chunk starts, so results don't depend on buffering
+    for(int k=points-1; k >= ch->agc_points; k--){
+      float sum = 0;
+      for(int j = k - ch->agc_points; j <= k; j++)
+	sum += carrier[j];
+      float const mean = sum / (ch->agc_points + 1);
+      gain[k] = mean * CH_MAX_GAIN > 1 ? 1 / mean : CH_MAX_GAIN;
+    }
+    for(int i=0; i < m; i++){
+      int64_t const s = p + i;
+      int const k = s / CH_STEP - k0;
+      float const f = (float)(s % CH_STEP) / CH_STEP;
+      for(int r=0; r < ch->rays; r++){
+	gr[r][i] = re[r][k] + f * (re[r][k+1] - re[r][k]);
+	gi[r][i] = im[r][k] + f * (im[r][k+1] - im[r][k]);
+      }
+      agc[i] = gain[k] + f * (gain[k+1] - gain[k]);
+    }
+    if(ch->sigma > 0){
+      for(int i=0; i < m; i++){
+	normal2(ch->noise_key,p + i,&ni[i],&nq[i]);
+	ni[i] *= ch->sigma;
+	nq[i] *= ch->sigma;
+      }
+    } else {
+      memset(ni,0,m * sizeof(*ni));
+      memset(nq,0,m * sizeof(*nq));
+    }
+    add_qrn(ch,ni,nq,m,p);
+
+    // Rays plus noise, envelope detected, less the carrier, times the AGC gain
+    float const *x0 = in + start;
+    float const *x1 = delayed + start;
+    float *o = out + start;
+    v4sf const one = {1,1,1,1};
+    int i = 0;
+    for(; i + 4 <= m; i += 4){
+      v4sf const a0 = positive(one + load4(x0 + i)); // Overmodulation cuts off the carrier
+      v4sf yr = load4(gr[0] + i) * a0 + load4(ni + i);
+      v4sf yi = load4(gi[0] + i) * a0 + load4(nq + i);
+      v4sf cr = load4(gr[0] + i);
+      v4sf ci = load4(gi[0] + i);
+      if(ch->rays > 1){
+	v4sf const a1 = positive(one + load4(x1 + i));
+	yr += load4(gr[1] + i) * a1;
+	yi += load4(gi[1] + i) * a1;
+	cr += load4(gr[1] + i);
+	ci += load4(gi[1] + i);
+      }
+      v4sf const y2 = yr * yr + yi * yi;
+      v4sf const c2 = cr * cr + ci * ci;
+      v4sf v;
+      for(int l=0; l < 4; l++)
+	v[l] = sqrtf(y2[l]) - sqrtf(c2[l]);
+      store4(o + i,v * load4(agc + i));
+    }
+    for(; i < m; i++){
+      float a0 = 1 + x0[i];
+      a0 = a0 < 0 ? 0 : a0;
+      float yr = gr[0][i] * a0 + ni[i], yi = gi[0][i] * a0 + nq[i];
+      float cr = gr[0][i], ci = gi[0][i];
+      if(ch->rays > 1){
+	float a1 = 1 + x1[i];
+	a1 = a1 < 0 ? 0 : a1;
+	yr += gr[1][i] * a1;
+	yi += gi[1][i] * a1;
+	cr += gr[1][i];
+	ci += gi[1][i];
+      }
+      o[i] = (sqrtf(yr * yr + yi * yi) - sqrtf(cr * cr + ci * ci)) * agc[i];
+    }
+  }
+}
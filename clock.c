@@ -0,0 +1,333 @@
+// Output clock discipline
+// A sound card plays at its own crystal's idea of the sample rate, off by
+// tens of ppm and wandering with temperature, so a stream started on time
+// drifts away from UTC by seconds a day. The output thread measures when the
+// sample it just handed the card will be heard, by the system clock, and
+// compares that with when it should be; a phase-locked loop turns the error
+// into a rate for a variable-ratio resampler between the renderer and the
+// output ring. The resampler plays the audio slightly faster or slower
+// rather than dropping or repeating samples. Only a gross error, as when the
+// system clock is stepped, is corrected by jumping.
+// The same resampler starts the output at any fraction of a sample, so
+// the stream can begin exactly on time rather than to the nearest sample.
+// The resampler is a windowed-sinc interpolator with CD_PHASES tabulated
+// fractional positions, linearly interpolated between.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+#define CD_HALF 16         // Interpolator half-width, samples
+#define CD_PHASES 256      // Tabulated fractional positions
+#define CD_CUTOFF 0.92     // Fraction of the Nyquist rate passed
+#define CD_BETA 8.0        // Kaiser window parameter, ~80 dB stopband
+#define CD_MAX_SLEW 500e-6 // Largest rate correction
+#define CD_STEP 0.5        // Seconds of error corrected by jumping
+#define CD_TC_MIN 10.0     // Loop time constant at first, seconds
+#define CD_TC_MAX 300.0    // and after settling in
+#define CD_DAMPING 0.7
+#define CD_REPORT 60       // Seconds between reports with -v
+
+struct clock_discipline {
+  int channels;
+  int rate;                // Frames per second
+
+  // Producer side
+  float *fifo;             // Interleaved input frames
+  int fifo_len;            // Frames
+  int max_frames;          // Most clock_resample() takes at once
+  int64_t base;            // Input frame number of fifo[0]
+  double pos;              // Index into 'fifo' of the next output frame
+  int64_t produced;        // Output frames ever
+
+  // Shared, under 'mutex'
+  pthread_mutex_t mutex;
+  double ratio;            // Input frames per output frame
+  int64_t snap_frame;      // Output frame 'snap_in' belongs to
+  double snap_in;          // Its input position
+  int64_t valid_from;      // Output frames before a jump are measured no more
+  int64_t step;            // Input frames to jump, waiting for the producer
+
+  // Loop, in the output thread
+  bool locked;             // Has a measurement
+  bool relative;           // Hold the first offset rather than zero
+  bool steer;              // Or just measure
+  double reference;        // Offset held, seconds
+  double integral;         // Frequency correction
+  double start;            // Time of the first measurement
+  double last;             // and the latest
+  double reported;
+
+  float taps[CD_PHASES + 1][2*CD_HALF];
+};
+
+// 'max_frames' is the most input frames any clock_resample() call will pass
+struct clock_discipline *clock_create(int channels,int rate,int max_frames,bool relative,bool steer){
+  struct clock_discipline *c = calloc(1,sizeof(*c));
+  if(c == NULL)
+    return NULL;
+  // Between calls the FIFO holds less than 2*CD_HALF frames of history, so
+  // this is all it ever needs; nothing is allocated once running
+  c->fifo = malloc((max_frames + 2 * CD_HALF) * channels * sizeof(*c->fifo));
+  if(c->fifo == NULL){
+    free(c);
+    return NULL;
+  }
+  c->max_frames = max_frames;
+  c->channels = channels;
+  c->rate = rate;
+  c->relative = relative;
+  c->steer = steer;
+  c->ratio = 1;
+  pthread_mutex_init(&c->mutex,NULL);
+
+  // Phase p interpolates p/CD_PHASES of the way from fifo[i] to fifo[i+1];
+  // tap k weights fifo[i - CD_HALF + 1 + k]
+  double const norm = bessel_i0(CD_BETA);
+  for(int p=0; p <= CD_PHASES; p++){
+    double const frac = (double)p / CD_PHASES;
+    double sum = 0;
+    double taps[2*CD_HALF];
+    for(int k=0; k < 2*CD_HALF; k++){
+      double const d = k - CD_HALF + 1 - frac;
+      double const r = d / CD_HALF;
+      double const window = fabs(r) < 1 ? bessel_i0(CD_BETA * sqrt(1 - r*r)) / norm : 0;
+      double const arg = M_PI * CD_CUTOFF * d;
+      taps[k] = window * (d == 0 ? 1.0 : sin(arg)/arg);
+      sum += taps[k];
+    }
+    for(int k=0; k < 2*CD_HALF; k++)
+      c->taps[p][k] = taps[k] / sum;
+  }
+  return c;
+}
+
+void clock_destroy(struct clock_discipline *c){
+  if(c == NULL)
+    return;
+  pthread_mutex_destroy(&c->mutex);
+  free(c->fifo);
+  free(c);
+}
+
+// Start afresh, after silence: input resumes at frame 'position', and
+// output frame 'frame' onward follows from 'offset' (0 <= offset) frames later
+void clock_reset(struct clock_discipline *c,int64_t frame,int64_t position,double offset){
+  c->fifo_len = CD_HALF - 1;
+  memset(c->fifo,0,c->fifo_len * c->channels * sizeof(*c->fifo));
+  c->base = position - c->fifo_len;
+  c->pos = c->fifo_len + offset;
+  c->produced = frame;
+  pthread_mutex_lock(&c->mutex);
+  c->snap_frame = frame;
+  c->snap_in = position + offset;
+  c->valid_from = frame;
+  pthread_mutex_unlock(&c->mutex);
+}
+
+// Input frames to jump ahead (or back) before the next clock_resample(), or 0
+int64_t clock_step(struct clock_discipline *c){
+  pthread_mutex_lock(&c->mutex);
+  int64_t const step = c->step;
+  c->step = 0;
+  pthread_mutex_unlock(&c->mutex);
+  return step;
+}
+
+// Take 'n' interleaved input frames, following on from the last, and write
+// what they make at the current rate to 'out', which has room for
+// n * (1 + CD_MAX_SLEW) + 2 frames. Return the number of frames written.
+// Frames past 'max_frames' are ignored
+int clock_resample(struct clock_discipline *c,float *out,float const *in,int n){
+  int const channels = c->channels;
+  if(n > c->max_frames)
+    n = c->max_frames;
+  memcpy(c->fifo + c->fifo_len * channels,in,n * channels * sizeof(*in));
+  c->fifo_len += n;
+
+  pthread_mutex_lock(&c->mutex);
+  double const ratio = c->ratio;
+  pthread_mutex_unlock(&c->mutex);
+
+  int produced = 0;
+  while(1){
+    int const i = floor(c->pos);
+    if(i + CD_HALF >= c->fifo_len)
+      break;
+    double const x = (c->pos - i) * CD_PHASES;
+    int const p = x;
+    float const f = x - p;
+    float taps[2*CD_HALF];
+    for(int k=0; k < 2*CD_HALF; k += 4){
+      v4sf const t0 = load4(&c->taps[p][k]);
+      store4(taps + k,t0 + f * (load4(&c->taps[p+1][k]) - t0));
+    }
+    float const *src = c->fifo + (i - CD_HALF + 1) * channels;
+    for(int ch=0; ch < channels; ch++){
+      float acc = 0;
+      for(int k=0; k < 2*CD_HALF; k++)
+	acc += taps[k] * src[k * channels + ch];
+      out[produced * channels + ch] = acc;
+    }
+    produced++;
+    c->pos += ratio;
+  }
+  c->produced += produced;
+
+  // Keep only the history the next output frame needs
+  int const drop = (int)floor(c->pos) - CD_HALF + 1;
+  if(drop > 0){
+    memmove(c->fifo,c->fifo + drop * channels,(c->fifo_len - drop) * channels * sizeof(*c->fifo));
+    c->fifo_len -= drop;
+    c->pos -= drop;
+    c->base += drop;
+  }
+  pthread_mutex_lock(&c->mutex);
+  c->snap_frame = c->produced;
+  c->snap_in = c->base + c->pos;
+  pthread_mutex_unlock(&c->mutex);
+  return produced;
+}
+
+// Output frame 'frame' will be heard at system time 'now' (seconds), when
+// input frame 'expected' should be. Update the rate
+void clock_measure(struct clock_discipline *c,int64_t frame,double expected,double now){
+  pthread_mutex_lock(&c->mutex);
+  if(frame < c->valid_from){
+    pthread_mutex_unlock(&c->mutex);
+    return;
+  }
+  // Input position of 'frame', close enough with the rate now in use
+  double const actual = c->snap_in - (c->snap_frame - frame) * c->ratio;
+  pthread_mutex_unlock(&c->mutex);
+
+  // Positive when the audio is early
+  double offset = (actual - expected) / c->rate;
+  if(!c->locked){
+    c->locked = true;
+    c->start = c->last = c->reported = now;
+    c->reference = c->relative ? offset : 0;
+  }
+  offset -= c->reference;
+  if(!c->steer){
+    atomic_store(&Stats.clock_offset_us,lrint(offset * 1e6));
+    return;
+  }
+  if(fabs(offset) > CD_STEP){
+    // Too far to slew; jump, and keep the frequency
+    int64_t const step = llrint(-offset * c->rate);
+    fprintf(stderr,"Output clock off by %.3f s, stepping\n",offset);
+    pthread_mutex_lock(&c->mutex);
+    c->step += step;
+    c->valid_from = INT64_MAX; // Until the jump is taken
+    pthread_mutex_unlock(&c->mutex);
+    c->last = now;
+    return;
+  }
+  double const dt = now - c->last;
+  c->last = now;
+
+  // Second order loop, tightening as it settles
+  double tc = CD_TC_MIN + (now - c->start) / 4;
+  if(tc > CD_TC_MAX)
+    tc = CD_TC_MAX;
+  double const wn = 1 / tc;
+  double integral = c->integral - wn * wn * offset * dt;
+  if(integral > CD_MAX_SLEW)
+    integral = CD_MAX_SLEW;
+  else if(integral < -CD_MAX_SLEW)
+    integral = -CD_MAX_SLEW;
+  c->integral = integral;
+  double correction = integral - 2 * CD_DAMPING * wn * offset;
+  if(correction > CD_MAX_SLEW)
+    correction = CD_MAX_SLEW;
+  else if(correction < -CD_MAX_SLEW)
+    correction = -CD_MAX_SLEW;
+
+  pthread_mutex_lock(&c->mutex);
+  c->ratio = 1 + correction;
+  pthread_mutex_unlock(&c->mutex);
+
+  // The card runs fast by as much as the input has to be slowed down
+  double const ppm = -1e6 * integral;
+  atomic_store(&Stats.clock_offset_us,lrint(offset * 1e6));
+  atomic_store(&Stats.clock_ppb,lrint(ppm * 1e3));
+  if(Verbose && now - c->reported >= CD_REPORT){
+    c->reported = now;
+    fprintf(stderr,"Output clock %+.3f ms, card rate %+.2f ppm\n",offset * 1e3,ppm);
+  }
+}
+
+// Start a resampler at fractions of a sample and check its output against
+// the receiver's fractional delay filter, and that the ticks come out when
+// they should. Return the number of failures
+int clock_selftest(void){
+  double const max_error = 1.0;   // 16-bit LSBs, between two filter designs
+  double const max_timing = 1e-7; // Seconds
+  static double const offsets[] = { 0.05, 0.25, 0.37, 0.5, 0.75, 0.95 }; // Whole samples aren't filtered by the receiver
+  struct wwvsim_params const params = { .no_voice = true };
+  struct wwvsim *w = wwvsim_create(&params);
+  if(w == NULL)
+    return 1;
+  // The two seconds around 12:00:30 UTC
+  int64_t const t0 = wwvsim_utc(w,2025,1,1,12,0,29);
+  int const n = 2 * Samprate;
+  int const skip = 2 * CD_HALF; // Silence ahead of the start reaches this far
+  float *in = malloc((n + 2) * sizeof(*in));
+  float *ref = malloc(n * sizeof(*ref));
+  float *out = malloc((n + 4) * sizeof(*out));
+  int failures = 0;
+  if(in == NULL || ref == NULL || out == NULL){
+    failures++;
+    goto done;
+  }
+  wwvsim_render(w,in,t0,t0 + n + 2);
+  for(size_t i=0; i < sizeof(offsets)/sizeof(offsets[0]); i++){
+    double const offset = offsets[i];
+    // The receiver delays the signal by 1 - offset, so its sample k is the
+    // station at t0 + offset + k
+    struct wwvsim_path const path = { w, 1.0, (1 - offset) / Samprate, NULL };
+    struct wwvsim_receiver *r = wwvsim_receiver_create(&path,1,false);
+    struct clock_discipline *c = clock_create(1,Samprate,n + 2,false,false);
+    if(r == NULL || c == NULL || wwvsim_receiver_render(r,ref,t0 + 1,t0 + 1 + n) != 0){
+      wwvsim_receiver_destroy(r);
+      clock_destroy(c);
+      failures++;
+      continue;
+    }
+    clock_reset(c,0,t0,offset);
+    int const produced = clock_resample(c,out,in,n + 2);
+
+    // Worst difference, and the time shift that best explains it
+    double worst = 0, num = 0, den = 0;
+    int const len = produced < n - 1 ? produced : n - 1;
+    for(int k=skip; k < len; k++){
+      double const e = out[k] - ref[k];
+      if(fabs(e) * SHRT_MAX > worst)
+	worst = fabs(e) * SHRT_MAX;
+      double const slope = (ref[k+1] - ref[k-1]) / 2; // Per sample
+      num += e * slope;
+      den += slope * slope;
+    }
+    double const timing = den > 0 ? num / den / Samprate : 0;
+    bool const ok = worst <= max_error && fabs(timing) <= max_timing;
+    fprintf(stderr,"start at +%.3f sample: max error %.3f LSB, timing %+.1f ns %s\n",
+	    offset,worst,timing * 1e9,ok ? "ok" : "FAIL");
+    if(!ok)
+      failures++;
+    clock_destroy(c);
+    wwvsim_receiver_destroy(r);
+  }
+ done:
+  free(in);
+  free(ref);
+  free(out);
+  wwvsim_destroy(w);
+  return failures;
+}
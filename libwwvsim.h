@@ -0,0 +1,190 @@
+// Public interface to libwwvsim, the WWV/WWVH program generator
+// A process sets the library up once with wwvsim_init(), then creates any
+// number of generators, each with its own station, UT1 offset, leap second
+// and program options. Generators share the sample rate, the per-second
+// templates and the speech engine with its caches; otherwise they're
+// independent, and each may be driven from its own thread.
+#ifndef _LIBWWVSIM_H
+#define _LIBWWVSIM_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Process-wide settings, zero for the defaults
+struct wwvsim_setup {
+  int samprate;          // Samples per second, 8000-384000, default 48000
+  bool verbose;          // Diagnostics on stderr
+  bool no_voice;         // Don't start the speech engine; every generator must then be no_voice
+  char const *tts;       // Speech synthesizer, default first available
+  int tts_workers;       // Synthesizer processes per voice for piper-pool, default 2
+  char const *cache_dir; // Speech cache, default $WWVSIM_CACHE or ~/.cache/wwvsim
+  bool no_disk_cache;    // Keep synthesized speech only in memory
+  bool clips;            // Splice time announcements from pre-rendered words
+};
+// Call once, before creating any generator. Return 0 on success, -1 on error
+int wwvsim_init(struct wwvsim_setup const *setup);
+
+// One generator, zero for the defaults
+struct wwvsim_params {
+  bool wwvh;             // WWVH, otherwise WWV
+  int dut1;              // UT1 - UTC, tenths of a second, -7 to +7
+  int leap;              // +1 or -1 for a leap second at the end of the first June
+  int leap_year;         // or December on or after leap_year/leap_month, 0 for none
+  int leap_month;
+  bool no_tone;          // Suppress the 440, 500 and 600 Hz tones
+  bool no_voice;         // Suppress all voice announcements
+  bool no_timecode;      // Suppress the 100 Hz timecode
+};
+struct wwvsim;
+// Return NULL on error
+struct wwvsim *wwvsim_create(struct wwvsim_params const *params);
+void wwvsim_destroy(struct wwvsim *w);
+
+// Samples of a generator's broadcast are numbered from 1970-01-01 00:00:00 UTC,
+// counting its leap second if it has one
+int64_t wwvsim_sample(struct wwvsim const *w,time_t t);
+int64_t wwvsim_utc(struct wwvsim const *w,int year,int month,int day,int hour,int minute,int second);
+// Sample number where the minute after the one containing sample 'n' begins
+int64_t wwvsim_next_minute(struct wwvsim const *w,int64_t n);
+
+// Render samples [t0,t1) into 'output', 1.0 = full scale, waiting for any speech
+// Intervals can be rendered in any order, from any number of threads at once
+void wwvsim_render(struct wwvsim const *w,float *output,int64_t t0,int64_t t1);
+
+// Render the broadcast in sequence, as for live output, starting at 'position'
+void wwvsim_seek(struct wwvsim *w,int64_t position);
+// Replace speech not ready 'margin_ms' before it goes out (and no earlier than
+// 'earliest') with the scheduled tone or silence, instead of waiting for it
+void wwvsim_deadlines(struct wwvsim *w,int margin_ms,struct timespec const *earliest);
+// Render the next 'n' samples; return the sample number of output[0]
+int64_t wwvsim_read(struct wwvsim *w,float *output,int n);
+
+// HF propagation over a path, see channel.c: Watterson two-ray fading,
+// Gaussian noise and static crashes, reproducible from the seed
+struct wwvsim_channel {
+  double spread_ms;      // Delay of the second ray, 0-10 ms; 0 for one ray
+  double doppler_hz;     // Doppler spread of each ray (two standard deviations), 0-50 Hz; 0 for no fading
+  bool noise;            // Add Gaussian noise at...
+  double snr_db;         // ...this carrier to noise ratio in 3 kHz
+  double qrn_rate;       // Static crashes per second, 0 for none
+  double qrn_db;         // Their peak level relative to the carrier
+  uint64_t seed;
+};
+
+// A receiver hearing one or more generators at once, each over a path
+// with its own gain and delay; see receiver.c
+struct wwvsim_path {
+  struct wwvsim *w;      // Station, not shared with another path or receiver
+  float gain;            // Amplitude, 1.0 = as broadcast
+  double delay;          // Propagation delay, 0-1 s, to any fraction of a sample
+  struct wwvsim_channel const *channel; // HF channel, NULL for none; paths fade independently
+};
+struct wwvsim_receiver;
+// Mix the paths into one channel, or with 'separate' give each its own
+// Return NULL on error
+struct wwvsim_receiver *wwvsim_receiver_create(struct wwvsim_path const *paths,int npaths,bool separate);
+void wwvsim_receiver_destroy(struct wwvsim_receiver *r);
+int wwvsim_receiver_channels(struct wwvsim_receiver const *r);
+// Samples are numbered as for the generators, which should agree on leap seconds
+int64_t wwvsim_receiver_sample(struct wwvsim_receiver const *r,time_t t);
+int64_t wwvsim_receiver_next_minute(struct wwvsim_receiver const *r,int64_t n);
+// The generator calls, with 'output' in frames of interleaved channels
+// wwvsim_receiver_read() reads the paths on separate threads
+// wwvsim_receiver_render() returns 0, or -1 if out of memory
+int wwvsim_receiver_render(struct wwvsim_receiver const *r,float *output,int64_t t0,int64_t t1);
+void wwvsim_receiver_seek(struct wwvsim_receiver *r,int64_t position);
+void wwvsim_receiver_deadlines(struct wwvsim_receiver *r,int margin_ms,struct timespec const *earliest);
+int64_t wwvsim_receiver_read(struct wwvsim_receiver *r,float *output,int n);
+
+// Output sample formats
+enum wwvsim_format {
+  WWVSIM_FORMAT_S16, // Signed 16-bit, native byte order
+  WWVSIM_FORMAT_F32, // 32-bit float, native byte order
+};
+int wwvsim_format_size(enum wwvsim_format format);
+char const *wwvsim_format_name(enum wwvsim_format format);
+int wwvsim_format_parse(char const *name);
+// Convert 'n' rendered samples to 'format', limiting to full scale
+// 'position' is the sample number of in[0], which seeds the optional dither
+void wwvsim_quantize(void *out,enum wwvsim_format format,bool dither,float const *in,int n,uint64_t position);
+
+// Pull rendering, for audio callbacks and test harnesses, see pull.c
+// A render thread keeps a ring of output ahead of the consumer; the
+// consumer takes frames as it needs them, counting from 0
+enum wwvsim_pull_clock {
+  WWVSIM_PULL_UNTIMED,  // Output goes at whatever pace it's taken
+  WWVSIM_PULL_MEASURED, // The consumer says when frames will be heard; report the error
+  WWVSIM_PULL_LOCKED,   // and resample to hold it to the system clock
+};
+struct wwvsim_pull_params {
+  enum wwvsim_format format;
+  bool dither;
+  struct wwvsim_am const *am; // I/Q output, or NULL for audio
+  int buffer_ms;         // Ring depth
+  int block_ms;          // Rendering granularity, at most half of buffer_ms
+  bool callback;         // Consumer uses wwvsim_pull_render(), which never waits
+  enum wwvsim_pull_clock clock;
+  bool relative;         // Keep the offset first measured rather than zero
+};
+struct wwvsim_pull;
+// Return NULL on error
+struct wwvsim_pull *wwvsim_pull_create(struct wwvsim_receiver *r,struct wwvsim_pull_params const *params);
+// Stop rendering, once the consumer has stopped
+void wwvsim_pull_destroy(struct wwvsim_pull *p);
+int wwvsim_pull_channels(struct wwvsim_pull const *p);
+int wwvsim_pull_rate(struct wwvsim_pull const *p);
+// Start with receiver sample 'position' as frame 0
+void wwvsim_pull_start(struct wwvsim_pull *p,int64_t position);
+// Play silence until wwvsim_pull_heard() has said when a frame will be heard,
+// then start, 'lead_ms' later, with what's on the air then
+void wwvsim_pull_start_live(struct wwvsim_pull *p,int lead_ms);
+// Consumer: output frame 'frame' will be heard at 'when' (CLOCK_REALTIME)
+// Wait-free, for an audio callback
+void wwvsim_pull_heard(struct wwvsim_pull *p,int64_t frame,struct timespec const *when);
+// Consumer: fill 'out' with the next 'n' frames, silence for any not
+// rendered in time. Wait-free, for an audio callback
+// Return the number of frames from the broadcast
+int wwvsim_pull_render(struct wwvsim_pull *p,void *out,int n);
+// Consumer: wait for and copy up to 'n' frames; return the number
+int wwvsim_pull_read(struct wwvsim_pull *p,void *out,int n);
+
+// Framed output (wwvsim --framed): each block of frames is preceded by this
+// header, in the host's byte order, saying when its first frame goes out
+#define WWVSIM_FRAME_MAGIC 0x46565757 // "WWVF" little endian
+struct wwvsim_frame_header {
+  uint32_t magic;
+  uint32_t frames;   // That follow, interleaved
+  uint64_t frame;    // Of the first, counting from 0 at the start of output
+  int64_t sec;       // UTC of the first, POSIX seconds; repeats in a leap second
+  uint32_t nsec;
+  uint32_t rate;     // Frames per second
+  uint16_t channels;
+  uint16_t format;   // enum wwvsim_format
+  uint32_t reserved; // 0
+};
+
+// Performance counters and histograms as one line of JSON, see stats.c
+// Return 0, or -1 on a write error
+int wwvsim_stats_json(FILE *fp);
+// Log each stage of the pipeline to 'file' as Chrome trace events
+int wwvsim_trace_open(char const *file);
+void wwvsim_trace_close(void);
+
+// AM modulator making complex baseband I/Q from rendered audio, see am.c
+struct wwvsim_am;
+// 'rate' complex samples per second, a multiple of the audio rate, with the
+// carrier offset 'carrier' Hz and modulation 'depth' (1.0 = 100%) at audio
+// full scale. Return NULL on error
+struct wwvsim_am *wwvsim_am_create(int rate,int carrier,float depth);
+void wwvsim_am_destroy(struct wwvsim_am *am);
+int wwvsim_am_rate(struct wwvsim_am const *am);
+// Audio samples needed on each side of an interval to modulate it
+int wwvsim_am_margin(struct wwvsim_am const *am);
+// Modulate 'n' audio samples starting at sample number 'position' into
+// n * rate / samprate interleaved I/Q pairs; audio[-margin] through
+// audio[n + margin - 1] must be valid
+void wwvsim_am_modulate(struct wwvsim_am const *am,float *iq,float const *audio,int n,int64_t position);
+
+#endif
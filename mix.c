@@ -0,0 +1,83 @@
+// Mix bus and output conversion for wwvsim
+// Minutes are mixed in single precision with 1.0 = full scale, so tones,
+// subcarrier and speech sum with headroom instead of being requantized and
+// clipped at every layer. Each buffer is converted to the output sample
+// format exactly once, at the end, with TPDF dither and a limiter.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <math.h>
+
+#include "wwvsim.h"
+
+static struct {
+  char const *name;
+  int size;
+} const Formats[] = {
+  [WWVSIM_FORMAT_S16] = { "s16", sizeof(int16_t) },
+  [WWVSIM_FORMAT_F32] = { "f32", sizeof(float) },
+};
+
+// Bytes per sample
+int wwvsim_format_size(enum wwvsim_format format){
+  return Formats[format].size;
+}
+
+char const *wwvsim_format_name(enum wwvsim_format format){
+  return Formats[format].name;
+}
+
+// Look up a format by name, return -1 if unknown
+int wwvsim_format_parse(char const *name){
+  for(int i=0; i < (int)(sizeof(Formats)/sizeof(Formats[0])); i++){
+    if(strcasecmp(name,Formats[i].name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Add 'n' 16-bit samples scaled by 'gain' to the bus
+// Simple enough for the compiler to vectorize
+void mix_add(float * restrict bus,int16_t const * restrict in,int n,float gain){
+  for(int i=0; i < n; i++)
+    bus[i] += in[i] * gain;
+}
+
+// Convert 'n' bus samples to 'format', limiting to full scale
+// 'position' is the absolute sample number of in[0], used to seed the dither
+void wwvsim_quantize(void *out,enum wwvsim_format format,bool dither,float const *in,int n,uint64_t position){
+  long clipped = 0;
+  switch(format){
+  case WWVSIM_FORMAT_S16:
+    {
+      int16_t *o = out;
+      for(int i=0; i < n; i++){
+	float d = 0;
+	if(dither){
+	  // Triangular PDF, +/- 1 LSB, depending only on the sample's position in time
+	  uint64_t const r = mix64(position + i);
+	  d = ((float)(uint32_t)r - (float)(uint32_t)(r >> 32)) * 0x1p-32f;
+	}
+	clipped += in[i] > 1 || in[i] < -1; // Not counting the dither
+	float x = in[i] * SHRT_MAX + d;
+	x = x > SHRT_MAX ? SHRT_MAX : x < -SHRT_MAX ? -SHRT_MAX : x;
+	o[i] = lrintf(x);
+      }
+    }
+    break;
+  case WWVSIM_FORMAT_F32:
+    {
+      float *o = out;
+      for(int i=0; i < n; i++){
+	clipped += in[i] > 1 || in[i] < -1;
+	o[i] = in[i] > 1 ? 1 : in[i] < -1 ? -1 : in[i];
+      }
+    }
+    break;
+  }
+  if(clipped > 0)
+    atomic_fetch_add(&Stats.clipped,clipped);
+}
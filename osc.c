@@ -0,0 +1,280 @@
+// Tone generation kernels for wwvsim
+//
+// Sine oscillators are block-renormalized rotators. Each block of OSC_BLOCK
+// samples starts from exactly computed phases, so unlike a free-running
+// phasor no error accumulates over a 44-second tone, and within a block the
+// lanes of a SIMD register advance together with one complex multiply per
+// step. The kernel is picked at run time: AVX2 or SSE2 on x86, NEON on ARM,
+// otherwise plain C.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OSC_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "wwvsim.h"
+
+#define OSC_BLOCK 256 // Samples between phase renormalizations
+
+// Generate 'n' samples of gain*sin(w*i + phase), i = 0...n-1, either
+// overwriting the buffer or adding to it
+typedef void (*osc_kernel)(float *out,int n,double w,double phase,float gain,bool add);
+
+static osc_kernel Kernel;
+static char const *Kernel_name;
+static pthread_once_t Kernel_once = PTHREAD_ONCE_INIT;
+
+// The original free-running complex phasor, kept as the reference for --self-test
+static void osc_reference(float *out,int n,double w,double phase,float gain,bool add){
+  complex double p = cos(phase) + I*sin(phase);
+  complex double const step = cos(w) + I*sin(w);
+  while(n-- > 0){
+    if(add)
+      *out += cimag(p) * gain;
+    else
+      *out = cimag(p) * gain;
+    out++;
+    p *= step;
+  }
+}
+
+static void osc_scalar(float *out,int n,double w,double phase,float gain,bool add){
+  complex double const step = cos(w) + I*sin(w);
+  for(int n0=0; n0 < n; n0 += OSC_BLOCK){
+    double const angle = phase + w * n0;
+    complex double p = cos(angle) + I*sin(angle);
+    int const len = n - n0 < OSC_BLOCK ? n - n0 : OSC_BLOCK;
+    for(int i=0; i < len; i++){
+      if(add)
+	out[n0+i] += cimag(p) * gain;
+      else
+	out[n0+i] = cimag(p) * gain;
+      p *= step;
+    }
+  }
+}
+
+#ifdef OSC_X86
+__attribute__((target("sse2")))
+static void osc_sse2(float *out,int n,double w,double phase,float gain,bool add){
+  __m128 const c = _mm_set1_ps(cos(4*w));
+  __m128 const s = _mm_set1_ps(sin(4*w));
+  __m128 const g = _mm_set1_ps(gain);
+
+  for(int n0=0; n0 < n; n0 += OSC_BLOCK){
+    float re0[4], im0[4];
+    for(int k=0; k < 4; k++){
+      double const angle = phase + w * (n0 + k);
+      re0[k] = cos(angle);
+      im0[k] = sin(angle);
+    }
+    __m128 re = _mm_loadu_ps(re0);
+    __m128 im = _mm_loadu_ps(im0);
+    int const len = n - n0 < OSC_BLOCK ? n - n0 : OSC_BLOCK;
+    for(int i=0; i < len; i += 4){
+      float *o = out + n0 + i;
+      int const count = len - i < 4 ? len - i : 4;
+      __m128 y = _mm_mul_ps(im,g);
+      if(count == 4){
+	_mm_storeu_ps(o,add ? _mm_add_ps(y,_mm_loadu_ps(o)) : y);
+      } else {
+	float buf[4];
+	_mm_storeu_ps(buf,y);
+	for(int k=0; k < count; k++)
+	  o[k] = add ? o[k] + buf[k] : buf[k];
+      }
+      __m128 const nre = _mm_sub_ps(_mm_mul_ps(re,c),_mm_mul_ps(im,s));
+      im = _mm_add_ps(_mm_mul_ps(re,s),_mm_mul_ps(im,c));
+      re = nre;
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void osc_avx2(float *out,int n,double w,double phase,float gain,bool add){
+  __m256 const c = _mm256_set1_ps(cos(8*w));
+  __m256 const s = _mm256_set1_ps(sin(8*w));
+  __m256 const g = _mm256_set1_ps(gain);
+
+  for(int n0=0; n0 < n; n0 += OSC_BLOCK){
+    float re0[8], im0[8];
+    for(int k=0; k < 8; k++){
+      double const angle = phase + w * (n0 + k);
+      re0[k] = cos(angle);
+      im0[k] = sin(angle);
+    }
+    __m256 re = _mm256_loadu_ps(re0);
+    __m256 im = _mm256_loadu_ps(im0);
+    int const len = n - n0 < OSC_BLOCK ? n - n0 : OSC_BLOCK;
+    for(int i=0; i < len; i += 8){
+      float *o = out + n0 + i;
+      int const count = len - i < 8 ? len - i : 8;
+      __m256 y = _mm256_mul_ps(im,g);
+      if(count == 8){
+	_mm256_storeu_ps(o,add ? _mm256_add_ps(y,_mm256_loadu_ps(o)) : y);
+      } else {
+	float buf[8];
+	_mm256_storeu_ps(buf,y);
+	for(int k=0; k < count; k++)
+	  o[k] = add ? o[k] + buf[k] : buf[k];
+      }
+      __m256 const nre = _mm256_sub_ps(_mm256_mul_ps(re,c),_mm256_mul_ps(im,s));
+      im = _mm256_add_ps(_mm256_mul_ps(re,s),_mm256_mul_ps(im,c));
+      re = nre;
+    }
+  }
+}
+#endif // OSC_X86
+
+#ifdef __ARM_NEON
+static void osc_neon(float *out,int n,double w,double phase,float gain,bool add){
+  float32x4_t const c = vdupq_n_f32(cos(4*w));
+  float32x4_t const s = vdupq_n_f32(sin(4*w));
+
+  for(int n0=0; n0 < n; n0 += OSC_BLOCK){
+    float re0[4], im0[4];
+    for(int k=0; k < 4; k++){
+      double const angle = phase + w * (n0 + k);
+      re0[k] = cos(angle);
+      im0[k] = sin(angle);
+    }
+    float32x4_t re = vld1q_f32(re0);
+    float32x4_t im = vld1q_f32(im0);
+    int const len = n - n0 < OSC_BLOCK ? n - n0 : OSC_BLOCK;
+    for(int i=0; i < len; i += 4){
+      float *o = out + n0 + i;
+      int const count = len - i < 4 ? len - i : 4;
+      float32x4_t y = vmulq_n_f32(im,gain);
+      if(count == 4){
+	vst1q_f32(o,add ? vaddq_f32(y,vld1q_f32(o)) : y);
+      } else {
+	float buf[4];
+	vst1q_f32(buf,y);
+	for(int k=0; k < count; k++)
+	  o[k] = add ? o[k] + buf[k] : buf[k];
+      }
+      float32x4_t const nre = vsubq_f32(vmulq_f32(re,c),vmulq_f32(im,s));
+      im = vaddq_f32(vmulq_f32(re,s),vmulq_f32(im,c));
+      re = nre;
+    }
+  }
+}
+#endif // __ARM_NEON
+
+static void osc_select(void){
+  Kernel = osc_scalar;
+  Kernel_name = "scalar";
+#ifdef OSC_X86
+  __builtin_cpu_init();
+  if(getenv("WWVSIM_NO_SIMD") != NULL)
+    return;
+  if(__builtin_cpu_supports("avx2")){
+    Kernel = osc_avx2;
+    Kernel_name = "avx2";
+  } else if(__builtin_cpu_supports("sse2")){
+    Kernel = osc_sse2;
+    Kernel_name = "sse2";
+  }
+#elif defined(__ARM_NEON)
+  if(getenv("WWVSIM_NO_SIMD") != NULL)
+    return;
+  Kernel = osc_neon;
+  Kernel_name = "neon";
+#endif
+}
+
+char const *osc_name(void){
+  pthread_once(&Kernel_once,osc_select);
+  return Kernel_name;
+}
+
+// Generate 'samples' of a tone at 'freq' Hz and amplitude 'amp' (1.0 = full scale)
+// starting 'offset' samples after its positive-going zero crossing,
+// overwriting the buffer or adding to it. Nothing is clipped; see mix.c
+void osc_tone(float *output,int samples,double freq,double amp,int64_t offset,bool add){
+  pthread_once(&Kernel_once,osc_select);
+  double const w = 2 * M_PI * freq / Samprate;
+  double const phase = fmod(w * offset,2 * M_PI);
+  (*Kernel)(output,samples,w,phase,amp,add);
+}
+
+// Compare each kernel available on this machine with the reference phasor
+// Return the number of failures
+int osc_selftest(void){
+  static struct {
+    char const *name;
+    osc_kernel kernel;
+    bool available;
+  } kernels[] = {
+    { "scalar", osc_scalar, true },
+#ifdef OSC_X86
+    { "sse2", osc_sse2, false },
+    { "avx2", osc_avx2, false },
+#endif
+#ifdef __ARM_NEON
+    { "neon", osc_neon, true },
+#endif
+  };
+#ifdef OSC_X86
+  __builtin_cpu_init();
+  kernels[1].available = __builtin_cpu_supports("sse2");
+  kernels[2].available = __builtin_cpu_supports("avx2");
+#endif
+  // Long tones, subcarrier, ticks and beeps, including odd lengths
+  static struct {
+    double freq, amp;
+    int ms;
+  } const cases[] = {
+    { 440, 0.5012, 44000 }, { 500, 0.5012, 44000 }, { 600, 0.5012, 44000 },
+    { 100, 0.5012, 800 }, { 1000, 1.0, 5 }, { 1200, 1.0, 5 }, { 1500, 1.0, 800 },
+  };
+  double const max_error = 0.1; // 16-bit LSBs, from single precision arithmetic
+  int failures = 0;
+  for(size_t k=0; k < sizeof(kernels)/sizeof(kernels[0]); k++){
+    if(!kernels[k].available)
+      continue;
+    double worst = 0;
+    for(size_t c=0; c < sizeof(cases)/sizeof(cases[0]); c++){
+      for(int add=0; add < 2; add++){
+	int const n = cases[c].ms * Samprate / 1000 + (add ? 3 : 0);
+	float *ref = malloc(n * sizeof(*ref));
+	float *test = malloc(n * sizeof(*test));
+	if(ref == NULL || test == NULL){
+	  free(ref);
+	  free(test);
+	  return failures + 1;
+	}
+	for(int i=0; i < n; i++)
+	  ref[i] = test[i] = add ? ((i * 7919) % 40000 - 20000) / 32767. : 0; // Something to add to
+	double const w = 2 * M_PI * cases[c].freq / Samprate;
+	osc_reference(ref,n,w,0,cases[c].amp,add);
+	(*kernels[k].kernel)(test,n,w,0,cases[c].amp,add);
+	for(int i=0; i < n; i++){
+	  double const e = fabs(ref[i] - test[i]) * SHRT_MAX;
+	  if(e > worst)
+	    worst = e;
+	}
+	free(ref);
+	free(test);
+      }
+    }
+    bool const ok = worst <= max_error;
+    fprintf(stderr,"oscillator %s: max error %.3f LSB %s\n",kernels[k].name,worst,ok ? "ok" : "FAIL");
+    if(!ok)
+      failures++;
+  }
+  return failures;
+}
@@ -0,0 +1,433 @@
+// Pull rendering for wwvsim
+// For audio systems that ask for samples when they want them (PortAudio,
+// JACK or PipeWire callbacks, a test harness) instead of taking whatever is
+// written. A render thread keeps a ring ahead of the consumer, rendering a
+// block at a time, modulating and resampling through the clock discipline
+// as asked, and quantizing to the output format. Speech, minute planning
+// and everything else that can wait or allocate happens there.
+// wwvsim_pull_render() only copies out of the ring: no locks, no system
+// calls, no allocation, a bounded number of steps whatever the render
+// thread is doing, so it can run on a real-time audio thread. If the ring
+// runs dry it plays silence and skips what it missed, keeping its place.
+// The consumer counts output frames from the first one it takes, and may
+// say when one of them will be heard; the render thread uses that to start
+// the broadcast exactly on time and to lock to the system clock.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+struct wwvsim_pull {
+  struct wwvsim_receiver *r;
+  struct wwvsim_pull_params params;
+  int rx_channels;       // From the receiver
+  int channels;          // Out
+  int rate;              // Output frames per second
+  int interp;            // Output frames per receiver sample
+  int block, margin;     // Receiver samples
+  float *bus;            // Receiver samples, 'margin' either side of each block for the modulator
+  float *iq;
+  float *disciplined;
+  struct clock_discipline *clock;
+  struct ring ring;      // Output frames
+
+  pthread_t thread;
+  atomic_bool quit;
+  pthread_mutex_t mutex; // Starting
+  bool go;
+  bool live;             // Start when the consumer says its frames will be heard
+  int lead_ms;
+  int64_t position;      // Otherwise here
+
+  _Atomic int64_t first; // Output frame of the ring's first sample, INT64_MAX until known
+  int64_t frame;         // Frames taken by the consumer
+
+  // The latest wwvsim_pull_heard(), under a sequence lock
+  atomic_uint seq;
+  _Atomic int64_t heard_frame;
+  _Atomic int64_t heard_sec;
+  _Atomic long heard_nsec;
+};
+
+struct wwvsim_pull *wwvsim_pull_create(struct wwvsim_receiver *r,struct wwvsim_pull_params const *params){
+  // The render thread waits for room for a whole block, resampled, so the
+  // ring must hold comfortably more than one
+  if(params->block_ms < 1 || params->block_ms > params->buffer_ms / 2){
+    fprintf(stderr,"Block size %d ms must be 1 ms to half the %d ms buffer\n",params->block_ms,params->buffer_ms);
+    return NULL;
+  }
+  struct wwvsim_pull *p = calloc(1,sizeof(*p));
+  if(p == NULL)
+    return NULL;
+  p->r = r;
+  p->params = *params;
+  p->rx_channels = wwvsim_receiver_channels(r);
+  struct wwvsim_am const *am = params->am;
+  p->channels = am != NULL ? 2 : p->rx_channels;
+  p->rate = am != NULL ? am->rate : Samprate;
+  p->interp = am != NULL ? am->interp : 1;
+  p->block = ms_samples(params->block_ms);
+  p->margin = am != NULL ? wwvsim_am_margin(am) : 0;
+  atomic_init(&p->first,INT64_MAX);
+  pthread_mutex_init(&p->mutex,NULL);
+
+  p->bus = malloc((p->block + 2 * p->margin) * p->rx_channels * sizeof(*p->bus));
+  if(p->bus == NULL)
+    goto fail;
+  if(am != NULL && (p->iq = malloc(2 * p->block * p->interp * sizeof(*p->iq))) == NULL)
+    goto fail;
+  if(params->clock != WWVSIM_PULL_UNTIMED){
+    // The discipline resamples by a little either way
+    p->clock = clock_create(p->channels,p->rate,p->block * p->interp,params->relative,params->clock == WWVSIM_PULL_LOCKED);
+    p->disciplined = malloc((p->block * p->interp * 101 / 100 + 2) * p->channels * sizeof(*p->disciplined));
+    if(p->clock == NULL || p->disciplined == NULL)
+      goto fail;
+  }
+  if(ring_init(&p->ring,ms_samples(params->buffer_ms) * p->interp,wwvsim_format_size(params->format) * p->channels) != 0){
+    fprintf(stderr,"Can't allocate %d ms output buffer\n",params->buffer_ms);
+    goto fail;
+  }
+  return p;
+ fail:
+  clock_destroy(p->clock);
+  free(p->disciplined);
+  free(p->iq);
+  free(p->bus);
+  free(p);
+  return NULL;
+}
+
+void wwvsim_pull_destroy(struct wwvsim_pull *p){
+  if(p == NULL)
+    return;
+  pthread_mutex_lock(&p->mutex);
+  bool const running = p->go;
+  atomic_store(&p->quit,true);
+  pthread_mutex_unlock(&p->mutex);
+  if(running){
+    // Let it out of a full ring
+    atomic_store(&p->ring.tail,atomic_load(&p->ring.head));
+    ring_consume(&p->ring,0);
+    pthread_join(p->thread,NULL);
+  }
+  ring_free(&p->ring);
+  clock_destroy(p->clock);
+  pthread_mutex_destroy(&p->mutex);
+  free(p->disciplined);
+  free(p->iq);
+  free(p->bus);
+  free(p);
+}
+
+int wwvsim_pull_channels(struct wwvsim_pull const *p){
+  return p->channels;
+}
+
+int wwvsim_pull_rate(struct wwvsim_pull const *p){
+  return p->rate;
+}
+
+// The last report from the consumer; false if none yet
+static bool last_heard(struct wwvsim_pull *p,int64_t *frame,struct timespec *when){
+  unsigned s;
+  do {
+    s = atomic_load_explicit(&p->seq,memory_order_acquire);
+    if(s == 0)
+      return false;
+    *frame = atomic_load_explicit(&p->heard_frame,memory_order_relaxed);
+    when->tv_sec = atomic_load_explicit(&p->heard_sec,memory_order_relaxed);
+    when->tv_nsec = atomic_load_explicit(&p->heard_nsec,memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+  } while((s & 1) || s != atomic_load_explicit(&p->seq,memory_order_relaxed));
+  return true;
+}
+
+void wwvsim_pull_heard(struct wwvsim_pull *p,int64_t frame,struct timespec const *when){
+  unsigned const s = atomic_load_explicit(&p->seq,memory_order_relaxed);
+  atomic_store_explicit(&p->seq,s + 1,memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&p->heard_frame,frame,memory_order_relaxed);
+  atomic_store_explicit(&p->heard_sec,when->tv_sec,memory_order_relaxed);
+  atomic_store_explicit(&p->heard_nsec,when->tv_nsec,memory_order_relaxed);
+  atomic_store_explicit(&p->seq,s + 2,memory_order_release);
+}
+
+// Output frame number, at the output rate, of the broadcast at 't'
+static double frame_at(struct wwvsim_pull const *p,struct timespec const *t){
+  return (double)wwvsim_receiver_sample(p->r,t->tv_sec) * p->interp + t->tv_nsec * 1e-9 * p->rate;
+}
+
+static void sleep_ms(int ms){
+  struct timespec const ts = { ms / 1000, (ms % 1000) * 1000000L };
+  nanosleep(&ts,NULL);
+}
+
+static void *pull_thread(void *arg){
+  struct wwvsim_pull *p = arg;
+  pthread_setname("render");
+  int const interp = p->interp;
+  int const margin = p->margin;
+  int const rx_channels = p->rx_channels;
+  int const channels = p->channels;
+
+  int64_t start = p->position;
+  int64_t frames_out = 0; // Through the clock discipline
+  double offset = 0;      // Output frames past 'start' to begin, less than one sample
+  int64_t heard = -1;     // Last consumer report used
+  if(p->live){
+    // Begin with whatever's on the air when the consumer's frame 'first' is heard,
+    // far enough ahead to render the first blocks
+    int64_t frame;
+    struct timespec when;
+    while(!last_heard(p,&frame,&when)){
+      if(atomic_load(&p->quit))
+	return NULL;
+      sleep_ms(1);
+    }
+    frames_out = frame + (int64_t)p->lead_ms * p->rate / 1000;
+    double const at = when.tv_nsec * 1e-9 + (double)(frames_out - frame) / p->rate;
+    when.tv_sec += (time_t)floor(at);
+    double const x = (at - floor(at)) * Samprate;
+    start = wwvsim_receiver_sample(p->r,when.tv_sec) + (int64_t)floor(x);
+    offset = (x - floor(x)) * interp;
+    heard = frame;
+  }
+  wwvsim_receiver_seek(p->r,start - margin);
+  wwvsim_receiver_read(p->r,p->bus,2 * margin);
+  if(p->clock != NULL)
+    clock_reset(p->clock,frames_out,start * interp,offset);
+  atomic_store(&p->first,frames_out);
+
+  int64_t next = start;
+  while(!atomic_load(&p->quit)){
+    if(p->clock != NULL){
+      int64_t frame;
+      struct timespec when;
+      if(last_heard(p,&frame,&when) && frame != heard){
+	heard = frame;
+	clock_measure(p->clock,frame,frame_at(p,&when),when.tv_sec + when.tv_nsec * 1e-9);
+      }
+      int64_t const step = clock_step(p->clock) / interp;
+      if(step != 0){
+	// The system clock jumped
+	next += step;
+	wwvsim_receiver_seek(p->r,next - margin);
+	wwvsim_receiver_read(p->r,p->bus,2 * margin);
+	clock_reset(p->clock,frames_out,next * interp,0);
+      }
+    }
+    if(p->params.callback){
+      // The consumer never waits, so it never wakes us
+      int const needed = (p->block * interp * 101) / 100 + 2;
+      int const space = ring_space(&p->ring);
+      if(space < needed){
+	int const ms = (int64_t)(needed - space) * 1000 / p->rate;
+	sleep_ms(ms < 1 ? 1 : ms);
+	continue;
+      }
+    }
+    int64_t const t = monotonic_ns();
+    int64_t const position = wwvsim_receiver_read(p->r,p->bus + 2 * margin * rx_channels,p->block) - margin;
+    hist_add(&Stats.render_block,(monotonic_ns() - t) / 1000);
+    trace_event("render",t);
+    next = position + p->block;
+    float const *out = p->bus + margin * rx_channels;
+    if(p->params.am != NULL){
+      wwvsim_am_modulate(p->params.am,p->iq,p->bus + margin,p->block,position);
+      out = p->iq;
+    }
+    int frames = p->block * interp;
+    int64_t key = position * interp; // Dither for frame 0
+    if(p->clock != NULL){
+      frames = clock_resample(p->clock,p->disciplined,out,frames);
+      out = p->disciplined;
+      key = frames_out;
+    }
+    frames_out += frames;
+    for(int done = 0; done < frames;){
+      int len;
+      void *space = ring_write_space(&p->ring,frames - done,&len);
+      if(atomic_load(&p->quit))
+	return NULL;
+      // The only quantization; dither is keyed to the time so reruns are identical
+      wwvsim_quantize(space,p->params.format,p->params.dither,out + done * channels,len * channels,(key + done) * channels);
+      ring_commit(&p->ring,len);
+      done += len;
+    }
+    memmove(p->bus,p->bus + p->block * rx_channels,2 * margin * rx_channels * sizeof(*p->bus));
+  }
+  return NULL;
+}
+
+static void pull_go(struct wwvsim_pull *p){
+  pthread_mutex_lock(&p->mutex);
+  p->go = true;
+  pthread_create(&p->thread,NULL,pull_thread,p);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void wwvsim_pull_start(struct wwvsim_pull *p,int64_t position){
+  p->position = position;
+  atomic_store(&p->first,0);
+  pull_go(p);
+}
+
+void wwvsim_pull_start_live(struct wwvsim_pull *p,int lead_ms){
+  p->live = true;
+  p->lead_ms = lead_ms;
+  pull_go(p);
+}
+
+// Copy up to 'n' frames the ring has for the consumer's next frames; skip
+// any it has for frames already gone. Return the number copied
+static int take(struct wwvsim_pull *p,char *out,int n){
+  int64_t const first = atomic_load(&p->first);
+  if(p->frame < first)
+    return 0;
+  struct ring *ring = &p->ring;
+  int const width = ring->width;
+  int64_t behind = p->frame - first - (int64_t)atomic_load(&ring->tail);
+  int done = 0;
+  while(done < n && ring_count(ring) > 0){
+    int len;
+    void const *data = ring_read_data(ring,behind > 0 ? behind : n - done,&len);
+    if(behind > 0){
+      behind -= len;
+    } else {
+      memcpy(out + (size_t)done * width,data,(size_t)len * width);
+      done += len;
+    }
+    ring_consume(ring,len);
+  }
+  return done;
+}
+
+int wwvsim_pull_render(struct wwvsim_pull *p,void *out,int n){
+  int const width = p->ring.width;
+  int64_t const first = atomic_load(&p->first);
+  int const lead = first <= p->frame ? 0 : first - p->frame < n ? first - p->frame : n;
+  memset(out,0,(size_t)lead * width);
+  p->frame += lead;
+  int const done = take(p,(char *)out + (size_t)lead * width,n - lead);
+  if(lead + done < n){
+    // Ran dry; play silence and keep time
+    memset((char *)out + (size_t)(lead + done) * width,0,(size_t)(n - lead - done) * width);
+    atomic_fetch_add_explicit(&Stats.ring_empty,1,memory_order_relaxed);
+  }
+  p->frame += n - lead;
+  atomic_store_explicit(&Stats.ring_ms,(long)ring_count(&p->ring) * 1000 / p->rate,memory_order_relaxed);
+  return done;
+}
+
+int wwvsim_pull_read(struct wwvsim_pull *p,void *out,int n){
+  int const width = p->ring.width;
+  int64_t const first = atomic_load(&p->first);
+  if(p->frame < first){
+    // Nothing yet; fill in time
+    int const lead = first - p->frame < n ? first - p->frame : n;
+    memset(out,0,(size_t)lead * width);
+    p->frame += lead;
+    return lead;
+  }
+  int64_t const depth = ring_count(&p->ring);
+  atomic_store(&Stats.ring_ms,depth * 1000 / p->rate);
+  hist_add(&Stats.ring_depth,depth * 1000000 / p->rate);
+  int len;
+  void const *data = ring_read_data(&p->ring,n,&len);
+  memcpy(out,data,(size_t)len * width);
+  ring_consume(&p->ring,len);
+  p->frame += len;
+  return len;
+}
+
+// Start live from a made-up wwvsim_pull_heard() stamp at fractions of a
+// sample and check that the 12:00:30 tick comes out at the output frame the
+// stamp says it should, against the receiver's fractional delay filter.
+// Return the number of failures
+int pull_selftest(void){
+  double const max_error = 1.0;   // 16-bit LSBs, between two filter designs
+  double const max_timing = 1e-7; // Seconds
+  int const lead_ms = 200;
+  static long const stamps[] = { 300001042, 300005208, 300010417, 300015625, 300019792 }; // ns past 12:00:29; not whole samples, which the receiver doesn't filter
+  struct wwvsim_params const params = { .no_voice = true };
+  struct wwvsim *w = wwvsim_create(&params);
+  struct wwvsim *wref = wwvsim_create(&params);
+  int const total = Samprate; // Frames taken, to 200 ms past the tick
+  float *out = malloc(total * sizeof(*out));
+  float *ref = malloc(total * sizeof(*ref));
+  int failures = 0;
+  if(w == NULL || wref == NULL || out == NULL || ref == NULL){
+    failures++;
+    goto done;
+  }
+  int64_t const tick = wwvsim_utc(w,2025,1,1,12,0,30);
+  struct tm tm = { .tm_year = 2025 - 1900, .tm_mon = 0, .tm_mday = 1, .tm_hour = 12, .tm_min = 0, .tm_sec = 29 };
+  time_t const sec = timegm(&tm);
+  for(size_t i=0; i < sizeof(stamps)/sizeof(stamps[0]); i++){
+    // Frame 0 is heard at 'when', so the tick at 'expected'
+    struct timespec const when = { sec, stamps[i] };
+    double const expected = (1e9 - when.tv_nsec) * 1e-9 * Samprate;
+    int const whole = floor(expected);
+    double const frac = expected - whole;
+    // The reference receiver delays the signal by 'frac', so its sample
+    // tick - whole + k is the station at tick - expected + k, as out[k] should be
+    struct wwvsim_path const path = { w, 1.0, 0, NULL };
+    struct wwvsim_path const ref_path = { wref, 1.0, frac / Samprate, NULL };
+    struct wwvsim_receiver *r = wwvsim_receiver_create(&path,1,false);
+    struct wwvsim_receiver *rref = wwvsim_receiver_create(&ref_path,1,false);
+    struct wwvsim_pull_params const pp = {
+      .format = WWVSIM_FORMAT_F32,
+      .buffer_ms = 1000,
+      .block_ms = 100,
+      .clock = WWVSIM_PULL_MEASURED, // Places the start, but never steers
+    };
+    struct wwvsim_pull *p = r != NULL ? wwvsim_pull_create(r,&pp) : NULL;
+    if(p == NULL || rref == NULL || wwvsim_receiver_render(rref,ref,tick - whole,tick - whole + total) != 0){
+      wwvsim_pull_destroy(p);
+      wwvsim_receiver_destroy(r);
+      wwvsim_receiver_destroy(rref);
+      failures++;
+      continue;
+    }
+    wwvsim_pull_heard(p,0,&when);
+    wwvsim_pull_start_live(p,lead_ms);
+    while(atomic_load(&p->first) == INT64_MAX)
+      sleep_ms(1);
+    for(int n = 0; n < total;)
+      n += wwvsim_pull_read(p,out + n,total - n);
+    wwvsim_pull_destroy(p);
+    wwvsim_receiver_destroy(r);
+    wwvsim_receiver_destroy(rref);
+
+    // Worst difference around the tick, and the time shift that best explains it
+    double worst = 0, num = 0, den = 0;
+    for(int k = whole - Samprate / 100; k < whole + Samprate / 20; k++){
+      double const e = out[k] - ref[k];
+      if(fabs(e) * SHRT_MAX > worst)
+	worst = fabs(e) * SHRT_MAX;
+      double const slope = (ref[k+1] - ref[k-1]) / 2; // Per sample
+      num += e * slope;
+      den += slope * slope;
+    }
+    double const timing = den > 0 ? num / den / Samprate : 1;
+    bool const ok = worst <= max_error && fabs(timing) <= max_timing;
+    fprintf(stderr,"heard at +%.6f s: tick at frame %.3f, max error %.3f LSB, timing %+.1f ns %s\n",
+	    when.tv_nsec * 1e-9,expected,worst,timing * 1e9,ok ? "ok" : "FAIL");
+    if(!ok)
+      failures++;
+  }
+ done:
+  free(out);
+  free(ref);
+  wwvsim_destroy(w);
+  wwvsim_destroy(wref);
+  return failures;
+}
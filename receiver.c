@@ -0,0 +1,312 @@
+// What a receiver hears: one or more stations at once
+// Each station arrives over a path with its own gain and propagation delay,
+// and is rendered by its own generator; the generators share the templates
+// and speech caches. The paths are added into one channel, or kept apart one
+// per channel. A delay of a whole number of samples is just an offset into
+// the station's broadcast; any fraction of a sample left over is made up by
+// a windowed-sinc fractional delay filter. A path may also have an HF
+// channel, applied to the station's audio ahead of the delay.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+#define RX_HALF 16      // Fractional delay filter half-width, samples
+#define RX_CUTOFF 0.92  // Fraction of the Nyquist rate passed
+#define RX_BETA 8.0     // Kaiser window parameter, ~80 dB stopband
+#define RX_CHUNK 4096   // Samples per pass in wwvsim_receiver_read()
+#define RX_MAX_DELAY 1.0 // Seconds
+
+struct path {
+  struct wwvsim_receiver *r;
+  struct wwvsim *w;
+  float gain;
+  int64_t shift;          // Whole samples of delay
+  int half;               // Filter half-width, 0 for a whole number of samples
+  float taps[2*RX_HALF];  // Including the gain
+  struct channel *channel; // HF propagation, or NULL
+  int lead;               // Station samples the channel needs ahead of its output
+  float *buffer;          // wwvsim_receiver_read(): lead + 2 * half samples of history, then the chunk
+  int64_t base;           // Station sample number of buffer[0]
+  int filled;             // Samples after the history, -1 to read the history afresh
+  float *faded;           // buffer[lead] onward through the channel
+  pthread_t thread;
+};
+
+struct wwvsim_receiver {
+  int npaths;
+  bool separate;
+  struct path *paths;
+  int64_t position;       // Next sample for wwvsim_receiver_read()
+
+  // Paths after the first are read on their own threads, started on first use
+  bool threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  long generation;        // Bumped for each chunk
+  int chunk;              // Samples in it
+  int pending;            // Threads still reading it
+  bool quit;
+};
+
+// Delayed, scaled copy of a path's station into every 'stride'th sample of
+// 'output', replacing or adding to what's there. in[0] is the station sample
+// 'shift + half' before output[0]; in[n + 2*half - 1] must be valid
+static void path_apply(struct path const *p,float *output,int stride,bool add,float const *in,int n){
+  if(p->half == 0){
+    for(int i=0; i < n; i++)
+      output[i * stride] = (add ? output[i * stride] : 0) + p->gain * in[i];
+    return;
+  }
+  int const ntaps = 2 * p->half;
+  int i = 0;
+  for(; i + 4 <= n; i += 4){
+    v4sf acc = {0,0,0,0};
+    for(int k=0; k < ntaps; k++)
+      acc += p->taps[k] * load4(in + i + k);
+    for(int l=0; l < 4; l++)
+      output[(i + l) * stride] = (add ? output[(i + l) * stride] : 0) + acc[l];
+  }
+  for(; i < n; i++){
+    float acc = 0;
+    for(int k=0; k < ntaps; k++)
+      acc += p->taps[k] * in[i + k];
+    output[i * stride] = (add ? output[i * stride] : 0) + acc;
+  }
+}
+
+static int path_init(struct path *p,struct wwvsim_path const *spec,int index){
+  if(!(spec->delay >= 0 && spec->delay <= RX_MAX_DELAY)){
+    fprintf(stderr,"Path delay %g s out of range 0-%g\n",spec->delay,RX_MAX_DELAY);
+    return -1;
+  }
+  p->w = spec->w;
+  p->gain = spec->gain;
+  if(spec->channel != NULL){
+    if((p->channel = channel_create(spec->channel,index)) == NULL)
+      return -1;
+    p->lead = channel_lead(p->channel);
+  }
+  double const delay = spec->delay * Samprate;
+  p->shift = floor(delay);
+  double frac = delay - p->shift;
+  if(frac < 1e-6)
+    frac = 0;
+  else if(frac > 1 - 1e-6){
+    p->shift++;
+    frac = 0;
+  }
+  p->half = frac != 0 ? RX_HALF : 0;
+  if(p->half == 0)
+    return 0;
+
+  // Output sample m + shift is the station at m - frac; tap k weights the
+  // station sample m - half + k, windowed sinc normalized to the path gain
+  int const ntaps = 2 * p->half;
+  double const norm = bessel_i0(RX_BETA);
+  double sum = 0;
+  for(int k=0; k < ntaps; k++){
+    double const d = p->half - k - frac;
+    double const r = d / p->half;
+    double const window = fabs(r) < 1 ? bessel_i0(RX_BETA * sqrt(1 - r*r)) / norm : 0;
+    double const arg = M_PI * RX_CUTOFF * d;
+    p->taps[k] = window * (d == 0 ? 1.0 : sin(arg)/arg);
+    sum += p->taps[k];
+  }
+  for(int k=0; k < ntaps; k++)
+    p->taps[k] *= p->gain / sum;
+  return 0;
+}
+
+struct wwvsim_receiver *wwvsim_receiver_create(struct wwvsim_path const *paths,int npaths,bool separate){
+  if(npaths < 1)
+    return NULL;
+  struct wwvsim_receiver *r = calloc(1,sizeof(*r));
+  if(r == NULL)
+    return NULL;
+  r->npaths = npaths;
+  r->separate = separate;
+  pthread_mutex_init(&r->mutex,NULL);
+  pthread_cond_init(&r->start_cond,NULL);
+  pthread_cond_init(&r->done_cond,NULL);
+  if((r->paths = calloc(npaths,sizeof(*r->paths))) == NULL)
+    goto fail;
+  for(int i=0; i < npaths; i++){
+    struct path *p = &r->paths[i];
+    p->r = r;
+    if(path_init(p,&paths[i],i) != 0)
+      goto fail;
+    if((p->buffer = malloc((RX_CHUNK + 2 * p->half + p->lead) * sizeof(*p->buffer))) == NULL)
+      goto fail;
+    if(p->channel != NULL && (p->faded = malloc((RX_CHUNK + 2 * p->half) * sizeof(*p->faded))) == NULL)
+      goto fail;
+  }
+  return r;
+ fail:;
+  wwvsim_receiver_destroy(r);
+  return NULL;
+}
+
+void wwvsim_receiver_destroy(struct wwvsim_receiver *r){
+  if(r == NULL)
+    return;
+  if(r->threads){
+    pthread_mutex_lock(&r->mutex);
+    r->quit = true;
+    pthread_cond_broadcast(&r->start_cond);
+    pthread_mutex_unlock(&r->mutex);
+    for(int i=1; i < r->npaths; i++)
+      pthread_join(r->paths[i].thread,NULL);
+  }
+  if(r->paths != NULL){
+    for(int i=0; i < r->npaths; i++){
+      free(r->paths[i].buffer);
+      free(r->paths[i].faded);
+      if(r->paths[i].channel != NULL)
+	channel_destroy(r->paths[i].channel);
+    }
+    free(r->paths);
+  }
+  pthread_cond_destroy(&r->done_cond);
+  pthread_cond_destroy(&r->start_cond);
+  pthread_mutex_destroy(&r->mutex);
+  free(r);
+}
+
+int wwvsim_receiver_channels(struct wwvsim_receiver const *r){
+  return r->separate ? r->npaths : 1;
+}
+
+int64_t wwvsim_receiver_sample(struct wwvsim_receiver const *r,time_t t){
+  return wwvsim_sample(r->paths[0].w,t);
+}
+
+int64_t wwvsim_receiver_next_minute(struct wwvsim_receiver const *r,int64_t n){
+  return wwvsim_next_minute(r->paths[0].w,n);
+}
+
+// Any number of threads may render through one receiver at once, so the
+// scratch space is the caller's, for the length of the call
+int wwvsim_receiver_render(struct wwvsim_receiver const *r,float *output,int64_t t0,int64_t t1){
+  int const n = t1 - t0;
+  int const stride = wwvsim_receiver_channels(r);
+  for(int i=0; i < r->npaths; i++){
+    struct path const *p = &r->paths[i];
+    int const len = n + 2 * p->half;
+    int64_t const s0 = t0 - p->shift - p->half;
+    // The station with the channel's lead, then what the channel makes of it
+    float *in = malloc((p->lead + len + (p->channel != NULL ? len : 0)) * sizeof(*in));
+    if(in == NULL){
+      fprintf(stderr,"Can't allocate %d samples to render\n",len);
+      return -1;
+    }
+    wwvsim_render(p->w,in,s0 - p->lead,s0 + len);
+    float const *heard = in;
+    if(p->channel != NULL){
+      float *faded = in + p->lead + len;
+      channel_apply(p->channel,faded,in + p->lead,len,s0);
+      heard = faded;
+    }
+    path_apply(p,output + (r->separate ? i : 0),stride,!r->separate && i > 0,heard,n);
+    free(in);
+  }
+  return 0;
+}
+
+void wwvsim_receiver_seek(struct wwvsim_receiver *r,int64_t position){
+  r->position = position;
+  for(int i=0; i < r->npaths; i++){
+    struct path *p = &r->paths[i];
+    p->base = position - p->shift - p->half - p->lead;
+    wwvsim_seek(p->w,p->base);
+    p->filled = -1;
+  }
+}
+
+void wwvsim_receiver_deadlines(struct wwvsim_receiver *r,int margin_ms,struct timespec const *earliest){
+  for(int i=0; i < r->npaths; i++)
+    wwvsim_deadlines(r->paths[i].w,margin_ms,earliest);
+}
+
+// Read the next 'n' samples of a path's station into its buffer after the
+// history, and through its channel
+static void path_read(struct path *p,int n){
+  int const history = p->lead + 2 * p->half;
+  if(p->filled < 0){
+    if(history > 0)
+      wwvsim_read(p->w,p->buffer,history);
+  } else {
+    if(history > 0)
+      memmove(p->buffer,p->buffer + p->filled,history * sizeof(*p->buffer));
+    p->base += p->filled;
+  }
+  wwvsim_read(p->w,p->buffer + history,n);
+  p->filled = n;
+  if(p->channel != NULL)
+    channel_apply(p->channel,p->faded,p->buffer + p->lead,n + 2 * p->half,p->base + p->lead);
+}
+
+static void *path_thread(void *arg){
+  struct path *p = arg;
+  struct wwvsim_receiver *r = p->r;
+  pthread_setname("path");
+  long generation = 0;
+
+  pthread_mutex_lock(&r->mutex);
+  while(1){
+    while(!r->quit && r->generation == generation)
+      pthread_cond_wait(&r->start_cond,&r->mutex);
+    if(r->quit)
+      break;
+    generation = r->generation;
+    int const n = r->chunk;
+    pthread_mutex_unlock(&r->mutex);
+    path_read(p,n);
+    pthread_mutex_lock(&r->mutex);
+    if(--r->pending == 0)
+      pthread_cond_signal(&r->done_cond);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+int64_t wwvsim_receiver_read(struct wwvsim_receiver *r,float *output,int n){
+  int64_t const start = r->position;
+  int const stride = wwvsim_receiver_channels(r);
+
+  if(r->npaths > 1 && !r->threads){
+    for(int i=1; i < r->npaths; i++)
+      pthread_create(&r->paths[i].thread,NULL,path_thread,&r->paths[i]);
+    r->threads = true;
+  }
+  while(n > 0){
+    int const len = n < RX_CHUNK ? n : RX_CHUNK;
+    // Paths read in parallel, since each may be waiting for its own speech
+    pthread_mutex_lock(&r->mutex);
+    r->chunk = len;
+    r->pending = r->npaths - 1;
+    r->generation++;
+    pthread_cond_broadcast(&r->start_cond);
+    pthread_mutex_unlock(&r->mutex);
+    path_read(&r->paths[0],len);
+    pthread_mutex_lock(&r->mutex);
+    while(r->pending > 0)
+      pthread_cond_wait(&r->done_cond,&r->mutex);
+    pthread_mutex_unlock(&r->mutex);
+
+    for(int i=0; i < r->npaths; i++){
+      struct path *p = &r->paths[i];
+      path_apply(p,output + (r->separate ? i : 0),stride,!r->separate && i > 0,p->channel != NULL ? p->faded : p->buffer,len);
+    }
+    output += len * stride;
+    n -= len;
+    r->position += len;
+  }
+  return start;
+}
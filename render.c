@@ -0,0 +1,679 @@
+// Rendering core of libwwvsim, see libwwvsim.h
+// Builds the WWV/WWVH program: timecode, per-second templates, tones and
+// speech, a block at a time. Everything a generator needs to know about its
+// station is in its context, so any number of them can run in one process;
+// only the sample rate and the speech engine are shared.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+#define PREFETCH_MINUTES 5 // Render announcements this far ahead
+
+char Libdir[] = "/usr/local/share/ka9q-radio";
+
+int Samprate = 48000; // Samples per second
+bool Verbose = false;
+static bool Speech_running; // Speech engine started by wwvsim_init()
+
+// Tone schedules for each minute of the hour for each station
+// Special exception: no 440 Hz tone in first hour of UTC day; must be handled ad-hoc
+static int const WWV_tone_schedule[60] = {
+    0,600,440,  0,  0,600,500,600,  0,  0, // 3 is nist reserved at wwvh, 4 reserved at wwv; 8 research signal; 9-10 storms; 7 undoc wwv
+    0,600,500,600,500,600,  0,600,  0,600, // 14-15 GPS (no longer used - tones), 16 nist reserved, 18 geoalerts; 11 undoc wwv
+  500,600,500,600,500,600,500,600,500,  0, // 29 is silent to protect wwvh id
+    0,600,500,600,500,600,500,600,500,600, // 30 is station ID
+  500,600,500,  0,  0,  0,  0,  0,  0,  0, // 43-51 is silent period to protect wwvh
+    0,  0,500,600,500,600,500,600,500,  0  // 59 is silent to protect wwvh id; 52 new special at wwvh, not protected by wwv
+};
+
+static int const WWVH_tone_schedule[60] = {
+    0,440,600,  0,  0,500,600,  0,  0,  0, // 0 silent to protect wwv id; 3 nist reserved; 4 reserved at wwv; 7 protects undoc wwv; 8-10 to protect wwv
+    0,  0,600,500,  0,  0,  0,  0,  0,  0, // 14-19 is silent period to protect wwv; 11 silent to protect undoc wwv
+  600,500,600,500,600,500,600,500,600,  0, // 29 is station ID
+    0,500,600,500,600,500,600,500,600,500, // 30 silent to protect wwv id
+  600,500,600,500,600,  0,600,  0,  0,  0, // 43-44 GPS (unused-tones); 45 geoalerts; 47 nist reserved; 48-51 storms
+    0,  0,  0,500,600,500,600,500,600,  0  // 59 is station ID; 52 new special at wwvh?, NOT protected at WWV
+};
+
+// Overlay a tone with frequency 'freq' in audio buffer, overwriting whatever was there
+// starting at 'startms' within the minute and stopping one sample before 'stopms'.
+// Amplitude 1.0 is 100% modulation, 0.5 is 50% modulation, etc
+// Used first for 500/600 Hz continuous audio tones
+// Then used for 1000/1200 Hz minute/hour beeps and second ticks, which pre-empt everything else.
+int overlay_tone(float *output,int startms,int stopms,float freq,float amp){
+  if(startms < 0 || stopms <= startms || stopms > 61000)
+    return -1;
+
+  assert((startms * (int)freq % 1000) == 0); // All tones start with a positive zero crossing?
+
+  osc_tone(output + ms_samples(startms),ms_samples(stopms) - ms_samples(startms),freq,amp,0,false);
+  return 0;
+}
+
+// Same as overlay_tone() except that the tone is added to whatever is already in the audio buffer
+// Take care to avoid overmodulation; the result will be limited when quantized but could still sound bad
+// Used mainly for 100 Hz subcarrier
+int add_tone(float *output,int startms,int stopms,float freq,float amp){
+  if(startms < 0 || stopms <= startms || stopms > 61000)
+    return -1;
+
+  assert((startms * (int)freq % 1000) == 0); // All tones start with a positive zero crossing?
+
+  osc_tone(output + ms_samples(startms),ms_samples(stopms) - ms_samples(startms),freq,amp,0,true);
+  return 0;
+}
+
+// Blank out whatever is in the audio buffer starting at startms and ending just before stopms
+// Used mainly to blank out 40 ms guard interval around seconds ticks
+int overlay_silence(float *output,int startms,int stopms){
+  if(startms < 0 || stopms <= startms || stopms > 61000)
+    return -1;
+  output += ms_samples(startms);
+  int const samples = ms_samples(stopms) - ms_samples(startms);
+
+  memset(output,0,samples * sizeof(*output));
+  return 0;
+}
+
+// Encode a BCD digit in little-endian format (lsb first)
+// NB! Only WWV/WWVH; WWVB uses big-endian format
+static void encode(uint8_t *code,int x){
+  for(int i=0;i<4;i++){
+    code[i] = x & 1;
+    x >>= 1;
+  }
+}
+static int decode(uint8_t const *code){
+  int r = 0;
+
+  for(int i=3; i>=0; i--){
+    r <<= 1;
+    assert(code[i] == 0 || code[i] == 1);
+    r += code[i];
+  }
+  return r;
+}
+
+// Construct time code as array of **61** unsigned chars with values 0 or 1
+void maketimecode(uint8_t *code,int dut1,bool leap_pending,int year,int month,int day,int hour,int minute){
+    memset(code,0,61*sizeof(*code)); // All bits default to 0
+
+    int doy = day_of_year(year,month,day);
+    int dst_start = dst_start_doy(year);
+
+    if(dst_start >= 1){
+      // DST always lasts for 238 days
+      if(doy > dst_start && doy <= dst_start + 238)
+	code[2] = 1; // DST status at 00:00 UTC
+      if(doy >= dst_start && doy < dst_start + 238)
+	code[55] = 1; // DST status at 24:00 UTC
+#if 0
+      fprintf(stderr,"year %d month %d day %d doy %d dst_start_doy %d dst_start_doy + 238 %d\n",
+	      year, month, day, doy, dst_start, dst_start + 238);
+#endif
+    }
+
+    code[3] = leap_pending;
+
+    // Year
+    encode(code+4,year % 10); // Least significant digit
+    encode(code+51,(year/10)%10); // Tens digit
+
+    // Minute of hour, 0-59
+    encode(code+10,minute%10); // Least significant digit
+    encode(code+15,minute/10); // Most significant digit, extends into unused bit 18
+
+    // Hour of day, 0-23
+    encode(code+20,hour%10);   // Least significant digit
+    encode(code+25,hour/10);   // Most significant digit, extends into unused bits 27-28
+
+    // Day of year, 1-366
+    encode(code+30,doy%10);    // Least significant digit
+    encode(code+35,(doy/10)%10); // Middle digit
+    encode(code+40,doy/100);   // High digit, extends into unused bits 42-43
+
+    // UT1 offset, +/-0.0 through 0.7; adjusted after leap second
+    code[50] = (dut1 >= 0); // sign
+    encode(code+56,abs(dut1));  // magnitude, extends into marker 59 and is ignored
+}
+
+// Fields of a frame of timecode. Digits aren't range checked
+void parse_timecode(uint8_t const *code,struct timecode *tc){
+  tc->year = 10 * decode(code+51) + decode(code+4);
+  tc->doy = 100 * decode(code+40) + 10 * decode(code+35) + decode(code+30);
+  tc->hour = 10 * decode(code+25) + decode(code+20);
+  tc->minute = 10 * decode(code+15) + decode(code+10);
+  tc->dut1 = code[50] ? decode(code+56) : -decode(code+56);
+  tc->leap_pending = code[3];
+  tc->dst_start = code[2];
+  tc->dst_end = code[55];
+}
+
+// What the two DST bits say
+char const *dst_status(struct timecode const *tc){
+  if(tc->dst_start && tc->dst_end)
+    return "DST in effect";
+  else if(!tc->dst_start && tc->dst_end)
+    return "DST starts today";
+  else if(tc->dst_start && !tc->dst_end)
+    return "DST ends today";
+  else
+    return "DST not in effect";
+}
+
+// Decode frame of timecode to stderr for debugging
+void decode_timecode(uint8_t *code,int length){
+  for(int s=0;s<length;s++){
+    if((s % 10) == 0 && s < 60)
+      fprintf(stderr,"%02d: ",s);
+    if(s == 0)
+      fputc(' ',stderr);
+    else if((s % 10) == 9)
+      fprintf(stderr,"M");
+    else
+      fputc(code[s] ? '1' : '0',stderr);
+    if(s < 59 && (s % 10 == 9))
+      fputc('\n',stderr);
+  }
+  fputc('\n',stderr);
+  struct timecode tc;
+  parse_timecode(code,&tc);
+  fprintf(stderr,"year %02d doy %03d hour %02d minute %02d; dut1 %+d",tc.year,tc.doy,tc.hour,tc.minute,tc.dut1);
+
+  if(tc.leap_pending)
+    fprintf(stderr,"; leap second pending");
+
+  fprintf(stderr,"; %s",dst_status(&tc));
+  fprintf(stderr,"\n\n");
+}
+
+// Insert tone or announcement into seconds 1-44
+// Speech is written to 'voice' and its extent to 'span'
+// Return the frequency of the tone to play instead, if any
+static int gen_tone_or_announcement(struct broadcast const *b,int16_t *voice,int length,int hour,int minute,struct timespec const *deadline,struct span *span){
+  span->start = span->length = 0;
+
+  // A raw audio file pre-empts everything else
+  char *rawfilename = NULL;
+  char *textfilename = NULL;
+  int tone = 0;
+  int n;
+  bool const wwvh = b->wwvh;
+
+  if(!b->no_voice && asprintf(&rawfilename,"%s/%s/%d.raw",Libdir,wwvh ? "wwvh" : "wwv",minute)
+     && access(rawfilename,R_OK) == 0){
+    if((n = announce_audio_file(voice,length,rawfilename,1000)) > 0)
+      *span = (struct span){ Samprate, n };
+    goto done;
+  } else if(!b->no_voice && asprintf(&textfilename,"%s/%s/%d.txt",Libdir,wwvh ? "wwvh" : "wwv",minute)
+	    && access(textfilename,R_OK) == 0
+	    && (n = announce_text_file(voice,length,textfilename,1000,wwvh,deadline)) > 0){
+    *span = (struct span){ Samprate, n };
+    goto done;
+  } else if (!b->no_tone){
+    // Otherwise generate a tone, unless silent
+    // Also stands in for a text announcement whose speech is late
+    tone = wwvh ? WWVH_tone_schedule[minute] : WWV_tone_schedule[minute];
+
+    // Special case: no 440 Hz tone during hour 0
+    if(tone == 440 && hour == 0)
+      tone = 0;
+  }
+
+ done:;
+  if(rawfilename)
+    free(rawfilename);
+  if(textfilename)
+    free(textfilename);
+  return tone;
+}
+
+// Per-second waveform templates
+// Apart from speech, every second of the program is one of a few dozen
+// patterns: the continuous tone (if any), the 100 Hz subcarrier pulse, second
+// ticks, double ticks for UT1, guard intervals and minute/hour beeps. Each
+// pattern is rendered once, and minutes are assembled by block copy.
+enum subcarrier {
+  SUB_NONE,
+  SUB_ZERO,   // 200 ms
+  SUB_ONE,    // 500 ms
+  SUB_MARKER, // 800 ms
+};
+
+struct second_type {
+  int tone;         // 440, 500, 600 Hz or 0
+  enum subcarrier sub;
+  int beep;         // Minute or hour beep frequency, second 0 only
+  int tickfreq;     // 1000 Hz at WWV, 1200 Hz at WWVH
+  bool tick;        // Tick and guard interval at start of second
+  bool dut1_tick;   // Second tick at 100 ms for UT1 offset
+  bool guard_after; // Guard interval for next second's tick
+};
+
+struct template {
+  struct template *next;
+  struct second_type type;
+  int nopaque;
+  struct {
+    int start, end;
+  } opaque[3];      // Sample ranges, in order, where beeps, ticks and guards replace everything else
+  float *samples;   // One second
+};
+
+static struct template *Templates;
+static pthread_mutex_t Template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_opaque(struct template *t,int startms,int stopms){
+  t->opaque[t->nopaque].start = ms_samples(startms);
+  t->opaque[t->nopaque].end = ms_samples(stopms);
+  t->nopaque++;
+}
+
+// Field by field; memcmp() would see the padding after the bools
+static bool same_type(struct second_type const *a,struct second_type const *b){
+  return a->tone == b->tone && a->sub == b->sub && a->beep == b->beep && a->tickfreq == b->tickfreq
+    && a->tick == b->tick && a->dut1_tick == b->dut1_tick && a->guard_after == b->guard_after;
+}
+
+// Find or render the template for a type of second
+static struct template const *get_template(struct second_type const *type){
+  pthread_mutex_lock(&Template_mutex);
+  struct template *t;
+  for(t = Templates; t != NULL; t = t->next){
+    if(same_type(&t->type,type))
+      goto done;
+  }
+  // Amplitudes
+  const double tone_amp = pow(10.,-6.0/20.); // -6 dB
+  // NIST 250-67, p 50
+  const double marker_high_amp = pow(10.,-6.0/20.);
+  //  NIST 250-67, p 47 says 1/3.3 (about -10 dB) but is apparently incorrect; observed is ~ -20 dB
+  // WWV staff says it's meant to be off, but the hardware won't go there so they set it to minimum
+  //  const double marker_low_amp = marker_high_amp / 3.3;
+  //  const double marker_low_amp = marker_high_amp / 10;
+  const double marker_low_amp = 0;
+  const double tick_amp = 1.0; // 100%, 0dBFS
+
+  t = calloc(1,sizeof(*t));
+  assert(t != NULL);
+  t->type = *type;
+  t->samples = calloc(Samprate,sizeof(*t->samples));
+  assert(t->samples != NULL);
+
+  // Same layering as the real thing: tone, then subcarrier, then
+  // beeps, guard intervals and ticks pre-empting everything
+  if(type->tone)
+    add_tone(t->samples,0,1000,type->tone,tone_amp);
+
+  switch(type->sub){
+  case SUB_NONE:
+    break;
+  case SUB_MARKER:
+    add_tone(t->samples,0,800,100,marker_high_amp);	 // 800 ms position markers on seconds 9, 19, 29, ...
+    add_tone(t->samples,800,1000,100,marker_low_amp);
+    break;
+  case SUB_ONE:
+    add_tone(t->samples,0,500,100,marker_high_amp);	 // 500 ms = 1 bit
+    add_tone(t->samples,500,1000,100,marker_low_amp);
+    break;
+  case SUB_ZERO:
+    add_tone(t->samples,0,200,100,marker_high_amp);	 // 200 ms = 0 bit
+    add_tone(t->samples,200,1000,100,marker_low_amp);
+    break;
+  }
+  if(type->beep){
+    overlay_tone(t->samples,0,800,type->beep,tick_amp);
+    overlay_silence(t->samples,800,1000);
+    add_opaque(t,0,1000);
+  } else {
+    if(type->tick){
+      // Blank with silence from t-10 ms to t+30, total 40 ms
+      overlay_silence(t->samples,0,30);
+      overlay_tone(t->samples,0,5,type->tickfreq,tick_amp); // 5 ms tick at 100% modulation on second
+      add_opaque(t,0,30);
+    }
+    if(type->dut1_tick){
+      // Double ticks without guard time for UT1 offset
+      overlay_tone(t->samples,100,105,type->tickfreq,tick_amp); // 5 ms second tick at 100 ms
+      add_opaque(t,100,105);
+    }
+    if(type->guard_after){
+      overlay_silence(t->samples,990,1000);
+      add_opaque(t,990,1000);
+    }
+  }
+  t->next = Templates;
+  Templates = t;
+ done:;
+  pthread_mutex_unlock(&Template_mutex);
+  return t;
+}
+
+// Does second s of a minute 'length' seconds long get a tick and guard interval?
+static bool has_tick(int s,int length){
+  return s > 0 && s < length && s != 29 && s < 59; // No ticks or blanking on 29, 59 or 60
+}
+
+// Add speech to samples [start,end) of a second, except where its template blanks it
+// 'output' and 'voice' point to sample 'start'
+static void mix_speech(float *output,struct template const *t,int16_t const *voice,int start,int end){
+  int pos = start;
+  for(int i=0; i <= t->nopaque && pos < end; i++){
+    int const stop = i < t->nopaque && t->opaque[i].start < end ? t->opaque[i].start : end;
+    if(pos < stop){
+      mix_add(output + pos - start,voice + pos - start,stop - pos,1.0f/SHRT_MAX);
+      pos = stop;
+    }
+    if(i < t->nopaque && pos < t->opaque[i].end)
+      pos = t->opaque[i].end;
+  }
+}
+
+// Start minute 'm' of broadcast 'b'. By default speech is waited for as long as it takes;
+// the caller may set 'wait', 'earliest' and 'margin_ms' to impose deadlines
+// Speech goes into 'voice', 61 seconds long, which must stay with the plan until it's done
+void plan_init(struct minute_plan *p,struct broadcast const *b,struct minute_state const *m,int16_t *voice){
+  memset(p,0,sizeof(*p));
+  p->b = b;
+  p->m = *m;
+  p->wait = true;
+  if(!b->no_timecode)
+    maketimecode(p->code,m->dut1,m->leap_pending,m->year,m->month,m->day,m->hour,m->minute);
+  p->voice = b->no_voice ? NULL : voice;
+}
+
+// When speech starting 'startms' into the minute has to be ready, or NULL to wait for it
+static struct timespec const *speech_deadline(struct minute_plan const *p,int startms,struct timespec *deadline){
+  if(p->wait)
+    return NULL;
+  long long const ms = (long long)p->m.start * 1000 + startms - p->margin_ms;
+  deadline->tv_sec = ms / 1000;
+  deadline->tv_nsec = (ms % 1000) * 1000000;
+  if(deadline->tv_sec < p->earliest.tv_sec
+     || (deadline->tv_sec == p->earliest.tv_sec && deadline->tv_nsec < p->earliest.tv_nsec))
+    *deadline = p->earliest;
+  return deadline;
+}
+
+// Which template second 's' of the planned minute uses
+static struct template const *plan_template(struct minute_plan const *p,int s){
+  int const tickfreq = p->m.wwvh ? 1200 : 1000;
+  int const hourbeep = 1500; // Both WWV and WWVH
+  int const dut1 = p->m.dut1;
+
+  struct second_type type = {
+    .tone = (s >= 1 && s < 45) ? p->tone : 0, // Continuous tone from 1 sec until 45 sec
+    .sub = SUB_NONE, // No subcarrier during second 0 (minute/hour beep)
+    .beep = s == 0 ? (p->m.minute == 0 ? hourbeep : tickfreq) : 0,
+    .tickfreq = tickfreq,
+    .tick = has_tick(s,p->m.length),
+    .dut1_tick = (dut1 > 0 && s >= 1 && s <= dut1) || (-dut1 > 0 && s >= 9 && s <= 8-dut1),
+    .guard_after = has_tick(s+1,p->m.length),
+  };
+  if(!p->b->no_timecode && s != 0){
+    // Modulate time code onto 100 Hz subcarrier
+    if((s % 10) == 9)
+      type.sub = SUB_MARKER;
+    else
+      type.sub = p->code[s] ? SUB_ONE : SUB_ZERO;
+  }
+  return get_template(&type);
+}
+
+// Render samples [start,start+n) of a planned minute into 'output'
+// Blocks must be rendered in order; speech is settled as the first block reaching it is rendered
+void render_block(struct minute_plan *p,float *output,int start,int n){
+  int const end = start + n;
+  struct timespec deadline;
+
+  if(!p->slot_done && end > Samprate){
+    // Announcement in seconds 1-44, or the tone it replaces
+    p->tone = gen_tone_or_announcement(p->b,p->voice,p->m.length,p->m.hour,p->m.minute,
+				       speech_deadline(p,1000,&deadline),&p->spans[p->nspans]);
+    if(p->spans[p->nspans].length > 0)
+      p->nspans++;
+    p->slot_done = true;
+  }
+  int const time_ms = p->m.wwvh ? 45000 : 52500; // WWV: male voice at 52.5 seconds, WWVH: female voice at 45 seconds
+  if(!p->time_done && end > ms_samples(time_ms)){
+    p->time_done = true;
+    // Insert minute announcement
+    // What are the next hour and minute?
+    int nextminute = p->m.minute;
+    int nexthour = p->m.hour;
+    if(++nextminute == 60){
+      nextminute = 0;
+      if(++nexthour == 24)
+	nexthour = 0;
+    }
+    if(p->voice != NULL){
+      int const len = announce_time(p->voice,p->m.length,nexthour,nextminute,time_ms,p->m.wwvh,speech_deadline(p,time_ms,&deadline));
+      if(len > 0)
+	p->spans[p->nspans++] = (struct span){ ms_samples(time_ms), len };
+    }
+  }
+  // Assemble a second at a time, mixing in any speech
+  for(int pos = start; pos < end;){
+    int const s = pos / Samprate;
+    int const stop = (s+1)*Samprate < end ? (s+1)*Samprate : end;
+    struct template const *t = plan_template(p,s);
+    memcpy(output + pos - start,t->samples + pos - s*Samprate,(stop - pos)*sizeof(*output));
+
+    for(int i=0; i < p->nspans; i++){
+      int const a = p->spans[i].start > pos ? p->spans[i].start : pos;
+      int const b = p->spans[i].start + p->spans[i].length < stop ? p->spans[i].start + p->spans[i].length : stop;
+      if(a < b)
+	mix_speech(output + a - start,t,p->voice + a,a - s*Samprate,b - s*Samprate);
+    }
+    pos = stop;
+  }
+}
+
+// Speech goes into its own buffer, only the parts touched by 'spans' are valid
+// One per rendering thread, freed when the thread exits
+static pthread_key_t Voice_key;
+static pthread_once_t Voice_once = PTHREAD_ONCE_INIT;
+
+static void voice_key_init(void){
+  pthread_key_create(&Voice_key,free);
+}
+
+// This thread's speech buffer, or NULL if there's no memory for it
+static int16_t *voice_buffer(void){
+  pthread_once(&Voice_once,voice_key_init);
+  int16_t *voice = pthread_getspecific(Voice_key);
+  if(voice == NULL && (voice = malloc(61*Samprate*sizeof(*voice))) != NULL)
+    pthread_setspecific(Voice_key,voice);
+  return voice;
+}
+
+// Render broadcast samples [t0,t1) into 'output', waiting for any speech
+// Reentrant; intervals can be rendered in any order from any number of threads
+void render_interval(struct broadcast const *b,float *output,int64_t t0,int64_t t1){
+  int16_t *voice = NULL;
+  struct broadcast quiet;
+  if(!b->no_voice && (voice = voice_buffer()) == NULL){
+    // The tones and time code go on without it
+    fprintf(stderr,"Can't allocate speech buffer; rendering without speech\n");
+    quiet = *b;
+    quiet.no_voice = true;
+    b = &quiet;
+  }
+  while(t0 < t1){
+    struct minute_state m;
+    broadcast_minute(b,t0,&m);
+    struct minute_plan plan;
+    plan_init(&plan,b,&m,voice);
+    int const offset = t0 - m.sample;
+    int const n = t1 - t0 < m.length * Samprate - offset ? t1 - t0 : m.length * Samprate - offset;
+    render_block(&plan,output,offset,n);
+    output += n;
+    t0 += n;
+  }
+}
+
+
+// A generator: one station's broadcast, and where sequential rendering is in it
+struct wwvsim {
+  struct broadcast b;
+  int16_t *voice;           // Speech for 'plan'
+  int64_t position;         // Next sample for wwvsim_read()
+  bool planned;             // 'plan' holds the minute containing 'position'
+  struct minute_plan plan;
+  bool deadlines;           // Don't wait for late speech
+  int margin_ms;
+  struct timespec earliest;
+  int64_t render_ns;        // Spent rendering 'plan' so far
+};
+
+int wwvsim_init(struct wwvsim_setup const *setup){
+  if(setup->samprate != 0)
+    Samprate = setup->samprate;
+  if(Samprate < MIN_SAMPRATE || Samprate > MAX_SAMPRATE){
+    fprintf(stderr,"Sample rate %d outside %d-%d Hz\n",Samprate,MIN_SAMPRATE,MAX_SAMPRATE);
+    return -1;
+  }
+  Verbose = setup->verbose;
+  if(Verbose)
+    fprintf(stderr,"tone oscillator: %s\n",osc_name());
+  if(setup->no_voice)
+    return 0;
+
+  if(setup->tts_workers > 0)
+    Tts_workers = setup->tts_workers;
+  if(setup->cache_dir != NULL)
+    Cache_dir = setup->cache_dir;
+  Splice_speech = setup->clips;
+  if(tts_init(setup->tts) != 0)
+    return -1;
+  if(!setup->no_disk_cache)
+    speech_cache_init();
+  announce_prefetch_init(Tts_workers);
+  Speech_running = true;
+  return 0;
+}
+
+struct wwvsim *wwvsim_create(struct wwvsim_params const *params){
+  if(params->dut1 > 7 || params->dut1 < -7){
+    fprintf(stderr,"ut1 offset %d out of range -7 to +7 tenths\n",params->dut1);
+    return NULL;
+  }
+  if(params->leap > 1 || params->leap < -1){
+    fprintf(stderr,"Leap second %d must be -1, 0 or +1\n",params->leap);
+    return NULL;
+  }
+  if(!params->no_voice && !Speech_running){
+    fprintf(stderr,"Speech engine not started; generator must be no_voice\n");
+    return NULL;
+  }
+  struct wwvsim *w = calloc(1,sizeof(*w));
+  if(w == NULL)
+    return NULL;
+  broadcast_init(&w->b,params->wwvh,params->dut1,params->leap,params->leap_year,params->leap_month);
+  w->b.no_tone = params->no_tone;
+  w->b.no_voice = params->no_voice;
+  w->b.no_timecode = params->no_timecode;
+  if(!params->no_voice){
+    if((w->voice = malloc(61*Samprate*sizeof(*w->voice))) == NULL){
+      free(w);
+      return NULL;
+    }
+    tts_start(params->wwvh); // Load the voice ahead of need
+    // Without them this voice speaks whole sentences; others may still splice
+    if(Splice_speech && announce_clips_init(params->wwvh) != 0)
+      fprintf(stderr,"Can't render %s announcement clips; speaking whole sentences\n",params->wwvh ? "WWVH" : "WWV");
+  }
+  return w;
+}
+
+void wwvsim_destroy(struct wwvsim *w){
+  if(w == NULL)
+    return;
+  free(w->voice);
+  free(w);
+}
+
+int64_t wwvsim_sample(struct wwvsim const *w,time_t t){
+  return broadcast_sample(&w->b,t);
+}
+
+int64_t wwvsim_utc(struct wwvsim const *w,int year,int month,int day,int hour,int minute,int second){
+  return broadcast_utc(&w->b,year,month,day,hour,minute,second);
+}
+
+int64_t wwvsim_next_minute(struct wwvsim const *w,int64_t n){
+  struct minute_state m;
+  broadcast_minute(&w->b,n,&m);
+  return m.sample + m.length * Samprate;
+}
+
+void wwvsim_render(struct wwvsim const *w,float *output,int64_t t0,int64_t t1){
+  render_interval(&w->b,output,t0,t1);
+}
+
+void wwvsim_seek(struct wwvsim *w,int64_t position){
+  w->position = position;
+  w->planned = false;
+}
+
+void wwvsim_deadlines(struct wwvsim *w,int margin_ms,struct timespec const *earliest){
+  w->deadlines = true;
+  w->margin_ms = margin_ms;
+  w->earliest = *earliest;
+}
+
+int64_t wwvsim_read(struct wwvsim *w,float *output,int n){
+  int64_t const start = w->position;
+  struct minute_plan *p = &w->plan;
+
+  while(n > 0){
+    if(!w->planned || w->position >= p->m.sample + p->m.length * Samprate){
+      if(w->planned){
+	hist_add(&Stats.render_minute,w->render_ns / 1000);
+	if(Verbose && Stats.late_speech > 0)
+	  fprintf(stderr,"%ld announcements late so far\n",(long)Stats.late_speech);
+	if(Verbose && Stats.failed_speech > 0)
+	  fprintf(stderr,"%ld announcements failed so far\n",(long)Stats.failed_speech);
+      }
+      w->render_ns = 0;
+
+      struct minute_state m;
+      broadcast_minute(&w->b,w->position,&m);
+      // Keep the speech for the next few minutes rendering in the background
+      if(!w->b.no_voice)
+	announce_schedule(w->b.wwvh,m.hour,m.minute,PREFETCH_MINUTES);
+      plan_init(p,&w->b,&m,w->voice);
+      if(w->deadlines){
+	p->wait = false;
+	p->margin_ms = w->margin_ms;
+	p->earliest = w->earliest;
+      }
+      // Optionally dump timecode
+      if(Verbose && !w->b.no_timecode){
+	fprintf(stderr,"%d/%d/%d %02d:%02d\n",m.month,m.day,m.year,m.hour,m.minute);
+	decode_timecode(p->code,m.length);
+      }
+      w->planned = true;
+    }
+    int const pos = w->position - p->m.sample;
+    int const len = p->m.length * Samprate - pos < n ? p->m.length * Samprate - pos : n;
+    int64_t const start_ns = monotonic_ns();
+    render_block(p,output,pos,len);
+    w->render_ns += monotonic_ns() - start_ns;
+    output += len;
+    n -= len;
+    w->position += len;
+  }
+  return start;
+}
@@ -0,0 +1,175 @@
+// Sample rate conversion for speech and other audio assets
+// Polyphase Kaiser-windowed sinc at the exact rational ratio of the two
+// rates: with outrate/inrate = up/down in lowest terms, output sample n falls
+// n*down/up input samples in, at one of 'up' fixed fractional positions, so
+// each position gets its own precomputed set of taps and no interpolation.
+// Lowpass cutoff follows the lower of the two rates so downsampling doesn't
+// alias. Filter banks are built on first use of a pair of rates and kept.
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+#define RS_HALF 16      // Filter half-width in input samples at unity ratio
+#define RS_CUTOFF 0.92  // Fraction of the Nyquist rate passed
+#define RS_BETA 8.0     // Kaiser window parameter, ~80 dB stopband
+#define RS_MAX_PHASES 4096 // Beyond this, positions are rounded to 1/4096 sample
+
+struct filter_bank {
+  struct filter_bank *next;
+  int inrate, outrate;
+  int up, down;   // outrate/inrate in lowest terms
+  int phases;     // 'up', or RS_MAX_PHASES if that's less
+  int half;       // Taps up to and including the nearest input sample at or before the output
+  int ntaps;      // Per phase, a multiple of 4
+  float *taps;    // phases x ntaps
+};
+
+static struct filter_bank *Banks;
+static pthread_mutex_t Bank_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Zeroth order modified Bessel function of the first kind, for Kaiser windows
+double bessel_i0(double x){
+  double sum = 1, term = 1;
+  for(int k=1; k < 40; k++){
+    term *= (x / (2*k)) * (x / (2*k));
+    sum += term;
+    if(term < 1e-12 * sum)
+      break;
+  }
+  return sum;
+}
+
+static long gcd(long a,long b){
+  while(b != 0){
+    long const t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Find or build the filter bank for a pair of rates
+static struct filter_bank const *get_bank(int inrate,int outrate){
+  pthread_mutex_lock(&Bank_mutex);
+  struct filter_bank *fb;
+  for(fb = Banks; fb != NULL; fb = fb->next){
+    if(fb->inrate == inrate && fb->outrate == outrate)
+      goto done;
+  }
+  if((fb = calloc(1,sizeof(*fb))) == NULL)
+    goto done;
+  long const g = gcd(inrate,outrate);
+  fb->inrate = inrate;
+  fb->outrate = outrate;
+  fb->up = outrate / g;
+  fb->down = inrate / g;
+  fb->phases = fb->up < RS_MAX_PHASES ? fb->up : RS_MAX_PHASES;
+  double const fc = fb->up < fb->down ? (double)fb->up / fb->down : 1; // Cutoff scaling when downsampling
+  double const width = RS_HALF / fc; // Window half-width, input samples
+  fb->half = ceil(width);
+  fb->ntaps = (2 * fb->half + 3) & ~3;
+  if((fb->taps = malloc((size_t)fb->phases * fb->ntaps * sizeof(*fb->taps))) == NULL){
+    free(fb);
+    fb = NULL;
+    goto done;
+  }
+  // Phase p at input sample i weights in[i - half + 1 + k] by taps[p][k],
+  // normalized to unity gain
+  double const norm = bessel_i0(RS_BETA);
+  for(int p=0; p < fb->phases; p++){
+    float *t = fb->taps + (size_t)p * fb->ntaps;
+    double sum = 0;
+    for(int k=0; k < fb->ntaps; k++){
+      double const d = (double)p / fb->phases + fb->half - 1 - k;
+      double const r = d / width;
+      double const window = fabs(r) < 1 ? bessel_i0(RS_BETA * sqrt(1 - r*r)) / norm : 0;
+      double const arg = M_PI * RS_CUTOFF * fc * d;
+      t[k] = window * (d == 0 ? 1.0 : sin(arg)/arg);
+      sum += t[k];
+    }
+    for(int k=0; k < fb->ntaps; k++)
+      t[k] /= sum;
+  }
+  fb->next = Banks;
+  Banks = fb;
+ done:;
+  pthread_mutex_unlock(&Bank_mutex);
+  return fb;
+}
+
+// Number of output samples produced by resample()
+int resample_length(int inlen,int inrate,int outrate){
+  return (int64_t)inlen * outrate / inrate;
+}
+
+// Convert 'inlen' samples at 'inrate' to 'outrate'
+// 'out' must have room for resample_length() samples, which is also returned
+// Return -1 on error
+int resample(float *out,int outrate,float const *in,int inlen,int inrate){
+  struct filter_bank const *fb = get_bank(inrate,outrate);
+  if(fb == NULL)
+    return -1;
+
+  // Zeros before and after, so the filter never runs off the end
+  int const pad = fb->ntaps;
+  float *x = calloc(inlen + 2 * pad,sizeof(*x));
+  if(x == NULL)
+    return -1;
+  memcpy(x + pad,in,inlen * sizeof(*x));
+
+  int const outlen = resample_length(inlen,inrate,outrate);
+  for(int n=0; n < outlen; n++){
+    int64_t const pos = (int64_t)n * fb->down;
+    int64_t center = pos / fb->up;
+    int p = pos % fb->up;
+    if(fb->phases != fb->up){
+      p = ((int64_t)p * fb->phases + fb->up / 2) / fb->up;
+      if(p == fb->phases){
+	p = 0;
+	center++;
+      }
+    }
+    float const *t = fb->taps + (size_t)p * fb->ntaps;
+    float const *s = x + pad + center - fb->half + 1;
+    v4sf acc = {0,0,0,0};
+    for(int k=0; k < fb->ntaps; k += 4)
+      acc += load4(t + k) * load4(s + k);
+    out[n] = acc[0] + acc[1] + acc[2] + acc[3];
+  }
+  free(x);
+  return outlen;
+}
+
+// Convert 'length' samples at 'rate' into malloc'ed 16-bit PCM at Samprate
+// Return number of samples, or -1 on error
+int resample_pcm(int16_t **samples,float const *in,int length,int rate){
+  *samples = NULL;
+  float *pcm = NULL;
+  if(rate != Samprate){
+    int const outlen = resample_length(length,rate,Samprate);
+    if((pcm = malloc(outlen * sizeof(*pcm))) == NULL)
+      return -1;
+    if((length = resample(pcm,Samprate,in,length,rate)) < 0){
+      free(pcm);
+      return -1;
+    }
+    in = pcm;
+  }
+  int16_t *buffer = malloc(length * sizeof(*buffer));
+  if(buffer == NULL){
+    free(pcm);
+    return -1;
+  }
+  for(int i=0; i < length; i++){
+    float const s = in[i] * 32768;
+    buffer[i] = s > SHRT_MAX ? SHRT_MAX : s < -SHRT_MAX ? -SHRT_MAX : s;
+  }
+  free(pcm);
+  *samples = buffer;
+  return length;
+}
@@ -0,0 +1,109 @@
+// Single producer, single consumer sample ring for wwvsim
+// The two indices are free-running counts of samples written and read, each
+// advanced by only one thread, so the data path takes no locks. A mutex and
+// condition variable are used only to sleep when the ring is full or empty,
+// and only when the other side has announced that it's waiting.
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+// Allocate a ring of 'size' samples of 'width' bytes each
+// Return 0 on success, -1 on error
+int ring_init(struct ring *r,int size,int width){
+  r->buffer = malloc((size_t)size * width);
+  if(r->buffer == NULL)
+    return -1;
+  r->size = size;
+  r->width = width;
+  atomic_init(&r->head,0);
+  atomic_init(&r->tail,0);
+  atomic_init(&r->waiters,0);
+  pthread_mutex_init(&r->mutex,NULL);
+  pthread_cond_init(&r->cond,NULL);
+  return 0;
+}
+
+void ring_free(struct ring *r){
+  free(r->buffer);
+  r->buffer = NULL;
+  pthread_mutex_destroy(&r->mutex);
+  pthread_cond_destroy(&r->cond);
+}
+
+// Samples available to the consumer
+int ring_count(struct ring *r){
+  return atomic_load(&r->head) - atomic_load(&r->tail);
+}
+
+// Room for the producer
+int ring_space(struct ring *r){
+  return r->size - ring_count(r);
+}
+
+// Wake the other side if it's waiting
+static void ring_notify(struct ring *r){
+  if(atomic_load(&r->waiters) == 0)
+    return;
+  pthread_mutex_lock(&r->mutex);
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+}
+
+// Producer: wait for space, then return a pointer to the contiguous free
+// region and its length in samples, at most 'max'
+void *ring_write_space(struct ring *r,int max,int *len){
+  uint64_t const head = atomic_load_explicit(&r->head,memory_order_relaxed);
+  if(r->size - (int)(head - atomic_load(&r->tail)) == 0){
+    pthread_mutex_lock(&r->mutex);
+    atomic_fetch_add(&r->waiters,1);
+    while(r->size - (int)(head - atomic_load(&r->tail)) == 0)
+      pthread_cond_wait(&r->cond,&r->mutex);
+    atomic_fetch_sub(&r->waiters,1);
+    pthread_mutex_unlock(&r->mutex);
+  }
+  int const offset = head % r->size;
+  int n = r->size - (int)(head - atomic_load(&r->tail));
+  if(n > r->size - offset)
+    n = r->size - offset;
+  if(n > max)
+    n = max;
+  *len = n;
+  return r->buffer + (size_t)offset * r->width;
+}
+
+// Producer: publish 'len' samples written to the region from ring_write_space()
+void ring_commit(struct ring *r,int len){
+  atomic_fetch_add(&r->head,len);
+  ring_notify(r);
+}
+
+// Consumer: wait for data, then return a pointer to the contiguous readable
+// region and its length in samples, at most 'max'
+void *ring_read_data(struct ring *r,int max,int *len){
+  uint64_t const tail = atomic_load_explicit(&r->tail,memory_order_relaxed);
+  if(atomic_load(&r->head) == tail){
+    pthread_mutex_lock(&r->mutex);
+    atomic_fetch_add(&r->waiters,1);
+    while(atomic_load(&r->head) == tail)
+      pthread_cond_wait(&r->cond,&r->mutex);
+    atomic_fetch_sub(&r->waiters,1);
+    pthread_mutex_unlock(&r->mutex);
+  }
+  int const offset = tail % r->size;
+  int n = atomic_load(&r->head) - tail;
+  if(n > r->size - offset)
+    n = r->size - offset;
+  if(n > max)
+    n = max;
+  *len = n;
+  return r->buffer + (size_t)offset * r->width;
+}
+
+// Consumer: release 'len' samples returned by ring_read_data()
+void ring_consume(struct ring *r,int len){
+  atomic_fetch_add(&r->tail,len);
+  ring_notify(r);
+}
@@ -0,0 +1,158 @@
+// Performance counters and pipeline tracing for wwvsim
+// Counters and histograms are process-wide atomics, updated from whichever
+// thread does the work and read without stopping anyone. Histograms count
+// durations in power-of-two buckets of microseconds, so they cost one
+// increment to update and say how close the worst case came to a deadline.
+// The optional trace is a Chrome trace event file (chrome://tracing,
+// Perfetto) with a complete event for each stage of the pipeline, one
+// track per thread.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "wwvsim.h"
+
+struct stats Stats;
+
+static FILE *Trace;
+static atomic_bool Tracing; // Trace is open, checked without the lock
+static pthread_mutex_t Trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t Trace_epoch;
+static atomic_int Trace_threads;
+static _Thread_local int Trace_tid; // 0 until the thread's first event
+
+int64_t monotonic_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Count a duration in a histogram
+void hist_add(struct histogram *h,int64_t us){
+  if(us < 0)
+    us = 0;
+  int bucket = 0;
+  while(bucket < HIST_BUCKETS - 1 && (1LL << (bucket + 1)) <= us)
+    bucket++;
+  atomic_fetch_add(&h->buckets[bucket],1);
+  atomic_fetch_add(&h->count,1);
+  atomic_fetch_add(&h->sum_us,us);
+  long max = atomic_load(&h->max_us);
+  while(us > max && !atomic_compare_exchange_weak(&h->max_us,&max,us))
+    ;
+}
+
+// Upper edge of the bucket holding fraction 'q' of the counts
+static long hist_quantile(struct histogram const *h,long count,double q){
+  long seen = 0;
+  for(int i=0; i < HIST_BUCKETS; i++){
+    seen += atomic_load(&h->buckets[i]);
+    if(seen > 0 && seen >= q * count)
+      return 1L << (i + 1);
+  }
+  return 0;
+}
+
+static void hist_json(FILE *fp,char const *name,struct histogram const *h){
+  long const count = atomic_load(&h->count);
+  fprintf(fp,"\"%s\":{\"count\":%ld",name,count);
+  if(count > 0){
+    fprintf(fp,",\"mean_us\":%ld,\"p50_us\":%ld,\"p99_us\":%ld,\"max_us\":%ld",
+	    atomic_load(&h->sum_us) / count,hist_quantile(h,count,0.5),hist_quantile(h,count,0.99),
+	    atomic_load(&h->max_us));
+    // Bucket i counts [2^i, 2^(i+1)) microseconds, the first from 0
+    int last = HIST_BUCKETS - 1;
+    while(last > 0 && atomic_load(&h->buckets[last]) == 0)
+      last--;
+    fprintf(fp,",\"buckets\":[");
+    for(int i=0; i <= last; i++)
+      fprintf(fp,"%s%ld",i == 0 ? "" : ",",atomic_load(&h->buckets[i]));
+    fprintf(fp,"]");
+  }
+  fprintf(fp,"}");
+}
+
+int wwvsim_stats_json(FILE *fp){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME,&now);
+  fprintf(fp,"{\"time\":%lld.%03ld,\"samprate\":%d,",(long long)now.tv_sec,now.tv_nsec / 1000000,Samprate);
+  fprintf(fp,"\"late_speech\":%ld,\"failed_speech\":%ld,\"clipped_samples\":%ld,",
+	  atomic_load(&Stats.late_speech),atomic_load(&Stats.failed_speech),atomic_load(&Stats.clipped));
+  fprintf(fp,"\"underruns\":%ld,\"ring_empty\":%ld,\"ring_ms\":%ld,",
+	  atomic_load(&Stats.underruns),atomic_load(&Stats.ring_empty),atomic_load(&Stats.ring_ms));
+  fprintf(fp,"\"clock_offset_us\":%ld,\"clock_ppm\":%.3f,",
+	  atomic_load(&Stats.clock_offset_us),atomic_load(&Stats.clock_ppb) / 1e3);
+  hist_json(fp,"render_minute",&Stats.render_minute);
+  fputc(',',fp);
+  hist_json(fp,"render_block",&Stats.render_block);
+  fputc(',',fp);
+  hist_json(fp,"output_write",&Stats.output_write);
+  fputc(',',fp);
+  hist_json(fp,"ring_depth",&Stats.ring_depth);
+  fprintf(fp,",\"speech\":{");
+  bool first = true;
+  for(int i=0; i < STATS_BACKENDS && tts_backend(i) != NULL; i++){
+    if(atomic_load(&Stats.speech[i].count) == 0)
+      continue;
+    if(!first)
+      fputc(',',fp);
+    hist_json(fp,tts_backend(i),&Stats.speech[i]);
+    first = false;
+  }
+  fprintf(fp,"}}\n");
+  return ferror(fp) ? -1 : 0;
+}
+
+int wwvsim_trace_open(char const *file){
+  FILE *fp = fopen(file,"w");
+  if(fp == NULL){
+    fprintf(stderr,"Can't create %s: %s\n",file,strerror(errno));
+    return -1;
+  }
+  pthread_mutex_lock(&Trace_mutex);
+  Trace_epoch = monotonic_ns();
+  fprintf(fp,"[\n");
+  Trace = fp;
+  atomic_store(&Tracing,true);
+  pthread_mutex_unlock(&Trace_mutex);
+  return 0;
+}
+
+void wwvsim_trace_close(void){
+  pthread_mutex_lock(&Trace_mutex);
+  atomic_store(&Tracing,false);
+  if(Trace != NULL){
+    fprintf(Trace,"{\"name\":\"end\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":0}\n]\n",
+	    (monotonic_ns() - Trace_epoch) / 1e3);
+    fclose(Trace);
+    Trace = NULL;
+  }
+  pthread_mutex_unlock(&Trace_mutex);
+}
+
+// Record a stage that began at 'start' (from monotonic_ns()) and ends now
+// A viewer takes the file as is, even if the program never closes it
+void trace_event(char const *name,int64_t start){
+  if(!atomic_load_explicit(&Tracing,memory_order_relaxed))
+    return;
+  int64_t const end = monotonic_ns();
+  pthread_mutex_lock(&Trace_mutex);
+  if(Trace != NULL){
+    if(Trace_tid == 0){
+      // Name the thread's track
+      Trace_tid = atomic_fetch_add(&Trace_threads,1) + 1;
+      char thread[32] = "";
+      pthread_getname_np(pthread_self(),thread,sizeof(thread));
+      fprintf(Trace,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+	      Trace_tid,thread[0] != '\0' ? thread : "main");
+    }
+    fprintf(Trace,"{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},\n",
+	    name,(start - Trace_epoch) / 1e3,(end - start) / 1e3,Trace_tid);
+    fflush(Trace);
+  }
+  pthread_mutex_unlock(&Trace_mutex);
+}
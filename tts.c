@@ -0,0 +1,686 @@
+// Text to speech backends for wwvsim
+//
+// In-process synthesizers are loaded with dlopen() so wwvsim neither links
+// against nor requires them: libpiper (the C API from piper1-gpl) and
+// libespeak-ng. They hand PCM straight back to the caller, which resamples it
+// to Samprate. Without libpiper, a pool of long-lived piper processes avoids
+// reloading the voice model for every announcement. When nothing else is
+// available the old path is used: run the synthesizer and sox through
+// system() with temporary files.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "wwvsim.h"
+
+extern char **environ;
+
+int Tts_workers = 2;
+
+struct tts_backend {
+  char const *name;
+  int (*init)(void); // Return 0 if usable
+  void (*start)(bool female); // Optional: get ready to speak with this voice
+  char const *(*voice)(bool female);
+  // Return malloc'ed mono PCM, full scale +/-1, and its sample rate
+  int (*synth)(char const *text,bool female,float **samples,int *rate);
+};
+
+static struct tts_backend const *Backend;
+
+// Collect chunks of synthesized audio into one growing buffer
+struct pcm_buffer {
+  float *samples;
+  int length;
+  int size;
+};
+
+static int pcm_append(struct pcm_buffer *pcm,float const *samples,int n){
+  if(pcm->length + n > pcm->size){
+    int size = pcm->size ? pcm->size : 65536;
+    while(size < pcm->length + n)
+      size *= 2;
+    float *new = realloc(pcm->samples,size * sizeof(*new));
+    if(new == NULL)
+      return -1;
+    pcm->samples = new;
+    pcm->size = size;
+  }
+  memcpy(pcm->samples + pcm->length,samples,n * sizeof(*samples));
+  pcm->length += n;
+  return 0;
+}
+
+// Open the first of several library names that exists
+static void *dlopen_any(char const * const *names){
+  for(int i=0; names[i] != NULL; i++){
+    void *handle = dlopen(names[i],RTLD_NOW|RTLD_LOCAL);
+    if(handle != NULL){
+      if(Verbose)
+	fprintf(stderr,"Loaded %s\n",names[i]);
+      return handle;
+    }
+  }
+  return NULL;
+}
+
+// Piper voice models, shared by the library and command backends
+#define PIPER_MODELS "/usr/local/lib/piper"
+static char const *piper_voice(bool female){
+  return female ? "en_US-kathleen-low.onnx" : "en_US-ryan-medium.onnx";
+}
+
+static char const *espeak_voice(bool female){
+  return female ? "en-us+f3" : "en-us";
+}
+
+
+// libpiper, from piper1-gpl
+// Mirrors libpiper/include/piper.h as of piper1-gpl v1.3.0, the first
+// release with the C API. Only the leading members of piper_audio_chunk
+// are declared (then phonemes, phoneme ids and alignments, each a pointer
+// and a count); the padding leaves room for those and for growth
+typedef struct piper_synthesizer piper_synthesizer;
+typedef struct {
+  float const *samples;
+  size_t num_samples;
+  int sample_rate;
+  bool is_last;
+  char pad[256];
+} piper_audio_chunk;
+_Static_assert(sizeof(piper_audio_chunk) >= offsetof(piper_audio_chunk,pad) + 6 * sizeof(void *),
+	       "piper_audio_chunk smaller than libpiper's");
+#define PIPER_OK 0
+#define PIPER_DONE 1
+
+static struct {
+  piper_synthesizer *(*create)(char const *model,char const *config,char const *espeak_data);
+  int (*start)(piper_synthesizer *,char const *text,void const *options);
+  int (*next)(piper_synthesizer *,piper_audio_chunk *);
+  piper_synthesizer *voices[2]; // Loaded on first use, indexed by female
+  pthread_mutex_t lock;
+} Piper = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int piper_lib_init(void){
+  static char const * const names[] = { "libpiper.so", "libpiper.so.1", "libpiper.dylib", NULL };
+  void *handle = dlopen_any(names);
+  if(handle == NULL)
+    return -1;
+  Piper.create = dlsym(handle,"piper_create");
+  Piper.start = dlsym(handle,"piper_synthesize_start");
+  Piper.next = dlsym(handle,"piper_synthesize_next");
+  // Also in v1.3.0; a library without it isn't the one declared above
+  void const *options = dlsym(handle,"piper_default_synthesize_options");
+  if(Piper.create == NULL || Piper.start == NULL || Piper.next == NULL || options == NULL){
+    fprintf(stderr,"libpiper isn't the version wwvsim was written for (piper1-gpl v1.3.0)\n");
+    dlclose(handle);
+    return -1;
+  }
+  return 0;
+}
+
+static int piper_lib_synth(char const *text,bool female,float **samples,int *rate){
+  *samples = NULL;
+  pthread_mutex_lock(&Piper.lock);
+  if(Piper.voices[female] == NULL){
+    char *model = NULL;
+    char *config = NULL;
+    char const *espeak_data = getenv("ESPEAK_DATA_PATH");
+    if(asprintf(&model,"%s/%s",PIPER_MODELS,piper_voice(female)) != -1
+       && asprintf(&config,"%s.json",model) != -1)
+      Piper.voices[female] = (*Piper.create)(model,config,espeak_data ? espeak_data : "/usr/share/espeak-ng-data");
+    free(model);
+    free(config);
+  }
+  piper_synthesizer *synth = Piper.voices[female];
+  struct pcm_buffer pcm = {0};
+  int r = -1;
+  if(synth == NULL || (*Piper.start)(synth,text,NULL) != PIPER_OK)
+    goto done;
+
+  piper_audio_chunk chunk;
+  int ret;
+  do {
+    // PIPER_DONE need not fill in the chunk
+    memset(&chunk,0,sizeof(chunk));
+    ret = (*Piper.next)(synth,&chunk);
+    if(ret != PIPER_OK && ret != PIPER_DONE)
+      break;
+    if(chunk.num_samples > 0 && chunk.samples != NULL){
+      if(chunk.sample_rate < 8000 || chunk.sample_rate > 192000){
+	fprintf(stderr,"libpiper returned a sample rate of %d; not the expected API version?\n",chunk.sample_rate);
+	goto done;
+      }
+      if(pcm_append(&pcm,chunk.samples,chunk.num_samples) != 0)
+	goto done;
+      *rate = chunk.sample_rate;
+    }
+  } while(ret == PIPER_OK && !chunk.is_last);
+  if(pcm.length > 0){
+    *samples = pcm.samples;
+    pcm.samples = NULL;
+    r = pcm.length;
+  }
+ done:;
+  pthread_mutex_unlock(&Piper.lock);
+  free(pcm.samples);
+  return r;
+}
+
+
+// libespeak-ng, synchronous mode
+// The API is global and not reentrant, so one utterance at a time
+#define ESPEAK_OUTPUT_SYNCHRONOUS 2
+#define ESPEAK_VOLUME 2
+#define ESPEAK_POS_CHARACTER 1
+#define ESPEAK_CHARS_AUTO 0
+
+static struct {
+  int (*synth)(void const *text,size_t size,unsigned position,int position_type,unsigned end_position,unsigned flags,unsigned *id,void *user);
+  int (*synchronize)(void);
+  int (*set_voice)(char const *name);
+  int (*set_parameter)(int parameter,int value,int relative);
+  int rate;
+  struct pcm_buffer *pcm; // Receives audio from the callback
+  pthread_mutex_t lock;
+} Espeak = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int espeak_callback(short *wav,int numsamples,void *events){
+  if(wav == NULL || numsamples <= 0 || Espeak.pcm == NULL)
+    return 0;
+  float buffer[numsamples];
+  for(int i=0; i < numsamples; i++)
+    buffer[i] = wav[i] * (1.0f / 32768);
+  return pcm_append(Espeak.pcm,buffer,numsamples) == 0 ? 0 : 1; // Nonzero aborts synthesis
+}
+
+static int espeak_lib_init(void){
+  static char const * const names[] = { "libespeak-ng.so.1", "libespeak-ng.so", "libespeak-ng.dylib", NULL };
+  void *handle = dlopen_any(names);
+  if(handle == NULL)
+    return -1;
+
+  int (*initialize)(int output,int buflength,char const *path,int options) = dlsym(handle,"espeak_Initialize");
+  void (*set_callback)(int (*)(short *,int,void *)) = dlsym(handle,"espeak_SetSynthCallback");
+  Espeak.synth = dlsym(handle,"espeak_Synth");
+  Espeak.synchronize = dlsym(handle,"espeak_Synchronize");
+  Espeak.set_voice = dlsym(handle,"espeak_SetVoiceByName");
+  Espeak.set_parameter = dlsym(handle,"espeak_SetParameter");
+  if(initialize == NULL || set_callback == NULL || Espeak.synth == NULL || Espeak.synchronize == NULL
+     || Espeak.set_voice == NULL || Espeak.set_parameter == NULL){
+    dlclose(handle);
+    return -1;
+  }
+  Espeak.rate = (*initialize)(ESPEAK_OUTPUT_SYNCHRONOUS,0,NULL,0);
+  if(Espeak.rate <= 0){
+    dlclose(handle);
+    return -1;
+  }
+  (*set_callback)(espeak_callback);
+  (*Espeak.set_parameter)(ESPEAK_VOLUME,70,0); // Same as -a 70 on the command line
+  return 0;
+}
+
+static int espeak_lib_synth(char const *text,bool female,float **samples,int *rate){
+  *samples = NULL;
+  struct pcm_buffer pcm = {0};
+  int r = -1;
+
+  pthread_mutex_lock(&Espeak.lock);
+  Espeak.pcm = &pcm;
+  if((*Espeak.set_voice)(espeak_voice(female)) == 0
+     && (*Espeak.synth)(text,strlen(text)+1,0,ESPEAK_POS_CHARACTER,0,ESPEAK_CHARS_AUTO,NULL,NULL) == 0
+     && (*Espeak.synchronize)() == 0
+     && pcm.length > 0){
+    *samples = pcm.samples;
+    *rate = Espeak.rate;
+    r = pcm.length;
+    pcm.samples = NULL;
+  }
+  Espeak.pcm = NULL;
+  pthread_mutex_unlock(&Espeak.lock);
+  free(pcm.samples);
+  return r;
+}
+
+
+// Pool of persistent piper processes, one voice model each
+// Piper reads one utterance per line on stdin; with --output_dir it writes
+// each to its own WAV file and prints the file's name on stdout. The
+// directory is in /dev/shm when available so nothing touches a disk.
+#define PIPER_PROGRAM "/usr/local/bin/piper"
+#define MAX_WORKERS 16
+
+struct worker {
+  pid_t pid;
+  FILE *in;     // Text to piper
+  FILE *out;    // WAV file names from piper
+  bool female;
+  bool busy;
+  char dir[64];
+};
+
+static struct {
+  struct worker workers[2][MAX_WORKERS]; // Indexed by female
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Read a 16-bit mono WAV file, converting to float
+// Return number of samples, or -1 on error
+static int read_wav_file(char const *file,float **samples,int *rate){
+  *samples = NULL;
+  FILE *fp = fopen(file,"r");
+  if(fp == NULL)
+    return -1;
+
+  int r = -1;
+  uint8_t hdr[12];
+  if(fread(hdr,1,sizeof(hdr),fp) != sizeof(hdr) || memcmp(hdr,"RIFF",4) != 0 || memcmp(hdr+8,"WAVE",4) != 0)
+    goto done;
+
+  int channels = 0, bits = 0;
+  while(true){
+    uint8_t chunk[8];
+    if(fread(chunk,1,sizeof(chunk),fp) != sizeof(chunk))
+      goto done;
+    uint32_t const size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+    if(memcmp(chunk,"fmt ",4) == 0 && size >= 16){
+      uint8_t fmt[16];
+      if(fread(fmt,1,sizeof(fmt),fp) != sizeof(fmt) || fseek(fp,size - sizeof(fmt) + (size & 1),SEEK_CUR) != 0)
+	goto done;
+      channels = fmt[2] | fmt[3] << 8;
+      *rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | (uint32_t)fmt[7] << 24;
+      bits = fmt[14] | fmt[15] << 8;
+    } else if(memcmp(chunk,"data",4) == 0){
+      if(channels != 1 || bits != 16)
+	goto done;
+      int length = size / 2;
+      uint8_t *buffer = malloc(2 * length);
+      float *fbuffer = malloc(length * sizeof(*fbuffer));
+      if(buffer == NULL || fbuffer == NULL || (length = fread(buffer,2,length,fp)) <= 0){
+	free(buffer);
+	free(fbuffer);
+	goto done;
+      }
+      for(int i=0; i < length; i++)
+	fbuffer[i] = (int16_t)(buffer[2*i] | buffer[2*i+1] << 8) * (1.0f / 32768); // Little endian
+      free(buffer);
+      *samples = fbuffer;
+      r = length;
+      goto done;
+    } else if(fseek(fp,size + (size & 1),SEEK_CUR) != 0)
+      goto done;
+  }
+ done:;
+  fclose(fp);
+  return r;
+}
+
+static void worker_stop(struct worker *w){
+  if(w->in != NULL)
+    fclose(w->in);
+  if(w->out != NULL)
+    fclose(w->out);
+  w->in = w->out = NULL;
+  if(w->pid > 0){
+    kill(w->pid,SIGTERM);
+    waitpid(w->pid,NULL,0);
+  }
+  w->pid = 0;
+  if(w->dir[0] != '\0')
+    rmdir(w->dir);
+  w->dir[0] = '\0';
+}
+
+// Start one piper process for the specified voice
+static int worker_start(struct worker *w,bool female){
+  w->female = female;
+  snprintf(w->dir,sizeof(w->dir),"%s/wwvsimXXXXXX",access("/dev/shm",W_OK) == 0 ? "/dev/shm" : "/tmp");
+  if(mkdtemp(w->dir) == NULL){
+    w->dir[0] = '\0';
+    return -1;
+  }
+  char *model = NULL;
+  if(asprintf(&model,"%s/%s",PIPER_MODELS,piper_voice(female)) == -1)
+    return -1;
+
+  int to_child[2], from_child[2];
+  if(pipe(to_child) != 0){
+    free(model);
+    return -1;
+  }
+  if(pipe(from_child) != 0){
+    close(to_child[0]);
+    close(to_child[1]);
+    free(model);
+    return -1;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions,to_child[0],0);
+  posix_spawn_file_actions_adddup2(&actions,from_child[1],1);
+  posix_spawn_file_actions_addclose(&actions,to_child[1]);
+  posix_spawn_file_actions_addclose(&actions,from_child[0]);
+
+  char *argv[] = { PIPER_PROGRAM, "--model", model, "--output_dir", w->dir, "--quiet", NULL };
+  int const ret = posix_spawn(&w->pid,PIPER_PROGRAM,&actions,NULL,argv,environ);
+  posix_spawn_file_actions_destroy(&actions);
+  free(model);
+  close(to_child[0]);
+  close(from_child[1]);
+  if(ret != 0){
+    close(to_child[1]);
+    close(from_child[0]);
+    w->pid = 0;
+    worker_stop(w);
+    return -1;
+  }
+  w->in = fdopen(to_child[1],"w");
+  w->out = fdopen(from_child[0],"r");
+  if(w->in == NULL || w->out == NULL){
+    worker_stop(w);
+    return -1;
+  }
+  if(Verbose)
+    fprintf(stderr,"Started piper worker %d for %s\n",(int)w->pid,piper_voice(female));
+  return 0;
+}
+
+// Start the workers for a voice if they aren't already running
+static void pool_start(bool female){
+  pthread_mutex_lock(&Pool.lock);
+  for(int i=0; i < Pool.count; i++){
+    struct worker *w = &Pool.workers[female][i];
+    if(w->pid == 0 && !w->busy)
+      worker_start(w,female);
+  }
+  pthread_mutex_unlock(&Pool.lock);
+}
+
+static void pool_cleanup(void){
+  for(int female=0; female < 2; female++)
+    for(int i=0; i < Pool.count; i++)
+      worker_stop(&Pool.workers[female][i]);
+}
+
+static int pool_init(void){
+  if(access(PIPER_PROGRAM,X_OK) != 0 || access(PIPER_MODELS,R_OK|X_OK) != 0)
+    return -1;
+  Pool.count = Tts_workers < 1 ? 1 : Tts_workers > MAX_WORKERS ? MAX_WORKERS : Tts_workers;
+  signal(SIGPIPE,SIG_IGN); // A worker dying shouldn't kill us too
+  atexit(pool_cleanup);
+  return 0;
+}
+
+static int pool_synth(char const *text,bool female,float **samples,int *rate){
+  *samples = NULL;
+
+  // Grab an idle worker, starting one if necessary
+  struct worker *w = NULL;
+  pthread_mutex_lock(&Pool.lock);
+  while(true){
+    for(int i=0; i < Pool.count; i++){
+      if(!Pool.workers[female][i].busy){
+	w = &Pool.workers[female][i];
+	break;
+      }
+    }
+    if(w != NULL)
+      break;
+    pthread_cond_wait(&Pool.cond,&Pool.lock);
+  }
+  w->busy = true;
+  pthread_mutex_unlock(&Pool.lock);
+
+  int r = -1;
+  char *line = NULL;
+  size_t size = 0;
+  if(w->pid == 0 && worker_start(w,female) != 0)
+    goto done;
+
+  // One utterance per line
+  for(char const *cp = text; *cp != '\0'; cp++)
+    fputc((*cp == '\n' || *cp == '\r') ? ' ' : *cp,w->in);
+  fputc('\n',w->in);
+  if(fflush(w->in) != 0 || getline(&line,&size,w->out) <= 0){
+    fprintf(stderr,"piper worker %d failed: %s\n",(int)w->pid,strerror(errno));
+    worker_stop(w); // Restarted on next use
+    goto done;
+  }
+  chomp(line);
+  r = read_wav_file(line,samples,rate);
+  unlink(line);
+
+ done:;
+  free(line);
+  pthread_mutex_lock(&Pool.lock);
+  w->busy = false;
+  pthread_cond_signal(&Pool.cond);
+  pthread_mutex_unlock(&Pool.lock);
+  return r;
+}
+
+
+// Fallback: run the synthesizer and sox as shell commands through temporary files
+static int command_init(void){
+  return 0; // Always there, though the programs it runs might not be
+}
+
+static char const *command_voice(bool female){
+#ifdef __APPLE__
+  return female ? "Samantha" : "Alex";
+#elif defined(PIPER)
+  return piper_voice(female);
+#else
+  return espeak_voice(female);
+#endif
+}
+
+// Read an entire raw 16-bit PCM file, converting to float
+// Return number of samples, or -1 on error
+static int read_raw_file(char const *file,float **samples){
+  *samples = NULL;
+  FILE *fp = fopen(file,"r");
+  if(fp == NULL)
+    return -1;
+
+  struct stat st;
+  if(fstat(fileno(fp),&st) != 0 || st.st_size < (off_t)sizeof(int16_t)){
+    fclose(fp);
+    return -1;
+  }
+  int const length = st.st_size / sizeof(int16_t);
+  int16_t *buffer = malloc(length * sizeof(*buffer));
+  float *fbuffer = malloc(length * sizeof(*fbuffer));
+  int const ret = (buffer && fbuffer) ? (int)fread(buffer,sizeof(*buffer),length,fp) : -1;
+  fclose(fp);
+  if(ret <= 0){
+    free(buffer);
+    free(fbuffer);
+    return -1;
+  }
+  for(int i=0; i < ret; i++)
+    fbuffer[i] = buffer[i] * (1.0f / 32768);
+  free(buffer);
+  *samples = fbuffer;
+  return ret;
+}
+
+static int command_synth(char const *text,bool female,float **samples,int *rate){
+  int r = -1;
+  *samples = NULL;
+
+  // The TTS engines read text from a file
+  char tempfile_txt[L_tmpnam+1];
+  memset(tempfile_txt,0,sizeof(tempfile_txt));
+  strncpy(tempfile_txt,"/tmp/stextXXXXXX.txt",sizeof(tempfile_txt));
+  int fd = mkstemps(tempfile_txt,4);
+  if(fd == -1)
+    return -1;
+  FILE *fp = fdopen(fd,"w");
+  if(fp == NULL){
+    close(fd);
+    unlink(tempfile_txt);
+    return -1;
+  }
+  fputs(text,fp);
+  fclose(fp);
+
+  char tempfile_raw[L_tmpnam+1];
+  memset(tempfile_raw,0,sizeof(tempfile_raw));
+  strncpy(tempfile_raw,"/tmp/srawXXXXXX.raw",sizeof(tempfile_raw));
+  mkstemps(tempfile_raw,4);
+
+#if defined(__APPLE__) || defined(PIPER)
+  char tempfile_wav[L_tmpnam+1];
+  memset(tempfile_wav,0,sizeof(tempfile_wav));
+  strncpy(tempfile_wav,"/tmp/swavXXXXXX.wav",sizeof(tempfile_wav));
+  mkstemps(tempfile_wav,4);
+#endif
+
+  char const *voice = command_voice(female);
+  char *command = NULL;
+  int asr = -1;
+
+#ifdef __APPLE__
+  asr = asprintf(&command,"say -v %s --output-file=%s --data-format=LEI16@48000 -f %s; sox %s -t raw -r %d -c 1 -b 16 -e signed-integer %s",
+	   voice,tempfile_wav,tempfile_txt,tempfile_wav,Samprate,tempfile_raw);
+
+#elif defined(PIPER)
+  asr = asprintf(&command,"/usr/local/bin/piper --model %s/%s --output_file - < %s | sox -t wav - -t raw -r %d -c 1 -b 16 -e signed-integer %s",
+		 PIPER_MODELS,voice,tempfile_txt,Samprate,tempfile_raw);
+
+#else // crappy espeak
+  asr = asprintf(&command,"espeak -v %s -a 70 -f %s --stdout | sox -t wav - -t raw -r %d -c 1 -b 16 -e signed-integer %s",
+	   voice,tempfile_txt,Samprate,tempfile_raw);
+#endif
+  if(asr == -1 || !command)
+    goto done; // asprintf failed somehow
+
+  if(Verbose)
+    fprintf(stderr,"Executing \"%s\" to speak:\n%s\n",command,text);
+
+  r = system(command);
+  if(r == 0){
+    r = read_raw_file(tempfile_raw,samples);
+    *rate = Samprate;
+  } else {
+    fprintf(stderr,"system(%s) returned %d\n",command,r);
+    r = -1;
+  }
+
+ done:; // Go here directly on errors
+  // Clean up
+  unlink(tempfile_txt);
+  unlink(tempfile_raw);
+#if defined(__APPLE__) || defined(PIPER)
+  unlink(tempfile_wav);
+#endif
+
+  if(command)
+    free(command);
+  return r;
+}
+
+
+// In order of preference
+static struct tts_backend const Backends[] = {
+#ifdef PIPER
+  { "piper-lib", piper_lib_init, NULL, piper_voice, piper_lib_synth },
+  { "piper-pool", pool_init, pool_start, piper_voice, pool_synth },
+#endif
+  { "espeak-lib", espeak_lib_init, NULL, espeak_voice, espeak_lib_synth },
+#ifdef __APPLE__
+  { "say", command_init, NULL, command_voice, command_synth },
+#elif defined(PIPER)
+  { "piper", command_init, NULL, command_voice, command_synth },
+#else
+  { "espeak", command_init, NULL, command_voice, command_synth },
+#endif
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+// Select a TTS backend by name, or the first usable one if name is NULL
+int tts_init(char const *name){
+  for(struct tts_backend const *be = Backends; be->name != NULL; be++){
+    if(name != NULL && strcmp(name,be->name) != 0)
+      continue;
+    if((*be->init)() == 0){
+      Backend = be;
+      if(Verbose)
+	fprintf(stderr,"TTS backend %s\n",be->name);
+      return 0;
+    }
+    if(name != NULL)
+      break;
+  }
+  if(name != NULL){
+    fprintf(stderr,"TTS backend %s not available; choose from:",name);
+    for(struct tts_backend const *be = Backends; be->name != NULL; be++)
+      fprintf(stderr," %s",be->name);
+    fputc('\n',stderr);
+  }
+  return -1;
+}
+
+// Start anything that takes a while, e.g., loading a voice model
+void tts_start(bool female){
+  if(Backend != NULL && Backend->start != NULL)
+    (*Backend->start)(female);
+}
+
+// Name of backend 'i' in order of preference, NULL past the last
+char const *tts_backend(int i){
+  for(int k=0; k <= i; k++){
+    if(Backends[k].name == NULL)
+      return NULL;
+  }
+  return Backends[i].name;
+}
+
+char const *tts_name(void){
+  return Backend ? Backend->name : "none";
+}
+
+char const *tts_voice(bool female){
+  return Backend ? (*Backend->voice)(female) : "none";
+}
+
+// Synthesize text into malloc'ed 16-bit PCM at Samprate
+// Return number of samples, or -1 on error
+int tts_synthesize(char const *text,bool female,int16_t **samples){
+  *samples = NULL;
+  if(Backend == NULL)
+    return -1;
+
+  float *pcm = NULL;
+  int rate = 0;
+  int64_t const start = monotonic_ns();
+  int length = (*Backend->synth)(text,female,&pcm,&rate);
+  int const index = Backend - Backends;
+  if(index < STATS_BACKENDS)
+    hist_add(&Stats.speech[index],(monotonic_ns() - start) / 1000);
+  trace_event("speech",start);
+  if(length <= 0 || rate <= 0){
+    free(pcm);
+    return -1;
+  }
+  length = resample_pcm(samples,pcm,length,rate);
+  free(pcm);
+  return length;
+}
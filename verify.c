@@ -0,0 +1,492 @@
+// Audio-domain check of wwvsim output
+// Decodes what a receiver would from the samples themselves, not from the
+// code[] array they were made from: second ticks and their guard intervals,
+// the DUT1 double ticks, the minute beep and the 100 Hz time code, and
+// compares each minute against what the broadcast should have sent.
+// Everything is measured over fixed windows at known offsets into each
+// second: a 100 Hz correlation over 10 ms slots gives the pulse width,
+// and single-bin Goertzel filters over a few milliseconds find the ticks
+// and beeps. Only the subcarrier needs a pass over most of the samples, so a
+// day of audio takes seconds.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "wwvsim.h"
+
+#define VF_ACQUIRE 10      // Seconds of audio searched for the ticks
+#define VF_SUB_ON 0.2      // 100 Hz amplitude for the subcarrier to count as on; sent at 0.5
+#define VF_TONE_ON 0.15    // Beep amplitude; sent at 1.0
+#define VF_TICK 0.005      // Least mean square of a tick; sent at 0.5
+#define VF_QUIET 1e-6      // Mean square of a silent guard interval, -60 dB
+#define VF_EDGE 1e-3       // Amplitude marking the first sample of a tick
+
+enum pulse {
+  PULSE_NONE,
+  PULSE_ZERO,   // 200 ms
+  PULSE_ONE,    // 500 ms
+  PULSE_MARKER, // 800 ms
+};
+
+struct second {
+  enum pulse pulse;
+  int beep;          // Minute or hour beep frequency, 0 if none
+  int tick;          // Tick frequency, 0 if none
+  bool dut1_tick;    // Second tick at 100 ms
+  bool quiet;        // Silent from 5 to 30 ms
+  bool quiet_after;  // Silent from 990 to 1000 ms
+};
+
+struct verifier {
+  FILE *fp;
+  enum wwvsim_format format;
+  struct broadcast const *b; // Expected broadcast, or NULL
+  int64_t t0;                // Its sample number at the start of the file
+  bool clean;                // Silence is silent, so the guard intervals can be checked
+
+  float *cos100, *sin100;    // One second of 100 Hz reference
+  float *buffer;             // Samples [base,base+have) of the file
+  void *raw;
+  int size;
+  int64_t base;
+  int have;
+
+  int64_t start;             // File sample of the current minute's second 0, -1 if none yet
+  int nsec;
+  struct second sec[62];
+  long minutes, bad;
+};
+
+// Read more samples, up to a full buffer; return false at the end of the file
+static bool fill(struct verifier *v){
+  int const want = v->size - v->have;
+  int const n = fread(v->raw,wwvsim_format_size(v->format),want,v->fp);
+  float *out = v->buffer + v->have;
+  if(v->format == WWVSIM_FORMAT_F32)
+    memcpy(out,v->raw,n * sizeof(*out));
+  else {
+    int16_t const *in = v->raw;
+    for(int i=0; i < n; i++)
+      out[i] = in[i] * (1.0f/32768);
+  }
+  v->have += n;
+  return n > 0;
+}
+
+// Amplitude of 'freq' over 'n' samples, single-bin Goertzel
+static double goertzel(float const *x,int n,double freq){
+  double const coeff = 2 * cos(2 * M_PI * freq / Samprate);
+  double s1 = 0, s2 = 0;
+  for(int i=0; i < n; i++){
+    double const s = x[i] + coeff * s1 - s2;
+    s2 = s1;
+    s1 = s;
+  }
+  double const power = s1*s1 + s2*s2 - coeff * s1 * s2;
+  return power > 0 ? 2 * sqrt(power) / n : 0;
+}
+
+// Amplitude of the tone at 'freq' in a second from 'startms' to 'stopms'
+static double tone_level(float const *x,int startms,int stopms,double freq){
+  int const start = ms_samples(startms);
+  return goertzel(x + start,ms_samples(stopms) - start,freq);
+}
+
+static double mean_square(float const *x,int startms,int stopms){
+  int const start = ms_samples(startms);
+  int const n = ms_samples(stopms) - start;
+  double sum = 0;
+  for(int i=0; i < n; i++)
+    sum += x[start + i] * x[start + i];
+  return sum / n;
+}
+
+// 100 Hz amplitude over the 10 ms slot 'j' of a second
+static double subcarrier(struct verifier const *v,float const *x,int j){
+  int const start = ms_samples(10 * j);
+  int const end = ms_samples(10 * j + 10);
+  v4sf i4 = {0,0,0,0}, q4 = {0,0,0,0};
+  int k = start;
+  for(; k + 4 <= end; k += 4){
+    v4sf const s = load4(x + k);
+    i4 += s * load4(v->cos100 + k);
+    q4 += s * load4(v->sin100 + k);
+  }
+  double i = i4[0] + i4[1] + i4[2] + i4[3];
+  double q = q4[0] + q4[1] + q4[2] + q4[3];
+  for(; k < end; k++){
+    i += x[k] * v->cos100[k];
+    q += x[k] * v->sin100[k];
+  }
+  return 2 * sqrt(i*i + q*q) / (end - start);
+}
+
+// Measure one second of audio starting at 'x'
+static void analyze(struct verifier const *v,float const *x,struct second *sec){
+  memset(sec,0,sizeof(*sec));
+  // Pulse width: the subcarrier comes on at the start of the second, but
+  // the tick guard blanks it for the first 30 ms
+  int j = 3;
+  while(j < 100 && subcarrier(v,x,j) >= VF_SUB_ON)
+    j++;
+  int const width = 10 * j;
+  sec->pulse = width <= 30 ? PULSE_NONE : width < 350 ? PULSE_ZERO : width < 650 ? PULSE_ONE : PULSE_MARKER;
+
+  // Fading takes out different frequencies at different times, so the
+  // ticks are found by their energy against the silence after them
+  double const tick = mean_square(x,0,5);
+  if(tick >= VF_TICK && tick >= 4 * mean_square(x,5,30)){
+    double const wwv = tone_level(x,0,5,1000);
+    double const wwvh = tone_level(x,0,5,1200);
+    sec->tick = wwvh > wwv ? 1200 : 1000;
+    // and the DUT1 ticks against the tick itself
+    sec->dut1_tick = tone_level(x,100,105,sec->tick) >= 0.5 * (wwvh > wwv ? wwvh : wwv);
+  }
+  int const freqs[] = { 1000, 1200, 1500 };
+  for(int i=0; i < 3; i++){
+    // Averaged over the beep, since fading may take out any one part of it
+    double level = 0;
+    for(int ms = 100; ms < 800; ms += 100)
+      level += tone_level(x,ms,ms+10,freqs[i]) / 7;
+    if(level >= VF_TONE_ON && sec->pulse == PULSE_NONE)
+      sec->beep = freqs[i];
+  }
+  if(sec->beep != 0){
+    sec->tick = 0; // Its start, not a tick
+    sec->dut1_tick = false;
+  }
+  sec->quiet = mean_square(x,5,30) < VF_QUIET;
+  sec->quiet_after = mean_square(x,990,1000) < VF_QUIET;
+}
+
+// Find where the seconds start: the millisecond at which the most seconds
+// have a tick with quiet either side, then the sample, by the first sample
+// of a tick if the audio is clean enough to find it, setting 'exact'
+// Return the offset of the first second boundary into the buffer, or -1
+static int acquire(struct verifier const *v,bool *exact){
+  int const seconds = v->have / Samprate < VF_ACQUIRE ? v->have / Samprate : VF_ACQUIRE;
+  *exact = false;
+  if(seconds < 2)
+    return -1;
+  int const total = 1000 * seconds;
+  double *energy = malloc(total * sizeof(*energy));
+  if(energy == NULL)
+    return -1;
+  for(int s=0; s < seconds; s++){
+    for(int ms=0; ms < 1000; ms++)
+      energy[1000 * s + ms] = mean_square(v->buffer + (int64_t)s * Samprate,ms,ms+1);
+  }
+  int best = -1, best_count = 0;
+  for(int ms=0; ms < 1000; ms++){
+    int count = 0;
+    for(int t = ms; t + 30 <= total; t += 1000){
+      if(t < 10)
+	continue;
+      double tick = 0, guard = 0;
+      for(int i=-10; i < 30; i++){
+	if(i >= 0 && i < 5)
+	  tick += energy[t + i] / 5;
+	else
+	  guard += energy[t + i] / 35;
+      }
+      if(tick >= VF_TONE_ON * VF_TONE_ON / 2 && guard < tick / 10)
+	count++;
+    }
+    if(count > best_count){
+      best_count = count;
+      best = ms;
+    }
+  }
+  free(energy);
+  if(best_count < 2)
+    return -1;
+
+  int const phase = ms_samples(best);
+  int const slop = ms_samples(2);
+  int const lead = ms_samples(1);
+  for(int s=0; s < seconds; s++){
+    int64_t const c = phase + (int64_t)s * Samprate;
+    if(c - slop - lead < 0 || c + slop > v->have)
+      continue;
+    for(int64_t n = c - slop; n < c + slop; n++){
+      if(fabsf(v->buffer[n]) < VF_EDGE)
+	continue;
+      // The tick is a sine starting at zero phase, after silence
+      int k = 1;
+      while(k <= lead && fabsf(v->buffer[n - k]) < VF_EDGE)
+	k++;
+      if(k > lead){
+	*exact = true;
+	return (n - 1) % Samprate;
+      }
+      break;
+    }
+  }
+  return phase;
+}
+
+// Month and day of the day of the year
+static void month_day(int year,int doy,int *month,int *day){
+  int m = 1;
+  while(m < 12){
+    int const days = Days_in_month[m] + (m == 2 && is_leap_year(year));
+    if(doy <= days)
+      break;
+    doy -= days;
+    m++;
+  }
+  *month = m;
+  *day = doy;
+}
+
+// Append to a minute's list of problems
+static void complain(char *msg,size_t size,char const *fmt,...){
+  size_t len = strlen(msg);
+  if(len != 0 && len + 2 < size){
+    strcpy(msg + len,"; ");
+    len += 2;
+  }
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(msg + len,size - len,fmt,ap);
+  va_end(ap);
+}
+
+// Decode and check the minute just collected
+static void finish(struct verifier *v){
+  int const length = v->nsec;
+  struct second const *sec = v->sec;
+  char msg[1024] = "";
+
+  uint8_t code[61];
+  memset(code,0,sizeof(code));
+  bool timecode = false;
+  for(int s=1; s < length; s++){
+    if(sec[s].pulse != PULSE_NONE)
+      timecode = true;
+  }
+  if(timecode){
+    for(int s=1; s < length && s < 61; s++){
+      enum pulse const want_marker = (s % 10) == 9 ? PULSE_MARKER : PULSE_NONE;
+      if(want_marker == PULSE_MARKER){
+	if(sec[s].pulse != PULSE_MARKER)
+	  complain(msg,sizeof(msg),"no marker at second %d",s);
+      } else if(sec[s].pulse == PULSE_ONE)
+	code[s] = 1;
+      else if(sec[s].pulse != PULSE_ZERO)
+	complain(msg,sizeof(msg),"unreadable bit at second %d",s);
+    }
+  }
+  // Ticks on every second but 0, 29, 59 and a leap second, each with
+  // silence 10 ms before and 25 ms after
+  int station = 0;
+  for(int s=0; s < length; s++){
+    bool const want = s > 0 && s != 29 && s < 59;
+    if(want != (sec[s].tick != 0))
+      complain(msg,sizeof(msg),want ? "no tick at second %d" : "extra tick at second %d",s);
+    if(sec[s].tick != 0){
+      if(station == 0)
+	station = sec[s].tick;
+      else if(sec[s].tick != station)
+	complain(msg,sizeof(msg),"%d Hz tick at second %d",sec[s].tick,s);
+    }
+    if(v->clean && want && (!sec[s].quiet || (s > 0 && !sec[s-1].quiet_after)))
+      complain(msg,sizeof(msg),"guard interval not silent at second %d",s);
+  }
+  if(station == 0)
+    station = sec[0].beep == 1200 ? 1200 : 1000;
+
+  // DUT1 from the double ticks: seconds 1 on for positive, 9 on for negative
+  int ticks = 0;
+  for(int s=1; s < length && s < 17; s++){
+    if(sec[s].dut1_tick)
+      ticks++;
+  }
+  int dut1 = 0;
+  if(ticks > 0)
+    dut1 = sec[1].dut1_tick ? ticks : -ticks;
+  for(int s=1; s < length && s < 17; s++){
+    bool const want = (dut1 > 0 && s <= dut1) || (dut1 < 0 && s >= 9 && s <= 8 - dut1);
+    if(want != sec[s].dut1_tick)
+      complain(msg,sizeof(msg),"stray DUT1 tick at second %d",s);
+  }
+
+  struct timecode tc = {0};
+  int year = 0, month = 0, day = 0;
+  if(timecode){
+    parse_timecode(code,&tc);
+    year = 2000 + tc.year;
+    if(tc.minute > 59 || tc.hour > 23 || tc.doy < 1 || tc.doy > 365 + is_leap_year(year))
+      complain(msg,sizeof(msg),"bad time code");
+    else
+      month_day(year,tc.doy,&month,&day);
+    if(tc.dut1 != dut1)
+      complain(msg,sizeof(msg),"DUT1 %+d in time code, %+d by double ticks",tc.dut1,dut1);
+    if((sec[0].beep == 1500) != (tc.minute == 0))
+      complain(msg,sizeof(msg),"%d Hz beep at minute %d",sec[0].beep,tc.minute);
+  }
+
+  if(v->b != NULL){
+    // What the broadcast should have sent
+    struct minute_state m;
+    int64_t const n = v->t0 + v->start;
+    broadcast_minute(v->b,n,&m);
+    if(m.sample != n && (v->clean || llabs(n - m.sample) > ms_samples(1)))
+      complain(msg,sizeof(msg),"minute starts %d samples into minute %02d",(int)(n - m.sample),m.minute);
+    if(length != m.length)
+      complain(msg,sizeof(msg),"%d seconds long, expected %d",length,m.length);
+    if(station != (v->b->wwvh ? 1200 : 1000))
+      complain(msg,sizeof(msg),"%d Hz ticks, expected %d",station,v->b->wwvh ? 1200 : 1000);
+    if(sec[0].beep != (m.minute == 0 ? 1500 : station))
+      complain(msg,sizeof(msg),"%d Hz beep, expected %d",sec[0].beep,m.minute == 0 ? 1500 : station);
+    if(dut1 != m.dut1)
+      complain(msg,sizeof(msg),"DUT1 %+d, expected %+d",dut1,m.dut1);
+    if(timecode != !v->b->no_timecode)
+      complain(msg,sizeof(msg),timecode ? "unexpected time code" : "no time code");
+    if(timecode){
+      uint8_t expect[61];
+      maketimecode(expect,m.dut1,m.leap_pending,m.year,m.month,m.day,m.hour,m.minute);
+      for(int s=1; s < 59; s++){
+	if((s % 10) != 9 && code[s] != expect[s])
+	  complain(msg,sizeof(msg),"bit %d is %d",s,code[s]);
+      }
+    }
+  }
+
+  if(timecode)
+    printf("%04d-%02d-%02d %02d:%02d %s doy %03d DUT1 %+.1f%s; %s",
+	   year,month,day,tc.hour,tc.minute,station == 1200 ? "WWVH" : "WWV",
+	   tc.doy,tc.dut1 / 10.,tc.leap_pending ? "; leap second pending" : "",dst_status(&tc));
+  else
+    printf("minute at %.3f s %s no time code; DUT1 %+.1f",(double)v->start / Samprate,station == 1200 ? "WWVH" : "WWV",dut1 / 10.);
+  if(length != 60)
+    printf("; %d seconds",length);
+  if(msg[0] != '\0'){
+    printf(": %s\n",msg);
+    v->bad++;
+  } else
+    printf(": ok\n");
+  v->minutes++;
+}
+
+// Take one analyzed second at file sample 'position'
+static void second(struct verifier *v,int64_t position,struct second const *sec){
+  // Once in step, only where a minute can end
+  if(sec->beep != 0 && (v->start < 0 || v->nsec >= 59)){
+    if(v->start >= 0)
+      finish(v);
+    v->start = position;
+    v->nsec = 0;
+  }
+  if(v->start < 0)
+    return; // Waiting for the first full minute
+  if(v->nsec == 61){
+    printf("minute at %.3f s: no beep after 61 seconds\n",(double)v->start / Samprate);
+    v->bad++;
+    v->start = -1;
+    return;
+  }
+  v->sec[v->nsec++] = *sec;
+}
+
+// Decode the mono audio in 'input' ("-" for stdin) at Samprate, and if 'b'
+// isn't NULL, check it against that broadcast starting at its sample 't0'
+// Return 0 if every minute decodes and matches, -1 otherwise
+int verify_file(char const *input,enum wwvsim_format format,struct broadcast const *b,int64_t t0){
+  struct verifier v = {
+    .format = format,
+    .b = b,
+    .t0 = t0,
+    .size = (VF_ACQUIRE + 1) * Samprate,
+    .start = -1,
+  };
+  int ret = -1;
+
+  if(strcmp(input,"-") == 0)
+    v.fp = stdin;
+  else if((v.fp = fopen(input,"r")) == NULL){
+    fprintf(stderr,"Can't read %s: %s\n",input,strerror(errno));
+    return -1;
+  }
+  v.cos100 = malloc(Samprate * sizeof(*v.cos100));
+  v.sin100 = malloc(Samprate * sizeof(*v.sin100));
+  v.buffer = malloc(v.size * sizeof(*v.buffer));
+  v.raw = malloc((size_t)v.size * wwvsim_format_size(format));
+  if(v.cos100 == NULL || v.sin100 == NULL || v.buffer == NULL || v.raw == NULL)
+    goto done;
+  for(int i=0; i < Samprate; i++){
+    v.cos100[i] = cos(2 * M_PI * 100 * i / Samprate);
+    v.sin100[i] = sin(2 * M_PI * 100 * i / Samprate);
+  }
+  bool more = true;
+  while(more && v.have < v.size)
+    more = fill(&v);
+
+  int const phase = acquire(&v,&v.clean);
+  if(phase < 0){
+    fprintf(stderr,"%s: no second ticks found\n",input);
+    goto done;
+  }
+  if(Verbose)
+    fprintf(stderr,"Seconds start at sample %d%s\n",phase,v.clean ? "" : ", to the millisecond");
+  int bad_phase = 0;
+  if(b != NULL){
+    // Second boundaries are whole seconds of broadcast samples
+    int const expect = (Samprate - t0 % Samprate) % Samprate;
+    int offset = phase - expect;
+    if(offset > Samprate / 2)
+      offset -= Samprate;
+    else if(offset < -Samprate / 2)
+      offset += Samprate;
+    if(offset != 0 && (v.clean || abs(offset) > ms_samples(1))){
+      printf("seconds start %d samples late\n",offset);
+      bad_phase = 1;
+    }
+  }
+  // A second at a time, keeping the buffer topped up
+  int64_t position = phase;
+  while(1){
+    while(position + Samprate <= v.base + v.have){
+      struct second sec;
+      analyze(&v,v.buffer + (position - v.base),&sec);
+      second(&v,position,&sec);
+      position += Samprate;
+    }
+    if(!more)
+      break;
+    int const keep = v.base + v.have - position;
+    memmove(v.buffer,v.buffer + (position - v.base),keep * sizeof(*v.buffer));
+    v.base = position;
+    v.have = keep;
+    more = fill(&v);
+  }
+  // The last minute counts if it ran to its end
+  if(v.start >= 0 && v.nsec >= 59){
+    int length = 60;
+    if(b != NULL){
+      struct minute_state m;
+      broadcast_minute(b,t0 + v.start,&m);
+      length = m.length;
+    }
+    if(v.nsec >= length)
+      finish(&v);
+  }
+  printf("%ld minutes, %ld bad\n",v.minutes,v.bad + bad_phase);
+  if(v.minutes > 0 && v.bad + bad_phase == 0)
+    ret = 0;
+
+ done:;
+  if(v.fp != stdin)
+    fclose(v.fp);
+  free(v.cos100);
+  free(v.sin100);
+  free(v.buffer);
+  free(v.raw);
+  return ret;
+}
@@ -1,3 +1,2 @@
 #!/bin/sh
-wwvsim -u 3 | modulate -v -m am -f -48000 | iqplay -v -f 10048000 -R iq.wwv.mcast.local
-
+wwvsim -u 3 --pace 100 --iq-rate 192000 --carrier -48000 | iqplay -v -f 10048000 -R iq.wwv.mcast.local
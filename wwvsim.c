@@ -20,9 +20,9 @@
 // Major rewrite 30 Aug 2023 to use a FIFO queue feeding a separate output thread
 // Better able to handle slow speech synthesizers
 // 11 May 2025: Cleanups, --no-tone, --no-voice, --no-code options
+// Now a thin front end to libwwvsim: options, sound device, output thread and batch mode
 
 #define USE_PORTAUDIO 1 // Enable direct on-time output to sound device with portaudio when stdout is a terminal
-#define PIPER 1 // Piper TTS
 
 #define _GNU_SOURCE
 #include <assert.h>
@@ -30,7 +30,6 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h>
-#include <complex.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -38,85 +37,68 @@
 #include <limits.h>
 #include <math.h>
 #include <memory.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <locale.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <getopt.h>
 
+#include "wwvsim.h"
+
 #ifdef USE_PORTAUDIO
 #include <portaudio.h>
-PaStream *Stream;
-#define FRAMES_PER_BUFFER 1024
+static PaStream *Stream;
+static double Latency;           // Seconds from writing to hearing, from PortAudio
+static _Atomic int64_t Stream_epoch; // System time at stream time 0, ns
+static int64_t Callback_frames;  // Output frames handed to the card so far
+static int pa_callback(void const *input,void *output,unsigned long frames,
+		       PaStreamCallbackTimeInfo const *time,PaStreamCallbackFlags flags,void *user);
+static void stream_epoch(void);
+static void heard_time(int rate,struct timespec *when);
 #endif
 
-#if __APPLE__
-#define pthread_setname(x) pthread_setname_np(x)
-#else // !__APPLE__
-// Not apple (Linux, etc)
-#define pthread_setname(x) pthread_setname_np(pthread_self(),(x))
-#endif // ifdef __APPLE__
-
-
-char Libdir[] = "/usr/local/share/ka9q-radio";
-
-int Samprate = 48000; // Samples per second - try to use this if possible
-bool WWVH = false; // WWV by default
-bool Verbose = false;
-bool Negative_leap_second_pending = false; // If true, leap second will be removed at end of June or December, whichever is first
-bool Positive_leap_second_pending = false; // If true, leap second will be inserted at end of June or December, whichever is first
-bool NoTone = false;
-bool NoVoice = false;
-bool NoTimeCode = false;
-
-
-// Applies only to non-leap years; you need special tests for February in leap year
-int const Days_in_month[] = { // Index 1 = January, 12 = December
-  0,31,28,31,30,31,30,31,31,30,31,30,31
-};
-
-// Tone schedules for each minute of the hour for each station
-// Special exception: no 440 Hz tone in first hour of UTC day; must be handled ad-hoc
-int const WWV_tone_schedule[60] = {
-    0,600,440,  0,  0,600,500,600,  0,  0, // 3 is nist reserved at wwvh, 4 reserved at wwv; 8 research signal; 9-10 storms; 7 undoc wwv
-    0,600,500,600,500,600,  0,600,  0,600, // 14-15 GPS (no longer used - tones), 16 nist reserved, 18 geoalerts; 11 undoc wwv
-  500,600,500,600,500,600,500,600,500,  0, // 29 is silent to protect wwvh id
-    0,600,500,600,500,600,500,600,500,600, // 30 is station ID
-  500,600,500,  0,  0,  0,  0,  0,  0,  0, // 43-51 is silent period to protect wwvh
-    0,  0,500,600,500,600,500,600,500,  0  // 59 is silent to protect wwvh id; 52 new special at wwvh, not protected by wwv
-};
-
-int const WWVH_tone_schedule[60] = {
-    0,440,600,  0,  0,500,600,  0,  0,  0, // 0 silent to protect wwv id; 3 nist reserved; 4 reserved at wwv; 7 protects undoc wwv; 8-10 to protect wwv
-    0,  0,600,500,  0,  0,  0,  0,  0,  0, // 14-19 is silent period to protect wwv; 11 silent to protect undoc wwv
-  600,500,600,500,600,500,600,500,600,  0, // 29 is station ID
-    0,500,600,500,600,500,600,500,600,500, // 30 silent to protect wwv id
-  600,500,600,500,600,  0,600,  0,  0,  0, // 43-44 GPS (unused-tones); 45 geoalerts; 47 nist reserved; 48-51 storms
-    0,  0,  0,500,600,500,600,500,600,  0  // 59 is station ID; 52 new special at wwvh?, NOT protected at WWV
-};
-
-struct qentry {
-  struct qentry *next;
-  int16_t *buffer;
-  int offset; // Starting offset
-  int length; // Samples
+#define STARTUP_GRACE_MS 300 // How long the first minute may wait for speech
+#define DEADLINE_MARGIN_MS 1000 // Speech must be ready this long before it goes out
+#define DEFAULT_BUFFER_MS 1000 // Output ring depth
+#define DEFAULT_BLOCK_MS 100 // Rendering granularity
+#define PACE_BLOCK_MS 10 // Paced output is released in blocks this long
+
+
+static enum wwvsim_format Format = WWVSIM_FORMAT_S16;
+static bool Dither = true;
+static struct wwvsim_am *Am; // Optional I/Q output stage
+static bool Iq = false;
+static bool Blocking = false; // Write to the sound card instead of letting it call for samples
+static struct wwvsim_pull *Pull; // Renders ahead of the output
+static int Pace_ms = -1;      // Release piped output this far ahead of when it goes out; -1 as rendered
+static bool Framed = false;   // Precede each block of piped output with a struct wwvsim_frame_header
+static struct wwvsim_receiver const *Receiver;
+static int64_t Start;         // Receiver sample of output frame 0
+static time_t Start_sec;      // About when it goes out
+static int64_t Pace_epoch = -1; // With a manual time, when frame 0 was released; otherwise the broadcast keeps UTC
+static void write_output(int chunk);
+static void timespec_add_ms(struct timespec *t,int ms);
+static void cleanup(void);
+static char const *Stats_file; // Rewritten every second
+static void *stats_thread(void *p);
+static void write_stats(void);
+
+// Watterson channels from ITU-R F.520
+static struct {
+  char const *name;
+  double spread_ms, doppler_hz;
+} const Channels[] = {
+  { "good", 0.5, 0.1 },
+  { "moderate", 1.0, 0.5 },
+  { "poor", 2.0, 1.0 },
+  { "flutter", 0.5, 10.0 },
 };
 
-struct qentry *Queue;
-pthread_t Output_thread;
-void *output_thread(void *p);
-pthread_mutex_t Output_mutex; // Protect queue
-pthread_cond_t Output_cond;
-int Samprate_ms;      // Samples per millisecond - sampling rates not divisible by 1000 may break
-
-void cleanup(void);
-void maketimecode(uint8_t *code,int dut1,bool leap_pending,int year,int month,int day,int hour,int minute);
-void decode_timecode(uint8_t *code,int length);
-void makeminute(int16_t *output,int length,bool wwvh,uint8_t const *code,int dut1,int hour,int minute);
-int qlen(void);
-bool const is_leap_year(int y);
-
-static char const Optstring[] = "HY:M:D:h:m:s:u:r:LNvn:";
+static char const Optstring[] = "HY:M:D:h:m:s:u:r:LNvn:o:";
 static const struct option Options[] = {
   {"device", required_argument, NULL, 'n' },
   {"verbose", no_argument, NULL, 'v'},
@@ -135,15 +117,70 @@ static const struct option Options[] = {
   {"no-voice", no_argument, NULL, 'd'},
   {"no-tone", no_argument, NULL, 't'},
   {"no-code", no_argument, NULL, 'c'},
+  {"cache-dir", required_argument, NULL, 'C'},
+  {"no-cache", no_argument, NULL, 'x'},
+  {"clips", no_argument, NULL, 'S'},
+  {"tts", required_argument, NULL, 'T'},
+  {"tts-workers", required_argument, NULL, 'W'},
+  {"self-test", no_argument, NULL, 'K'},
+  {"format", required_argument, NULL, 'F'},
+  {"no-dither", no_argument, NULL, 'Z'},
+  {"start", required_argument, NULL, 'B'},
+  {"duration", required_argument, NULL, 'R'},
+  {"output", required_argument, NULL, 'o'},
+  {"buffer", required_argument, NULL, 'b'},
+  {"block", required_argument, NULL, 'G'},
+  {"iq", no_argument, NULL, 'I'},
+  {"iq-rate", required_argument, NULL, 'Q'},
+  {"carrier", required_argument, NULL, 'A'},
+  {"depth", required_argument, NULL, 'J'},
+  {"both", no_argument, NULL, '2'},
+  {"wwv-gain", required_argument, NULL, 'g'},
+  {"wwvh-gain", required_argument, NULL, 'k'},
+  {"wwv-delay", required_argument, NULL, 'e'},
+  {"wwvh-delay", required_argument, NULL, 'E'},
+  {"separate", no_argument, NULL, 'X'},
+  {"channel", required_argument, NULL, 'j'},
+  {"snr", required_argument, NULL, 'y'},
+  {"qrn", required_argument, NULL, 'q'},
+  {"seed", required_argument, NULL, 'z'},
+  {"verify", required_argument, NULL, 'V'},
+  {"stats", required_argument, NULL, 'U'},
+  {"free-run", no_argument, NULL, 'f'},
+  {"trace", required_argument, NULL, 'w'},
+  {"blocking", no_argument, NULL, 'l'},
+  {"pace", required_argument, NULL, 'a'},
+  {"framed", no_argument, NULL, 'i'},
   { NULL, no_argument, NULL, 0},
 };
 
 
 int main(int argc,char *argv[]){
 
-  int dut1 = 0;
+  struct wwvsim_setup setup = {0};
+  struct wwvsim_params params = {0};
+  bool positive_leap = false; // If true, leap second will be inserted at end of June or December, whichever is first
+  bool negative_leap = false; // If true, leap second will be removed at end of June or December, whichever is first
   bool manual_time = false;
+  bool manual_sec = false;
   int devnum = -1;
+  bool self_test = false;
+  char const *output = NULL; // Batch mode
+  char const *verify = NULL; // Decode this file instead
+  char const *trace = NULL;  // Pipeline trace file
+  long duration = 60;        // Batch minutes
+  int buffer_ms = DEFAULT_BUFFER_MS;
+  int block_ms = DEFAULT_BLOCK_MS;
+  int iq_rate = 0;    // Default audio rate
+  int carrier = 0;    // Hz
+  float depth = 1.0;  // 100% modulation at full scale
+  bool both = false;  // WWV and WWVH together
+  bool separate = false; // One channel per station
+  double gain_db[2] = { NAN, NAN }; // WWV, WWVH; default 0 dB, or -6 mixed together
+  double delay_ms[2] = { 0, 0 };
+  struct wwvsim_channel channel = { .qrn_db = 6 };
+  bool hf = false;    // Apply 'channel'
+  bool free_run = false; // Measure the sound card's clock, but leave it alone
 
   // Use current computer clock time as default
   struct timeval start_time;
@@ -168,28 +205,186 @@ int main(int argc,char *argv[]){
   while((c = getopt_long(argc,argv,Optstring,Options,NULL)) != EOF){
     switch(c){
     case 'c':
-      NoTimeCode = true;
+      params.no_timecode = true;
+      break;
+    case 'C':
+      setup.cache_dir = optarg;
+      break;
+    case 'x':
+      setup.no_disk_cache = true;
+      break;
+    case 'S':
+      setup.clips = true;
+      break;
+    case 'T':
+      setup.tts = optarg;
+      break;
+    case 'W':
+      setup.tts_workers = strtol(optarg,NULL,0);
+      break;
+    case 'K':
+      self_test = true;
+      break;
+    case 'V':
+      verify = optarg;
+      break;
+    case 'U':
+      Stats_file = optarg;
+      break;
+    case 'w':
+      trace = optarg;
+      break;
+    case 'f':
+      free_run = true;
+      break;
+    case 'l':
+      Blocking = true;
+      break;
+    case 'a':
+      Pace_ms = strtol(optarg,NULL,0);
+      if(Pace_ms < 0){
+	fprintf(stderr,"Pace lead must be 0 ms or more\n");
+	Pace_ms = 0;
+      }
+      break;
+    case 'i':
+      Framed = true;
+      break;
+    case 'F':
+      {
+	int const f = wwvsim_format_parse(optarg);
+	if(f < 0){
+	  fprintf(stderr,"Unknown sample format %s; use s16 or f32\n",optarg);
+	  exit(1);
+	}
+	Format = f;
+      }
+      break;
+    case 'Z':
+      Dither = false;
+      break;
+    case 'B': // Start time, YYYY-MM-DD HH:MM[:SS]
+      sec = 0;
+      manual_sec = true;
+      if(sscanf(optarg,"%d-%d-%d%*[ T]%d:%d:%d",&year,&month,&day,&hour,&minute,&sec) < 5){
+	fprintf(stderr,"Can't parse start time %s; use YYYY-MM-DDTHH:MM[:SS]\n",optarg);
+	exit(1);
+      }
+      manual_time = true;
+      break;
+    case 'R': // Batch duration in minutes, or with suffix m, h or d
+      {
+	char *ep;
+	double d = strtod(optarg,&ep);
+	if(*ep == 'h')
+	  d *= 60;
+	else if(*ep == 'd')
+	  d *= 1440;
+	duration = ceil(d);
+	if(duration <= 0){
+	  fprintf(stderr,"Bad duration %s\n",optarg);
+	  exit(1);
+	}
+      }
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'I':
+      Iq = true;
+      break;
+    case 'Q':
+      iq_rate = strtol(optarg,NULL,0);
+      Iq = true;
+      break;
+    case 'A':
+      carrier = strtol(optarg,NULL,0);
+      Iq = true;
+      break;
+    case 'J':
+      depth = strtod(optarg,NULL);
+      Iq = true;
+      break;
+    case '2':
+      both = true;
+      break;
+    case 'g':
+    case 'k':
+      gain_db[c == 'k'] = strtod(optarg,NULL);
+      break;
+    case 'e':
+    case 'E':
+      delay_ms[c == 'E'] = strtod(optarg,NULL);
+      break;
+    case 'X':
+      separate = true;
+      break;
+    case 'j':
+      {
+	size_t i;
+	for(i=0; i < sizeof(Channels)/sizeof(Channels[0]); i++){
+	  if(strcasecmp(optarg,Channels[i].name) == 0)
+	    break;
+	}
+	if(i < sizeof(Channels)/sizeof(Channels[0])){
+	  channel.spread_ms = Channels[i].spread_ms;
+	  channel.doppler_hz = Channels[i].doppler_hz;
+	} else if(sscanf(optarg,"%lf,%lf",&channel.spread_ms,&channel.doppler_hz) != 2){
+	  fprintf(stderr,"Unknown channel %s; use good, moderate, poor, flutter or <spread ms>,<Doppler Hz>\n",optarg);
+	  exit(1);
+	}
+	hf = true;
+      }
+      break;
+    case 'y':
+      channel.noise = true;
+      channel.snr_db = strtod(optarg,NULL);
+      hf = true;
+      break;
+    case 'q':
+      if(sscanf(optarg,"%lf,%lf",&channel.qrn_rate,&channel.qrn_db) < 1){
+	fprintf(stderr,"Bad QRN %s; use <crashes per second>[,<dB>]\n",optarg);
+	exit(1);
+      }
+      hf = true;
+      break;
+    case 'z':
+      channel.seed = strtoull(optarg,NULL,0);
+      break;
+    case 'G':
+      block_ms = strtol(optarg,NULL,0);
+      if(block_ms < 1 || block_ms > 1000){
+	fprintf(stderr,"Block size %s ms out of range, using %d\n",optarg,DEFAULT_BLOCK_MS);
+	block_ms = DEFAULT_BLOCK_MS;
+      }
+      break;
+    case 'b':
+      buffer_ms = strtol(optarg,NULL,0);
+      if(buffer_ms < 100){
+	fprintf(stderr,"Output buffer %s ms too small, using 100\n",optarg);
+	buffer_ms = 100;
+      }
       break;
     case 'd':
-      NoVoice = true;
+      params.no_voice = true;
       break;
     case 't':
-      NoTone = true; // Nicht diese Tone!
+      params.no_tone = true; // Nicht diese Tone!
       break;
     case 'n':
       devnum = strtol(optarg,NULL,0);
       break;
     case 'v':
-      Verbose = true;
+      setup.verbose = true;
       break;
     case 'r':
-      Samprate = strtol(optarg,NULL,0); // Try not to change this, may not work
+      setup.samprate = strtol(optarg,NULL,0);
       break;
     case 'H': // Simulate WWVH, otherwise WWV
-      WWVH = true;
+      params.wwvh = true;
       break;
     case 'u': // UT1 offset in tenths of a second, +/- 7
-      dut1 = strtol(optarg,NULL,0);
+      params.dut1 = strtol(optarg,NULL,0);
       break;
     case 'Y': // Manual year setting
       year = strtol(optarg,NULL,0);
@@ -213,13 +408,14 @@ int main(int argc,char *argv[]){
       break;
     case 's': // Manual second setting
       sec = strtol(optarg,NULL,0);
+      manual_sec = true;
       manual_time = true;
       break;
     case 'L':
-      Positive_leap_second_pending = true; // Positive leap second at end of current month
+      positive_leap = true; // Positive leap second at end of current month
       break;
     case 'N':
-      Negative_leap_second_pending = true;  // Leap second at end of current month
+      negative_leap = true;  // Leap second at end of current month
       break;
     case '?':
       fprintf(stderr,"Usage: %s [options]\n",argv[0]);
@@ -239,11 +435,136 @@ int main(int argc,char *argv[]){
       fprintf(stderr,"[-t | --no-tone] suppress 440, 500 and 600 Hz tones\n");
       fprintf(stderr,"[-d | --no-voice] suppress all voice announcements\n");
       fprintf(stderr,"[-c | --no-code] suppress 100 Hz timecode\n");
+      fprintf(stderr,"[--cache-dir <dir>] speech cache, default $WWVSIM_CACHE or ~/.cache/wwvsim\n");
+      fprintf(stderr,"[--no-cache] don't keep synthesized speech on disk\n");
+      fprintf(stderr,"[--clips] splice time announcements from pre-rendered words\n");
+      fprintf(stderr,"[--tts <backend>] speech synthesizer; default first available\n");
+      fprintf(stderr,"[--tts-workers <n>] synthesizer processes per voice for piper-pool, default 2\n");
+      fprintf(stderr,"[--format s16|f32] output sample format, default s16\n");
+      fprintf(stderr,"[--no-dither] round to 16 bits without dither\n");
+      fprintf(stderr,"[--self-test] check signal generation against reference code and exit\n");
+      fprintf(stderr,"[--verify <file>] decode rendered audio (- for stdin); with a start time, check it too\n");
+      fprintf(stderr,"[-o | --output <file>] render offline as fast as possible to file (- for stdout)\n");
+      fprintf(stderr,"[--start <YYYY-MM-DDTHH:MM[:SS]>] same as -Y/-M/-D/-h/-m/-s\n");
+      fprintf(stderr,"[--duration <minutes>[h|d]] batch length, default 60 minutes\n");
+      fprintf(stderr,"[--buffer <ms>] output buffer depth, default %d ms\n",DEFAULT_BUFFER_MS);
+      fprintf(stderr,"[--free-run] don't lock the sound card's sample rate to the system clock\n");
+      fprintf(stderr,"[--blocking] write to the sound card instead of having it call for samples\n");
+      fprintf(stderr,"[--pace <ms>] release piped output in small blocks, this far ahead of when they go out\n");
+      fprintf(stderr,"[--framed] precede each block of piped output with a header giving its UTC time\n");
+      fprintf(stderr,"[--block <ms>] rendering block size, default %d ms\n",DEFAULT_BLOCK_MS);
+      fprintf(stderr,"[--iq] AM modulate to complex baseband, interleaved I/Q in the output format\n");
+      fprintf(stderr,"[--iq-rate <Hz>] I/Q sample rate, a multiple of the audio rate; default audio rate\n");
+      fprintf(stderr,"[--carrier <Hz>] carrier offset from zero frequency, default 0\n");
+      fprintf(stderr,"[--depth <0-1>] modulation depth at full scale, default 1\n");
+      fprintf(stderr,"[--both] WWV and WWVH together, mixed into one channel\n");
+      fprintf(stderr,"[--separate] with --both, WWV on the left channel and WWVH on the right\n");
+      fprintf(stderr,"[--wwv-gain <dB>] [--wwvh-gain <dB>] station level, default 0 dB, -6 dB each when mixed\n");
+      fprintf(stderr,"[--wwv-delay <ms>] [--wwvh-delay <ms>] propagation delay, 0-1000 ms, default 0\n");
+      fprintf(stderr,"[--channel good|moderate|poor|flutter|<spread ms>,<Doppler Hz>] HF fading, each station independently\n");
+      fprintf(stderr,"[--snr <dB>] add noise at this carrier to noise ratio in 3 kHz\n");
+      fprintf(stderr,"[--qrn <per second>[,<dB>]] static crashes peaking up to this level over the carrier, default 6 dB\n");
+      fprintf(stderr,"[--seed <n>] for fading and noise, default 0\n");
+      fprintf(stderr,"[--stats <file>] keep performance counters in this file as JSON, updated every second\n");
+      fprintf(stderr,"[--trace <file>] record each stage of the pipeline for chrome://tracing or Perfetto\n");
       exit(1);
 
     }
   }
-  if(isatty(fileno(stdout))){
+  if(manual_time && !manual_sec)
+    sec = 0; // Start on the minute
+  if(block_ms > buffer_ms / 2){
+    // The render thread waits for room for a whole block, which a smaller buffer may never have
+    fprintf(stderr,"Block size %d ms too big for a %d ms buffer, using %d\n",block_ms,buffer_ms,buffer_ms / 2);
+    block_ms = buffer_ms / 2;
+  }
+
+  if(self_test){
+    setup.no_voice = true;
+    if(wwvsim_init(&setup) != 0)
+      exit(1);
+    int const failures = osc_selftest() + clock_selftest() + pull_selftest();
+    exit(failures == 0 ? 0 : 1);
+  }
+  if(dst_start_doy(year) < 0)
+    fprintf(stderr,"Warning: DST rules for %d not implemented; DST bits = 0\n",year);    // Punt
+
+  if(positive_leap && negative_leap){
+    fprintf(stderr,"Positive and negative leap seconds can't both be pending! Both cancelled\n");
+    positive_leap = negative_leap = false;
+  }
+
+  if(params.dut1 > 7 || params.dut1 < -7){
+    fprintf(stderr,"ut1 offset %d out of range, limited to -7 to +7 tenths\n",params.dut1);
+    params.dut1 = 0;
+  }
+  if(positive_leap && params.dut1 > -3){
+    fprintf(stderr,"Postive leap second cancelled since dut1 > -0.3 sec\n");
+    positive_leap = false;
+  } else if(negative_leap && params.dut1 < 3){
+    fprintf(stderr,"Negative leap second cancelled since dut1 < +0.3 sec\n");
+    negative_leap = false;
+  }
+  params.leap = positive_leap ? +1 : negative_leap ? -1 : 0;
+  params.leap_year = year;
+  params.leap_month = month;
+
+  if(verify != NULL){
+    // The broadcast the file should hold, if it's known where it starts
+    setup.no_voice = true;
+    if(wwvsim_init(&setup) != 0)
+      exit(1);
+    struct broadcast b;
+    broadcast_init(&b,params.wwvh,params.dut1,params.leap,params.leap_year,params.leap_month);
+    b.no_timecode = params.no_timecode;
+    int64_t const t0 = broadcast_utc(&b,year,month,day,hour,minute,sec);
+    exit(verify_file(verify,Format,manual_time ? &b : NULL,t0) == 0 ? 0 : 1);
+  }
+  setup.no_voice = params.no_voice;
+  if(wwvsim_init(&setup) != 0)
+    exit(1);
+  if(trace != NULL){
+    if(wwvsim_trace_open(trace) != 0)
+      exit(1);
+    atexit(wwvsim_trace_close);
+  }
+  if(Stats_file != NULL){
+    pthread_t t;
+    pthread_create(&t,NULL,stats_thread,NULL);
+    pthread_detach(t);
+    atexit(write_stats);
+  }
+  // One station, or both as heard somewhere in between
+  struct wwvsim_path paths[2];
+  int npaths = 0;
+  for(int h=0; h < 2; h++){
+    if(!both && h != params.wwvh)
+      continue;
+    struct wwvsim_params station = params;
+    station.wwvh = h;
+    struct wwvsim *w = wwvsim_create(&station);
+    if(w == NULL)
+      exit(1);
+    double const db = !isnan(gain_db[h]) ? gain_db[h] : both && !separate ? -6 : 0;
+    paths[npaths++] = (struct wwvsim_path){ w, pow(10.,db/20.), delay_ms[h] / 1000, hf ? &channel : NULL };
+  }
+  if(Iq && separate && npaths > 1){
+    fprintf(stderr,"Can't modulate separate channels; drop --separate or --iq\n");
+    exit(1);
+  }
+  struct wwvsim_receiver *r = wwvsim_receiver_create(paths,npaths,separate);
+  if(r == NULL)
+    exit(1);
+  struct wwvsim const *w = paths[0].w; // For the calendar
+  int const rx_channels = wwvsim_receiver_channels(r);
+  if(Iq && (Am = wwvsim_am_create(iq_rate != 0 ? iq_rate : Samprate,carrier,depth)) == NULL)
+    exit(1);
+
+  if((Pace_ms >= 0 || Framed) && (output != NULL || isatty(fileno(stdout)))){
+    fprintf(stderr,"--pace and --framed are for real time output to a pipe\n");
+    exit(1);
+  }
+  if(output == NULL && isatty(fileno(stdout))){
 #ifdef USE_PORTAUDIO
     // No output redirection, so use portaudio to write directly to audio hardware with "precise" (?) timing
     Pa_Initialize();
@@ -253,764 +574,351 @@ int main(int argc,char *argv[]){
 
     PaStreamParameters param;
     param.device = dev;
-    param.channelCount = 1;
-    param.sampleFormat = paInt16;
+    param.channelCount = Iq ? 2 : rx_channels; // I and Q in left and right
+    param.sampleFormat = Format == WWVSIM_FORMAT_F32 ? paFloat32 : paInt16;
     param.suggestedLatency = .02; // Don't make too small
     param.hostApiSpecificStreamInfo = NULL;
 
-    int err = Pa_OpenStream(&Stream,NULL,&param,(double)Samprate,0,0,NULL,NULL);
+    // Unless asked to block, PortAudio calls for each buffer as the card needs it
+    int err = Pa_OpenStream(&Stream,NULL,&param,(double)(Iq ? wwvsim_am_rate(Am) : Samprate),
+			    paFramesPerBufferUnspecified,0,Blocking ? NULL : pa_callback,NULL);
     if(err != paNoError){
       fprintf(stderr,"Pa_OpenStream failed\n");
       exit(1);
     }
     atexit(cleanup);
+    PaStreamInfo const *info = Pa_GetStreamInfo(Stream);
+    Latency = info != NULL ? info->outputLatency : 0;
 #else
     fprintf(stderr,"Won't send PCM to a terminal (direct mode not compiled in)\n");
     exit(1);
 #endif
-
   }
-  if(year < 2007)
-    fprintf(stderr,"Warning: DST rules prior to %d not implemented; DST bits = 0\n",year);    // Punt
-
-  if(Positive_leap_second_pending && Negative_leap_second_pending){
-    fprintf(stderr,"Positive and negative leap seconds can't both be pending! Both cancelled\n");
-    Positive_leap_second_pending = Negative_leap_second_pending = false;
+  if(output != NULL){
+    int64_t const t0 = wwvsim_utc(w,year,month,day,hour,minute,sec);
+    struct tm tm = { .tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_hour = hour, .tm_min = minute, .tm_sec = sec };
+    int64_t const t1 = wwvsim_sample(w,timegm(&tm) + 60 * duration);
+    exit(batch_render(r,t0,t1,output,Format,Dither,Am) == 0 ? 0 : 1);
   }
-
-  if(dut1 > 7 || dut1 < -7){
-    fprintf(stderr,"ut1 offset %d out of range, limited to -7 to +7 tenths\n",dut1);
-    dut1 = 0;
-  }
-  if(Positive_leap_second_pending && dut1 > -3){
-    fprintf(stderr,"Postive leap second cancelled since dut1 > -0.3 sec\n");
-    Positive_leap_second_pending = false;
-  } else if(Negative_leap_second_pending && dut1 < 3){
-    fprintf(stderr,"Negative leap second cancelled since dut1 < +0.3 sec\n");
-    Negative_leap_second_pending = false;
+  // A render thread keeps the output a buffer ahead; see pull.c
+  struct wwvsim_pull_params pp = {
+    .format = Format,
+    .dither = Dither,
+    .am = Am,
+    .buffer_ms = buffer_ms,
+    .block_ms = block_ms,
+    .clock = WWVSIM_PULL_UNTIMED,
+    .relative = manual_time, // With a manual time there's no right time to keep, only the rate
+  };
+#ifdef USE_PORTAUDIO
+  if(Stream != NULL){
+    pp.callback = !Blocking;
+    pp.clock = free_run ? WWVSIM_PULL_MEASURED : WWVSIM_PULL_LOCKED;
   }
+#endif
+  Pull = wwvsim_pull_create(r,&pp);
+  if(Pull == NULL)
+    exit(1);
 
-  Samprate_ms = Samprate/1000; // Samples per ms
-  bool startup = true;
-  // Set up output thread to write asynchronously
-  pthread_create(&Output_thread,NULL,output_thread,NULL);
-
-  while(1){
-    int length = 60;    // Default length 60 seconds
-    if((month == 6 || month == 12) && hour == 23 && minute == 59){
-      if(Positive_leap_second_pending){
-	length = 61; // This minute ends with a leap second!
-      } else if(Negative_leap_second_pending){
-	length = 59; // Negative leap second
-      }
-    }
-
-    struct qentry *qe = calloc(1,sizeof(*qe));
-    assert(qe != NULL);
-    qe->length = length * Samprate; // Worst case
-    qe->buffer = calloc(sizeof(*qe->buffer),qe->length);
-    assert(qe->buffer != NULL);
-
-    // Generate timecode
-    uint8_t code[61] = {0}; // one extra for a possible leap second
-    if(!NoTimeCode){
-      bool leap_pending = (Positive_leap_second_pending || Negative_leap_second_pending);
-      maketimecode(code,dut1,leap_pending,year,month,day,hour,minute);
-
-      // Optionally dump timecode
-      if(Verbose){
-	fprintf(stderr,"%d/%d/%d %02d:%02d\n",month,day,year,hour,minute);
-	decode_timecode(code,length);
-      }
-    }
-    // Build a minute of audio
-    makeminute(qe->buffer,length,WWVH,NoTimeCode ? NULL : code,dut1,hour,minute);
-
-    if(!manual_time && startup){
-      // Buffers are constructed starting on the minute, so compute
-      // how much of it to skip in the first one.
-      // Speech synthesis can be slow, so look at the clock again
-      // Don't do with this when time is manually set
-      struct timeval now;
-      gettimeofday(&now,NULL);
-      struct tm const * const tm = gmtime(&now.tv_sec);
-      if(minute != tm->tm_min){
-	// We're already into the next minute? Speech synthesis can be slow.
-	// Discard this first one and continue with the next minute
-	// (What if we start during a leap second? geez...it never ends...)
-	fprintf(stderr,"Discarding first minute\n");
-	free(qe->buffer);
-	free(qe);
-	goto next_minute;
-      } else {
-	// Calculate starting offset into first buffer
-	qe->offset = Samprate * ((long long)1000000 * tm->tm_sec + now.tv_usec) /  1000000;
-	assert(qe->offset < Samprate * 60);
-	startup = false;
-      }
+  // Where to start: the manually set time, or join the broadcast in progress,
+  // giving speech a moment to get going
+  // Speech must be ready in time for the minute to go out on schedule; if not,
+  // it's replaced by the scheduled tone or silence. With a manually set time there's
+  // no schedule to keep, so wait for it
+  Receiver = r;
+  if(manual_time){
+    Start = wwvsim_utc(w,year,month,day,hour,minute,sec);
+    struct tm tm = { .tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_hour = hour, .tm_min = minute, .tm_sec = sec };
+    Start_sec = timegm(&tm);
+    if(Pace_ms >= 0){
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME,&now);
+      Pace_epoch = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec + Pace_ms * 1000000LL;
     }
-
-    // Append to queue, wake output
-    pthread_mutex_lock(&Output_mutex);
-    struct qentry *last = NULL;
-    for(struct qentry *q = Queue;q != NULL;last = q,q = q->next)
-      ;
-
-    if(last)
-      last->next = qe;
+    wwvsim_pull_start(Pull,Start);
+  } else {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+    struct timespec earliest = now;
+    timespec_add_ms(&earliest,STARTUP_GRACE_MS);
+    // Paced output goes out on schedule, so begin far enough ahead to render the first blocks
+    struct timespec begin = now;
+    if(Pace_ms >= 0)
+      timespec_add_ms(&begin,STARTUP_GRACE_MS + block_ms);
+    Start = wwvsim_sample(w,begin.tv_sec) + (int64_t)begin.tv_nsec * Samprate / 1000000000;
+    Start_sec = begin.tv_sec;
+    // Speech is rendered when the block containing it is, about one buffer ahead of
+    // the output, so its deadline has to fall within the buffer
+    int const margin_ms = DEADLINE_MARGIN_MS < buffer_ms / 2 ? DEADLINE_MARGIN_MS : buffer_ms / 2;
+    wwvsim_receiver_deadlines(r,margin_ms,&earliest);
+#ifdef USE_PORTAUDIO
+    // Begin with whatever's on the air when the card plays the first frame
+    // the render thread can have ready
+    if(Stream != NULL)
+      wwvsim_pull_start_live(Pull,STARTUP_GRACE_MS + block_ms);
     else
-      Queue = qe; // First on empty queue
-
-    pthread_cond_signal(&Output_cond);
-    pthread_mutex_unlock(&Output_mutex);
-
-    // Wait for queue to drain a little
-    while(qlen() >= 2){
-      useconds_t interval = 30000000; // Pause 30 sec
-      usleep(interval);
-    }
-  next_minute:;
-    if(length == 61){
-      // Leap second just occurred in this last minute
-      Positive_leap_second_pending = false;
-      dut1 += 10;
-    } else if(length == 59){
-      Negative_leap_second_pending = false;
-      dut1 -= 10;
+#endif
+      wwvsim_pull_start(Pull,Start);
+  }
+#ifdef USE_PORTAUDIO
+  if(Stream != NULL && !Blocking){
+    // All the work is in the callback and the render thread; keep the
+    // callback's map from stream time to system time up to date
+    stream_epoch();
+    int err = Pa_StartStream(Stream);
+    if(err != paNoError){
+      fprintf(stderr,"Portaudio error: %s\n",Pa_GetErrorText(err));
+      exit(1);
     }
-    // Advance to next minute
-    sec = 0;
-    if(++minute > 59){
-      // New hour
-      minute = 0;
-      if(++hour > 23){
-	// New day
-	hour = 0;
-	if(++day > ((month == 2 && is_leap_year(year))? 29 : Days_in_month[month])){
-	  // New month
-	  day = 1;
-	  if(++month > 12){
-	    // New year
-	    month = 1;
-	    ++year;
-	  }
-	}
-      }
+    while(1){
+      sleep(1);
+      stream_epoch();
     }
   }
+#endif
+  if(Pace_ms >= 0)
+    write_output(ms_samples(PACE_BLOCK_MS) * (Iq ? Am->interp : 1));
+  else
+    write_output(ms_samples(buffer_ms) * (Iq ? Am->interp : 1) / 4); // Leave the rest of the ring for the render thread
   exit(0);
 }
 
-
-// Is specified year a leap year?
-bool const is_leap_year(int y){
-  if((y % 4) != 0)
-    return false; // Ordinary year; example: 2017
-  if((y % 100) != 0)
-    return true; // Examples: 1956, 2004 (i.e., most leap years)
-  if((y % 400) != 0)
-    return false; // Examples: 1900, 2100 (the big exception to the usual rule; non-leap US presidential election years)
-  return true; // Example: 2000 (the exception to the exception)
-}
-
-
-char *chomp(char *str){
-  char *cp = strchr(str,'\n');
-  if(cp != NULL)
-    *cp = '\0';
-  cp = strchr(str,'\r');
-  if(cp != NULL)
-    *cp = '\0';
-  return str;
+static void timespec_add_ms(struct timespec *t,int ms){
+  t->tv_nsec += ms * 1000000LL;
+  while(t->tv_nsec >= 1000000000){
+    t->tv_nsec -= 1000000000;
+    t->tv_sec++;
+  }
 }
 
-// Generate complex phasor with specified angle in radians
-// Used for tone generation
-complex double const csincos(double x){
-  return cos(x) + I*sin(x);
+// When output frame 'frame' goes out, in ns of UTC as the system clock keeps it,
+// which repeats a second when one is inserted
+static int64_t frame_ns(int64_t frame){
+  int const interp = Iq ? Am->interp : 1;
+  int64_t const s = Start + frame / interp;
+  time_t sec = Start_sec + (s - wwvsim_receiver_sample(Receiver,Start_sec)) / Samprate;
+  while(wwvsim_receiver_sample(Receiver,sec) > s)
+    sec--;
+  while(wwvsim_receiver_sample(Receiver,sec + 1) <= s)
+    sec++;
+  int64_t const into = (s - wwvsim_receiver_sample(Receiver,sec)) * interp + frame % interp; // Up to 2 s in a leap second
+  return (int64_t)sec * 1000000000 + into * 1000000000 / ((int64_t)Samprate * interp);
 }
 
-// Insert PCM audio file into audio output at specified offset
-int announce_audio_file(int16_t *output, int length, char const *file, int startms){
-  if(startms < 0 || startms >= 61000)
-    return -1;
-
-  FILE *fp;
-  if((fp = fopen(file,"r")) != NULL){
-    int ret = fread(output+startms*Samprate_ms,
-		    sizeof(*output),
-		    Samprate_ms*(length-startms),
-		    fp);
+// Make a pipe on standard output hold at least 'bytes', or as much as it may
+static void pipe_size(int64_t bytes){
+#ifdef F_SETPIPE_SZ
+  int const size = fcntl(STDOUT_FILENO,F_GETPIPE_SZ);
+  if(size < 0 || size >= bytes)
+    return; // Not a pipe, or big enough
+  if(bytes <= INT_MAX && fcntl(STDOUT_FILENO,F_SETPIPE_SZ,(int)bytes) >= 0)
+    return;
+  // Without privileges it grows only so far
+  int max = 0;
+  FILE *fp = fopen("/proc/sys/fs/pipe-max-size","r");
+  if(fp != NULL){
+    if(fscanf(fp,"%d",&max) != 1)
+      max = 0;
     fclose(fp);
-    if(ret > 0) // Good read
-      return 0;
   }
-  return -1;
-}
-
-#if 0
-// Synthesize speech from a text file and insert into audio output at specified offset
-// Use female = true for WWVH, false for WWV
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <stdbool.h>
-#include <string.h>
-#include <errno.h>
-
-int announce_text(int16_t *output, int length, const char *text, int startms, bool female) {
-  FILE *fp = NULL;
-  char command[1024] = {0};
-  const char *voice = NULL;
-
-    if (access("/usr/local/bin/piper", X_OK) == 0) {
-        // Piper
-        voice = female ? "en_US-kathleen-low.onnx" : "en_US-ryan-medium.onnx";
-        snprintf(command, sizeof(command),
-            "/usr/local/bin/piper --model /usr/local/lib/piper/%s --output_file - <<< \"%s\" | "
-            "sox -t wav - -t raw -r 48000 -c 1 -b 16 -e signed-integer -",
-            voice, text);
-    }
-#ifdef __APPLE__
-    else if (access("/usr/bin/say", X_OK) == 0) {
-        // macOS 'say'
-        voice = female ? "Samantha" : "Alex";
-        snprintf(command, sizeof(command),
-            "say -v %s --data-format=LEI16@48000 -o - \"%s\" 2>/dev/null",
-            voice, text);
-    }
-#endif
-    else if (access("/usr/bin/espeak", X_OK) == 0 || access("/usr/bin/espeak-ng", X_OK) == 0) {
-        const char *espeak = access("/usr/bin/espeak-ng", X_OK) == 0 ? "/usr/bin/espeak-ng" : "/usr/bin/espeak";
-        voice = female ? "en-us+f3" : "en-us";
-        snprintf(command, sizeof(command),
-            "%s -v %s -s 175 -a 70 --stdout \"%s\" | "
-            "sox -t wav - -t raw -r 48000 -c 1 -b 16 -e signed-integer -",
-            espeak, voice, text);
-    } else {
-        fprintf(stderr, "No TTS engine available\n");
-        return -1;
-    }
-    fprintf(stderr,"command = %s\n",command);
-    if ((fp = popen(command, "r")) == NULL) {
-        perror("popen");
-        return -1;
-    }
-    fprintf(stderr,"fread(%p,%d,%d,%p\n",output + startms * Samprate_ms,
-		    sizeof(*output),
-		    Samprate_ms*(1000*length - startms),
-		    fp);
-    size_t samples_read = fread(output+startms*Samprate_ms,
-		    sizeof(*output),
-		    Samprate_ms*(1000*length - startms),
-		    fp);
-    pclose(fp);
-    fprintf(stderr,"announce_text(output=%p,length=%d,text=%s,startms=%d,female=%d)\n",
-	    output,length,text, startms,female);
-    fprintf(stderr,"samples: %lu\n",(unsigned long)samples_read);
-    return samples_read;
-}
-int announce_text_file(int16_t *output,int length,char const *file, int startms, bool female){
-  char text_buffer[8192]; // Pick a better number
-  FILE *fp = fopen(file,"r");
-  if(fp == NULL)
-    return -1;
-  size_t bytes = fread(text_buffer,1,sizeof text_buffer,fp);
-  fclose(fp);
-  if(bytes <= 0)
-    return -1;
-  return announce_text(output,length,text_buffer,startms,female);
-}
-
-# else 
-
-
-int announce_text_file(int16_t *output,int length,char const *file, int startms, bool female){
-  int r = -1;
-
-  char tempfile_raw[L_tmpnam+1];
-  memset(tempfile_raw,0,sizeof(tempfile_raw));
-  strncpy(tempfile_raw,"/tmp/srawXXXXXX.raw",sizeof(tempfile_raw));
-  mkstemps(tempfile_raw,4);
-
-#if defined(__APPLE__) || defined(PIPER)
-  char tempfile_wav[L_tmpnam+1];
-  memset(tempfile_wav,0,sizeof(tempfile_wav));
-  strncpy(tempfile_wav,"/tmp/swavXXXXXX.wav",sizeof(tempfile_wav));
-  mkstemps(tempfile_wav,4);
-#endif
-
-  int asr = -1;
-  char *fullname = NULL;
-  if(file[0] == '/')
-    asr = asprintf(&fullname,"%s",file); // Leading slash indicates absolute path name
-  else
-    asr = asprintf(&fullname,"%s/%s",Libdir,file); // Otherwise relative to library directory
-
-  if(asr == -1 || !fullname)
-    goto done; // asprintf failed for some reason
-
-  chomp(fullname);
-  if(access(fullname,R_OK) != 0)
-    goto done; // file isn't readable (what if it's a directory?
-
-  char const *voice = NULL;
-  asr = -1;
-
-  char *command = NULL;
-
-#ifdef __APPLE__
-  voice = female ? "Samantha" : "Alex";
-  asr = asprintf(&command,"say -v %s --output-file=%s --data-format=LEI16@48000 -f %s; sox %s -t raw -r 48000 -c 1 -b 16 -e signed-integer %s",
-	   voice,tempfile_wav,fullname,tempfile_wav,tempfile_raw);
-
-#elif defined(PIPER)
-  voice = female ? "en_US-kathleen-low.onnx" : "en_US-ryan-medium.onnx";
-  asr = asprintf(&command,"/usr/local/bin/piper --model /usr/local/lib/piper/%s --output_file - < %s | sox -t wav - -t raw -r 48000 -c 1 -b 16 -e signed-integer %s",
-		 voice,fullname,tempfile_raw);
-
-#else // crappy espeak
-  voice = female ? "en-us+f3" : "en-us";
-  asr = asprintf(&command,"espeak -v %s -a 70 -f %s --stdout | sox -t wav - -t raw -r 48000 -c 1 -b 16 -e signed-integer %s",
-	   voice,fullname,tempfile_raw);
-#endif
-  if(asr == -1 || !command)
-    goto done; // asprintf failed somehow
-
-  if(Verbose){
-    fprintf(stderr,"Executing \"%s\" to speak:\n",command);
-    FILE *in = fopen(fullname,"r");
-    if(in == NULL)
-      goto done;
-
-    int c;
-    while((c = fgetc(in)) != EOF)
-      fputc(c,stderr);
-    fputc('\n',stderr);
-    fflush(stderr);
-    fclose(in);
+  if(max <= size || fcntl(STDOUT_FILENO,F_SETPIPE_SZ,max) < 0){
+    if(Verbose)
+      fprintf(stderr,"Can't enlarge output pipe to %lld bytes: %s\n",(long long)bytes,strerror(errno));
   }
-
-  r = system(command);
-  if(r == 0)
-    r = announce_audio_file(output,length,tempfile_raw, startms);
-  else
-    fprintf(stderr,"system(%s) returned %d\n",command,r);
-
- done:; // Go here directly on errors
-  // Clean up
-  unlink(tempfile_raw);
-#if defined(__APPLE__) || defined(PIPER)
-  unlink(tempfile_wav);
 #endif
-
-  if(command)
-    free(command);
-  if(fullname)
-    free(fullname);
-  return r;
-}
-
-
-// Synthesize a text announcement and insert into output buffer
-int announce_text(int16_t *output,int length, char const *message,int startms,int female){
-
-  char tempfile_txt[L_tmpnam+1];
-  memset(tempfile_txt,0,sizeof(tempfile_txt));
-  strncpy(tempfile_txt,"/tmp/stextXXXXXX.txt",sizeof(tempfile_txt));
-  mkstemps(tempfile_txt,4);
-
-  FILE *fp;
-  if ((fp = fopen(tempfile_txt,"w")) == NULL)
-    return -1;
-  fputs(message,fp);
-  fclose(fp);
-  int r = announce_text_file(output,length, tempfile_txt,startms,female);
-  unlink(tempfile_txt);
-  return r;
 }
-#endif
 
-// Overlay a tone with frequency 'freq' in audio buffer, overwriting whatever was there
-// starting at 'startms' within the minute and stopping one sample before 'stopms'.
-// Amplitude 1.0 is 100% modulation, 0.5 is 50% modulation, etc
-// Used first for 500/600 Hz continuous audio tones
-// Then used for 1000/1200 Hz minute/hour beeps and second ticks, which pre-empt everything else.
-int overlay_tone(int16_t *output,int startms,int stopms,float freq,float amp){
-  if(startms < 0 || stopms <= startms || stopms > 61000)
-    return -1;
-
-  assert((startms * (int)freq % 1000) == 0); // All tones start with a positive zero crossing?
-
-  complex double phase = 1;
-  complex double const phase_step = csincos(2*M_PI*freq/Samprate);
-  output += startms*Samprate_ms;
-  int samples = (stopms - startms)*Samprate_ms;
-  while(samples-- > 0){
-    *output++ = cimag(phase) * amp * SHRT_MAX; // imaginary component is sine, real is cosine
-    phase *= phase_step;  // Rotate the tone phasor
+// Write 'n' frames to standard output, after a header if framed
+// One writev() from the output buffer; there's nothing to gain from stdio's
+// buffer, and vmsplice() would need pages nothing reuses until the reader is done
+static void write_pipe(void const *data,int n,int size,int64_t frame){
+  struct wwvsim_frame_header header;
+  struct iovec iov[2];
+  struct iovec *v = iov;
+  int count = 0;
+  if(Framed){
+    int64_t const ns = frame_ns(frame);
+    header = (struct wwvsim_frame_header){
+      .magic = WWVSIM_FRAME_MAGIC,
+      .frames = n,
+      .frame = frame,
+      .sec = ns / 1000000000,
+      .nsec = ns % 1000000000,
+      .rate = wwvsim_pull_rate(Pull),
+      .channels = wwvsim_pull_channels(Pull),
+      .format = Format,
+    };
+    iov[count++] = (struct iovec){ &header, sizeof(header) };
   }
- return 0;
-}
-
-// Same as overlay_tone() except that the tone is added to whatever is already in the audio buffer
-// Take care to avoid overmodulation; the result will be clipped but could still sound bad
-// Used mainly for 100 Hz subcarrier
-int add_tone(int16_t *output,int startms,int stopms,float freq,float amp){
-  if(startms < 0 || stopms <= startms || stopms > 61000)
-    return -1;
-
-  assert((startms * (int)freq % 1000) == 0); // All tones start with a positive zero crossing?
-
-  complex double phase = 1;
-  complex double const phase_step = csincos(2*M_PI*freq/Samprate);
-  output += startms*Samprate_ms;
-  int samples = (stopms - startms)*Samprate_ms;
-  while(samples-- > 0){
-    // Add and clip
-    float const samp = *output + cimag(phase) * amp * SHRT_MAX;
-    *output++ = samp > 32767 ? 32767 : samp < -32767 ? -32767 : samp;
-    phase *= phase_step; // Rotate the tone phasor
+  iov[count++] = (struct iovec){ (void *)data, (size_t)n * size };
+  while(count > 0){
+    ssize_t w = writev(STDOUT_FILENO,v,count);
+    if(w < 0 && errno == EINTR)
+      continue;
+    if(w <= 0)
+      exit(1); // Reader went away; SIGPIPE may be ignored
+    while(count > 0 && (size_t)w >= v->iov_len){
+      w -= v->iov_len;
+      v++;
+      count--;
+    }
+    if(count > 0){
+      v->iov_base = (char *)v->iov_base + w;
+      v->iov_len -= w;
+    }
   }
-  return 0;
-}
-
-// Blank out whatever is in the audio buffer starting at startms and ending just before stopms
-// Used mainly to blank out 40 ms guard interval around seconds ticks
-int overlay_silence(int16_t *output,int startms,int stopms){
-  if(startms < 0 || stopms <= startms || stopms > 61000)
-    return -1;
-  output += startms*Samprate_ms;
-  int const samples = (stopms - startms)*Samprate_ms;
-
-  memset(output,0,samples * sizeof(*output));
-  return 0;
 }
 
-// Encode a BCD digit in little-endian format (lsb first)
-// NB! Only WWV/WWVH; WWVB uses big-endian format
-void encode(uint8_t *code,int x){
-  for(int i=0;i<4;i++){
-    code[i] = x & 1;
-    x >>= 1;
+// Hold paced output until it's 'Pace_ms' ahead of when it goes out
+static void pace(int64_t frame){
+  int const rate = wwvsim_pull_rate(Pull);
+  // Whole seconds apart so the product can't overflow at high I/Q rates
+  int64_t const due = (Pace_epoch >= 0 ? Pace_epoch + frame / rate * 1000000000 + frame % rate * 1000000000 / rate : frame_ns(frame))
+    - Pace_ms * 1000000LL;
+#ifdef __APPLE__
+  // No clock_nanosleep(); sleep off what's left, again if woken early
+  while(1){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+    int64_t const left = due - ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+    if(left <= 0)
+      break;
+    struct timespec const ts = { left / 1000000000, left % 1000000000 };
+    nanosleep(&ts,NULL);
   }
+#else
+  struct timespec const ts = { due / 1000000000, due % 1000000000 };
+  while(clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&ts,NULL) == EINTR)
+    ;
+#endif
 }
-int decode(uint8_t const *code){
-  int r = 0;
 
-  for(int i=3; i>=0; i--){
-    r <<= 1;
-    assert(code[i] == 0 || code[i] == 1);
-    r += code[i];
+// Take from the render thread and write, to the sound card or standard output
+static void write_output(int chunk){
+  int const size = wwvsim_pull_channels(Pull) * wwvsim_format_size(Format);
+  void *buffer = malloc((size_t)chunk * size);
+  assert(buffer != NULL);
+  int const rate = wwvsim_pull_rate(Pull);
+  int64_t written = 0; // Frames
+  // Room in a pipe for all that's released ahead, or for a couple of writes
+  pipe_size(((Pace_ms >= 0 ? (int64_t)Pace_ms * rate / 1000 : 0) + 2 * chunk)
+	    * (size + (Framed ? sizeof(struct wwvsim_frame_header) : 0)));
+#if USE_PORTAUDIO
+  if(Stream != NULL){
+    // Silence goes out until the render thread has the first frame
+    int err = Pa_StartStream(Stream);
+    if(err != paNoError){
+      fprintf(stderr,"Portaudio error: %s\n",Pa_GetErrorText(err));
+      exit(1);
+    }
   }
-  return r;
-}
+#endif
 
-/* Determine day of year when daylight savings time starts
-   Only US rules are needed, since WWV/WWVH are American stations
-   US rules last changed in 2007 to 2nd sunday of March to first sunday in November
-   Always lasts for 238 days (34 weeks)
-   Pattern repeats every 28 years (7 days in week x 4 years in leap year cycle)
-   Hopefully DST will be abolished before long!
-                                          2007: 3/11 (70)    2008: 3/9  (69)
-   2009: 3/8  (67)     2010: 3/14 (73)    2011: 3/13 (72)    2012: 3/11 (71)
-   2013: 3/10 (69)     2014: 3/9  (68)    2015: 3/8  (67)    2016: 3/13 (73)
-   2017: 3/12 (71)     2018: 3/11 (70)    2019: 3/10 (69)    2020: 3/8  (68)
-   2021: 3/14 (73)     2022: 3/13 (72)    2023: 3/12 (71)    2024: 3/10 (70)
-   2025: 3/9  (68)     2026: 3/8  (67)    2027: 3/14 (73)    2028: 3/12 (72)
-   2029: 3/11 (70)     2030: 3/10 (69)    2031: 3/9  (68)    2032: 3/14 (74)
-
-   2033: 3/13 (72)     2034: 3/12 (71)    2035: 3/11 (70)    2036: 3/9  (69)
-   2037: 3/8  (67)     2038: 3/14 (73)    2039: 3/13 (72)    2040: 3/11 (71)
-   2041: 3/10 (69)     2042: 3/9  (68)    2043: 3/8  (67)    2044: 3/13 (73)
-   2045: 3/12 (71)     2046: 3/11 (70)    2047: 3/10 (69)    2048: 3/8  (68)
-   2049: 3/14 (73)     2050: 3/13 (72)    2051: 3/12 (71)    2052: 3/10 (70)
-   2053: 3/9  (68)     2054: 3/8  (67)    2055: 3/14 (73)    2056: 3/12 (72)
-   2057: 3/11 (70)     2058: 3/10 (69)    2059: 3/9  (68)    2060: 3/14 (74)
-*/
-int dst_start_doy(int year){
-  int r = -1;
-  if(year >= 2007){
-    r = 72;  // DST would have started on day 72 in year 2005 if rule had been in effect then
-    for(int ytmp = 2005; ytmp < year; ytmp++){
-      r -= 1 + is_leap_year(ytmp);
-      if(r < 67) // Never before day 67
-	r += 7;
+  while(1){
+    if(Pace_ms >= 0)
+      pace(written);
+    int const n = wwvsim_pull_read(Pull,buffer,chunk);
+    int64_t const start = monotonic_ns();
+#if USE_PORTAUDIO
+    if(Stream){
+      int err = Pa_WriteStream(Stream,buffer,n);
+      if(err == paOutputUnderflowed){
+	atomic_fetch_add(&Stats.underruns,1);
+	if(Verbose)
+	  fprintf(stderr,"Output underrun\n");
+      } else if(err != paNoError){
+	fprintf(stderr,"Portaudio error: %s\n",Pa_GetErrorText(err));
+      }
+      if(err == paNoError){
+	struct timespec when;
+	heard_time(rate,&when);
+	wwvsim_pull_heard(Pull,written + n - 1,&when);
+      }
+    } else {
+      write_pipe(buffer,n,size,written);
     }
-    if(r == 67 && is_leap_year(year)) // day 67 is 1st sunday in march
-	r += 7;
+#else
+    write_pipe(buffer,n,size,written);
+#endif
+    written += n;
+    hist_add(&Stats.output_write,(monotonic_ns() - start) / 1000);
+    trace_event("write",start);
   }
-  return r;
 }
-
-int day_of_year(int year,int month,int day){
-    // Compute day of year
-    // don't use doy in tm struct in case date was manually overridden
-    // (Bug found and reported by Jayson Smith jaybird@bluegrasspals.com)
-    int doy = day;
-    for(int i = 1; i < month; i++){
-      if(i == 2 && is_leap_year(year))
-	doy += 29;
-      else
-	doy += Days_in_month[i];
-    }
-    return doy;
+#ifdef USE_PORTAUDIO
+// A write just returned, so the card's buffer is full but for what it says
+// is free, and the last frame written will be heard once the frames ahead
+// of it have played
+static void heard_time(int rate,struct timespec *when){
+  clock_gettime(CLOCK_REALTIME,when);
+  long const available = Pa_GetStreamWriteAvailable(Stream);
+  double const heard = when->tv_nsec * 1e-9 + Latency - (double)((available > 0 ? available : 0) + 1) / rate;
+  when->tv_sec += (time_t)floor(heard);
+  when->tv_nsec = (long)((heard - floor(heard)) * 1e9);
 }
 
-
-// Construct time code as array of **61** unsigned chars with values 0 or 1
-void maketimecode(uint8_t *code,int dut1,bool leap_pending,int year,int month,int day,int hour,int minute){
-    memset(code,0,61*sizeof(*code)); // All bits default to 0
-
-    int doy = day_of_year(year,month,day);
-    int dst_start = dst_start_doy(year);
-
-    if(dst_start >= 1){
-      // DST always lasts for 238 days
-      if(doy > dst_start && doy <= dst_start + 238)
-	code[2] = 1; // DST status at 00:00 UTC
-      if(doy >= dst_start && doy < dst_start + 238)
-	code[55] = 1; // DST status at 24:00 UTC
-#if 0
-      fprintf(stderr,"year %d month %d day %d doy %d dst_start_doy %d dst_start_doy + 238 %d\n",
-	      year, month, day, doy, dst_start, dst_start + 238);
-#endif
+// Map PortAudio's stream time to the system clock, which may be slewed
+// by NTP; the closest of a few tries
+static void stream_epoch(void){
+  int64_t best = INT64_MAX, epoch = 0;
+  for(int i=0; i < 5; i++){
+    struct timespec before, after;
+    clock_gettime(CLOCK_REALTIME,&before);
+    PaTime const t = Pa_GetStreamTime(Stream);
+    clock_gettime(CLOCK_REALTIME,&after);
+    int64_t const b = (int64_t)before.tv_sec * 1000000000 + before.tv_nsec;
+    int64_t const a = (int64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+    if(a - b < best){
+      best = a - b;
+      epoch = b + (a - b) / 2 - llround(t * 1e9);
     }
-
-    code[3] = leap_pending;
-
-    // Year
-    encode(code+4,year % 10); // Least significant digit
-    encode(code+51,(year/10)%10); // Tens digit
-
-    // Minute of hour, 0-59
-    encode(code+10,minute%10); // Least significant digit
-    encode(code+15,minute/10); // Most significant digit, extends into unused bit 18
-
-    // Hour of day, 0-23
-    encode(code+20,hour%10);   // Least significant digit
-    encode(code+25,hour/10);   // Most significant digit, extends into unused bits 27-28
-
-    // Day of year, 1-366
-    encode(code+30,doy%10);    // Least significant digit
-    encode(code+35,(doy/10)%10); // Middle digit
-    encode(code+40,doy/100);   // High digit, extends into unused bits 42-43
-
-    // UT1 offset, +/-0.0 through 0.7; adjusted after leap second
-    code[50] = (dut1 >= 0); // sign
-    encode(code+56,abs(dut1));  // magnitude, extends into marker 59 and is ignored
-}
-
-// Decode frame of timecode to stderr for debugging
-void decode_timecode(uint8_t *code,int length){
-  for(int s=0;s<length;s++){
-    if((s % 10) == 0 && s < 60)
-      fprintf(stderr,"%02d: ",s);
-    if(s == 0)
-      fputc(' ',stderr);
-    else if((s % 10) == 9)
-      fprintf(stderr,"M");
-    else
-      fputc(code[s] ? '1' : '0',stderr);
-    if(s < 59 && (s % 10 == 9))
-      fputc('\n',stderr);
   }
-  fputc('\n',stderr);
-  fprintf(stderr,"year %d%d",decode(code+51),decode(code+4));
-  fprintf(stderr," doy %d%d%d",decode(code+40),decode(code+35),decode(code+30));
-
-  fprintf(stderr," hour %d%d",decode(code+25),decode(code+20));
-  fprintf(stderr," minute %d%d",decode(code+15),decode(code+10));
-  int dut1 = decode(code+56);
-  if(!code[50])
-    dut1 = -dut1;
-  fprintf(stderr,"; dut1 %+d",dut1);
-
-  if(code[3])
-    fprintf(stderr,"; leap second pending");
-
-  if(code[2] && code[55])
-    fprintf(stderr,"; DST in effect");
-  else if(!code[2] && code[55])
-    fprintf(stderr,"; DST starts today");
-  else if(code[2]  && !code[55])
-    fprintf(stderr,"; DST ends today");
-  else
-    fprintf(stderr,"; DST not in effect");
-
-  fprintf(stderr,"\n\n");
+  atomic_store(&Stream_epoch,epoch);
 }
 
-// Insert tone or announcement into seconds 1-44
-void gen_tone_or_announcement(int16_t *output,int length,bool wwvh,int hour,int minute){
-  const double tone_amp = pow(10.,-6.0/20.); // -6 dB
-
-  // A raw audio file pre-empts everything else
-  char *rawfilename = NULL;
-  char *textfilename = NULL;
-
-  if(!NoVoice && asprintf(&rawfilename,"%s/%s/%d.raw",Libdir,wwvh ? "wwvh" : "wwv",minute)
-     && access(rawfilename,R_OK) == 0){
-    announce_audio_file(output,length,rawfilename,1000);
-    goto done;
-  } else if(!NoVoice && asprintf(&textfilename,"%s/%s/%d.txt",Libdir,wwvh ? "wwvh" : "wwv",minute)
-	    && access(textfilename,R_OK) == 0){
-    announce_text_file(output,length,textfilename,1000,wwvh);
-    goto done;
-  } else if (!NoTone){
-    // Otherwise generate a tone, unless silent
-    double tone = wwvh ? WWVH_tone_schedule[minute] : WWV_tone_schedule[minute];
-
-    // Special case: no 440 Hz tone during hour 0
-    if(tone == 440 && hour == 0)
-      tone = 0;
-
-    if(tone)
-      add_tone(output,1000,45000,tone,tone_amp); // Continuous tone from 1 sec until 45 sec
+// On PortAudio's real-time thread: no locks, no allocation, no system calls
+static int pa_callback(void const *input,void *output,unsigned long frames,
+		       PaStreamCallbackTimeInfo const *time,PaStreamCallbackFlags flags,void *user){
+  if(flags & paOutputUnderflow)
+    atomic_fetch_add_explicit(&Stats.underruns,1,memory_order_relaxed);
+  // When this buffer's first frame will be heard; some host APIs don't say
+  PaTime dac = time->outputBufferDacTime;
+  if(dac <= 0 && time->currentTime > 0)
+    dac = time->currentTime + Latency;
+  if(dac > 0){
+    int64_t const ns = atomic_load_explicit(&Stream_epoch,memory_order_relaxed) + llround(dac * 1e9);
+    struct timespec const when = { ns / 1000000000, ns % 1000000000 };
+    wwvsim_pull_heard(Pull,Callback_frames,&when);
   }
-
- done:;
-  if(rawfilename)
-    free(rawfilename);
-  if(textfilename)
-    free(textfilename);
+  wwvsim_pull_render(Pull,output,frames);
+  Callback_frames += frames;
+  return paContinue;
 }
+#endif
 
-
-
-void makeminute(int16_t *output,int length,bool wwvh,uint8_t const *code,int dut1,int hour,int minute){
-  // Amplitudes
-  // NIST 250-67, p 50
-  const double marker_high_amp = pow(10.,-6.0/20.);
-  //  NIST 250-67, p 47 says 1/3.3 (about -10 dB) but is apparently incorrect; observed is ~ -20 dB
-  // WWV staff says it's meant to be off, but the hardware won't go there so they set it to minimum
-  //  const double marker_low_amp = marker_high_amp / 3.3;
-  //  const double marker_low_amp = marker_high_amp / 10;
-  const double marker_low_amp = 0;
-  const double tick_amp = 1.0; // 100%, 0dBFS
-
-  const double tickfreq = wwvh ? 1200.0 : 1000.0;
-  const double hourbeep = 1500.0; // Both WWV and WWVH
-
-  // Build a minute of audio
-  memset(output,0,length*Samprate*sizeof(*output)); // Clear previous audio
-  gen_tone_or_announcement(output,length,wwvh,hour,minute);
-
-  // Insert minute announcement
-  // What are the next hour and minute?
-  int nextminute = minute;
-  int nexthour = hour;
-  if(++nextminute == 60){
-    nextminute = 0;
-    if(++nexthour == 24)
-      nexthour = 0;
-  }
-  if(!NoVoice){
-    char *message = NULL;
-    int asr = asprintf(&message,"At the tone, %d %s %d %s Coordinated Universal Time",
-		       nexthour,nexthour == 1 ? "hour" : "hours",
-		       nextminute,nextminute == 1 ? "minute" : "minutes");
-    if(asr != -1 && message){
-      if(!wwvh)
-	announce_text(output,length,message,52500,0); // WWV: male voice at 52.5 seconds
-      else
-	announce_text(output,length,message,45000,1); // WWVH: female voice at 45 seconds
-      free(message); message = NULL;
-    }
-  }
-  if(code != NULL){
-    // Modulate time code onto 100 Hz subcarrier
-    for(int s=1; s<length; s++){ // No subcarrier during second 0 (minute/hour beep)
-      if((s % 10) == 9){
-	add_tone(output,s*1000,s*1000+800,100,marker_high_amp);	 // 800 ms position markers on seconds 9, 19, 29, ...
-	add_tone(output,s*1000+800,s*1000+1000,100,marker_low_amp);
-      } else if(code[s]){
-	add_tone(output,s*1000,s*1000+500,100,marker_high_amp);	 // 500 ms = 1 bit
-      add_tone(output,s*1000+500,s*1000+1000,100,marker_low_amp);
-      } else {
-	add_tone(output,s*1000,s*1000+200,100,marker_high_amp);	 // 200 ms = 0 bit
-	add_tone(output,s*1000+200,s*1000+1000,100,marker_low_amp);
-      }
-    }
-  }
-  // Pre-empt with minute/hour beep and guard interval
-  overlay_tone(output,0,800,minute == 0 ? hourbeep : tickfreq,tick_amp);
-  overlay_silence(output,800,1000);
-
-  // Pre-empt with second ticks and guard interval
-  for(int s=1; s<length; s++){
-    if(s != 29 && s < 59){
-      // No ticks or blanking on 29, 59 or 60
-      // Blank with silence from t-10 ms to t+30, total 40 ms
-      overlay_silence(output,1000*s-10,1000*s+30);
-      overlay_tone(output,1000*s,1000*s+5,tickfreq,tick_amp); // 5 ms tick at 100% modulation on second
-    }
-    // Double ticks without guard time for UT1 offset
-    if((dut1 > 0 && s >= 1 && s <= dut1)
-       || (-dut1 > 0 && s >= 9 && s <= 8-dut1)){
-      overlay_tone(output,1000*s+100,1000*s+105,tickfreq,tick_amp); // 5 ms second tick at 100 ms
-    }
-  }
+// Replace the stats file, so a reader never sees it half written
+static void write_stats(void){
+  char tmp[PATH_MAX];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",Stats_file);
+  FILE *fp = fopen(tmp,"w");
+  if(fp == NULL)
+    return;
+  int const r = wwvsim_stats_json(fp);
+  if(fclose(fp) != 0 || r != 0 || rename(tmp,Stats_file) != 0)
+    unlink(tmp);
 }
 
-
-// Read from buffer, send to standard output
-// In separate thread to run parallel with next buffer generation (similar to port audio for direct output)
-void *output_thread(void *p){
-  pthread_setname("output");
-
-  bool started = false;
-
+static void *stats_thread(void *p){
+  pthread_setname("stats");
   while(1){
-    struct qentry *qe;
-    pthread_mutex_lock(&Output_mutex);
-    while(Queue == NULL)
-      pthread_cond_wait(&Output_cond,&Output_mutex);
-    qe = Queue;
-    Queue = qe->next;
-    qe->next = NULL;
-    pthread_mutex_unlock(&Output_mutex);
-
-#if USE_PORTAUDIO
-    if(!started && Stream){
-      int err = Pa_StartStream(Stream);
-      if(err != paNoError){
-	fprintf(stderr,"Portaudio error: %s\n",Pa_GetErrorText(err));
-	exit(1);
-      }
-      started = true;
-    }
-    if(Stream){
-      int err = Pa_WriteStream(Stream,qe->buffer + qe->offset,qe->length - qe->offset);
-      if(err != paNoError){
-	fprintf(stderr,"Portaudio error: %s\n",Pa_GetErrorText(err));
-      }
-    } else {
-      fwrite(qe->buffer + qe->offset,sizeof(int16_t),qe->length - qe->offset,stdout);
-      fflush(stdout);
-    }
-#else
-    fwrite(qe->buffer + qe->offset,sizeof(int16_t),qe->length - qe->offset,stdout);
-    fflush(stdout);
-#endif
-    free(qe->buffer);
-    free(qe);
+    write_stats();
+    sleep(1);
   }
   return NULL;
 }
-void cleanup(void){
+
+static void cleanup(void){
 #if USE_PORTAUDIO
   Pa_Terminate();
 #endif
 }
-
-
-// Return length of output queue
-int qlen(void){
-  int len = 0;
-  pthread_mutex_lock(&Output_mutex);
-  for(struct qentry *q = Queue;q != NULL;q = q->next)
-    len++;
-  pthread_mutex_unlock(&Output_mutex);
-  return len;
-}
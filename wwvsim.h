@@ -0,0 +1,267 @@
+// Declarations shared between the wwvsim modules
+// The public library interface is in libwwvsim.h
+#ifndef _WWVSIM_H
+#define _WWVSIM_H 1
+
+#define PIPER 1 // Piper TTS
+
+#include <pthread.h>
+
+#if __APPLE__
+#define pthread_setname(x) pthread_setname_np(x)
+#else // !__APPLE__
+// Not apple (Linux, etc)
+#define pthread_setname(x) pthread_setname_np(pthread_self(),(x))
+#endif // ifdef __APPLE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "libwwvsim.h"
+
+extern char Libdir[];
+extern int Samprate;    // Samples per second
+#define MIN_SAMPRATE 8000   // Room for the 1500 Hz beep
+#define MAX_SAMPRATE 384000 // And nothing silly
+extern bool Verbose;
+
+// The program is laid out in milliseconds; this is where one falls at the
+// sample rate. Rounds down, so a span from 'a' to 'b' ms is
+// ms_samples(b) - ms_samples(a) samples wherever it falls
+static inline int ms_samples(int ms){
+  return (int64_t)ms * Samprate / 1000;
+}
+
+// Four floats, lowered to SSE, NEON or scalar code as the target allows
+typedef float v4sf __attribute__((vector_size(16)));
+
+static inline v4sf load4(float const *p){
+  v4sf v;
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+static inline void store4(float *p,v4sf v){
+  memcpy(p,&v,sizeof(v));
+}
+
+// Stateless random numbers, so dither and noise depend only on a sample's
+// position in time, not on how the program was divided into buffers
+// (splitmix64 finalizer)
+static inline uint64_t mix64(uint64_t x){
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Durations in power-of-two buckets of microseconds, see stats.c
+#define HIST_BUCKETS 32
+struct histogram {
+  atomic_long count;
+  atomic_long sum_us;
+  atomic_long max_us;
+  atomic_long buckets[HIST_BUCKETS];
+};
+void hist_add(struct histogram *h,int64_t us);
+int64_t monotonic_ns(void);
+void trace_event(char const *name,int64_t start);
+
+// Event counters
+#define STATS_BACKENDS 8 // Speech synthesizers tracked
+struct stats {
+  atomic_long late_speech; // Announcements not rendered by their deadline
+  atomic_long failed_speech; // Announcements the synthesizer couldn't render
+  atomic_long clipped;     // Samples limited to full scale by wwvsim_quantize()
+  atomic_long underruns;   // Sound device ran out of samples
+  atomic_long ring_empty;  // Output thread found nothing to write
+  atomic_long ring_ms;     // Audio in the output ring at the last write
+  atomic_long clock_offset_us; // Output early (+) or late of the system clock, see clock.c
+  atomic_long clock_ppb;   // Sound card sample rate error
+  struct histogram render_minute; // Time to render each minute of each station, or batch job
+  struct histogram render_block;  // Time to render each live block
+  struct histogram output_write;  // Time to hand each chunk to the device or pipe
+  struct histogram ring_depth;    // Audio in the output ring at each write
+  struct histogram speech[STATS_BACKENDS]; // Synthesis time by backend
+};
+extern struct stats Stats;
+
+// Speech cache configuration, see announce.c
+extern char const *Cache_dir; // On-disk cache directory; NULL disables
+extern long Cache_mem_limit;  // Bytes of PCM kept in memory
+extern bool Splice_speech;    // Build time announcements from pre-rendered clips; set by wwvsim_init() only
+
+char *chomp(char *str);
+
+// Extent of speech within a minute, in samples
+struct span {
+  int start;
+  int length;
+};
+
+// Everything a minute of the broadcast depends on, besides the program options
+struct minute_state {
+  int year, month, day, hour, minute;
+  bool wwvh;
+  int length;         // Seconds, 59-61 with a leap second
+  int dut1;           // UT1 - UTC, tenths of a second
+  bool leap_pending;  // Leap second warning
+  time_t start;       // UNIX time of the minute
+  int64_t sample;     // Broadcast sample number of its first sample
+};
+
+// What's on the air, for any instant; see calendar.c
+struct broadcast {
+  bool wwvh;
+  int dut1;           // UT1 - UTC before any leap second, tenths of a second
+  int leap;           // +1 or -1 with a leap second, otherwise 0
+  time_t leap_minute; // UNIX time of the 23:59 minute ending with it
+  bool no_tone;       // Program options
+  bool no_voice;
+  bool no_timecode;
+};
+extern int const Days_in_month[];
+bool is_leap_year(int y);
+int dst_start_doy(int year);
+int day_of_year(int year,int month,int day);
+void broadcast_init(struct broadcast *b,bool wwvh,int dut1,int leap,int year,int month);
+int64_t broadcast_sample(struct broadcast const *b,time_t t);
+int64_t broadcast_utc(struct broadcast const *b,int year,int month,int day,int hour,int minute,int second);
+void broadcast_minute(struct broadcast const *b,int64_t n,struct minute_state *m);
+
+// A minute rendered in blocks. Speech is settled when rendering reaches it
+struct minute_plan {
+  struct broadcast const *b;
+  struct minute_state m;
+  uint8_t code[61];         // Timecode bits, one extra for a possible leap second
+  bool wait;                // Wait for speech as long as it takes
+  struct timespec earliest; // Otherwise no speech deadline before this
+  int margin_ms;            // and speech must be ready this long before it's due
+  bool slot_done;           // Seconds 1-44 settled: announcement or tone
+  int tone;                 // Tone for seconds 1-44
+  bool time_done;           // Time announcement settled
+  int16_t *voice;           // Speech, valid only within 'spans'
+  struct span spans[2];
+  int nspans;
+};
+void plan_init(struct minute_plan *p,struct broadcast const *b,struct minute_state const *m,int16_t *voice);
+void render_block(struct minute_plan *p,float *output,int start,int n);
+void render_interval(struct broadcast const *b,float *output,int64_t t0,int64_t t1);
+
+// Program elements, see render.c
+void maketimecode(uint8_t *code,int dut1,bool leap_pending,int year,int month,int day,int hour,int minute);
+void decode_timecode(uint8_t *code,int length);
+struct timecode {
+  int year;          // Last two digits
+  int doy, hour, minute;
+  int dut1;          // Tenths of a second
+  bool leap_pending;
+  bool dst_start;    // DST in effect at 00:00 UTC
+  bool dst_end;      // and at 24:00 UTC
+};
+void parse_timecode(uint8_t const *code,struct timecode *tc);
+char const *dst_status(struct timecode const *tc);
+int overlay_tone(float *output,int startms,int stopms,float freq,float amp);
+int add_tone(float *output,int startms,int stopms,float freq,float amp);
+int overlay_silence(float *output,int startms,int stopms);
+
+// HF channel simulator, see channel.c
+struct channel;
+struct channel *channel_create(struct wwvsim_channel const *spec,uint64_t salt);
+void channel_destroy(struct channel *ch);
+int channel_lead(struct channel const *ch);
+void channel_apply(struct channel const *ch,float *out,float const *in,int n,int64_t position);
+
+// Output clock discipline, see clock.c
+struct clock_discipline;
+struct clock_discipline *clock_create(int channels,int rate,int max_frames,bool relative,bool steer);
+void clock_destroy(struct clock_discipline *c);
+void clock_reset(struct clock_discipline *c,int64_t frame,int64_t position,double offset);
+int64_t clock_step(struct clock_discipline *c);
+int clock_resample(struct clock_discipline *c,float *out,float const *in,int n);
+void clock_measure(struct clock_discipline *c,int64_t frame,double expected,double now);
+int clock_selftest(void);
+
+// Pull rendering, see pull.c
+int pull_selftest(void);
+
+// AM modulator state, see am.c; opaque in the library interface
+struct wwvsim_am {
+  int rate;              // Complex samples per second, a multiple of the audio rate
+  int interp;            // Complex samples per audio sample
+  int carrier;           // Carrier offset, Hz
+  float depth;           // Modulation depth at audio full scale, 1.0 = 100%
+  float level;           // Carrier amplitude
+  int half;              // Interpolation filter half-width, audio samples
+  float *taps;           // Polyphase interpolation filter
+  int period;            // Samples in one cycle of the carrier table
+  int length;            // Carrier table length, a multiple of 'period'
+  float *carrier_table;  // Interleaved cos/sin
+};
+
+// Offline rendering, see batch.c
+int batch_render(struct wwvsim_receiver const *r,int64_t t0,int64_t t1,char const *output,enum wwvsim_format format,bool dither,struct wwvsim_am const *am);
+
+// Audio-domain check of rendered output, see verify.c
+int verify_file(char const *input,enum wwvsim_format format,struct broadcast const *b,int64_t t0);
+
+// Insert audio into the minute buffer at 'startms'. 'length' is the length of the minute in seconds
+// Return the number of samples inserted, or -1 on error
+int announce_audio_file(int16_t *output,int length,char const *file,int startms);
+// Speech not ready by 'deadline' is skipped; a NULL deadline waits indefinitely
+int announce_text_file(int16_t *output,int length,char const *file,int startms,bool female,struct timespec const *deadline);
+int announce_text(int16_t *output,int length,char const *message,int startms,bool female,struct timespec const *deadline);
+int announce_time(int16_t *output,int length,int hour,int minute,int startms,bool female,struct timespec const *deadline);
+int announce_clips_init(bool female);
+void speech_cache_init(void);
+int announce_prefetch_init(int threads);
+void announce_prefetch(char const *text,bool female);
+void announce_schedule(bool wwvh,int hour,int minute,int count);
+
+// Speech synthesizers, see tts.c
+extern int Tts_workers; // Persistent synthesizer processes per voice
+int tts_init(char const *name);
+void tts_start(bool female);
+char const *tts_backend(int i);
+char const *tts_name(void);
+char const *tts_voice(bool female);
+int tts_synthesize(char const *text,bool female,int16_t **samples);
+
+// Tone oscillators, see osc.c
+void osc_tone(float *output,int samples,double freq,double amp,int64_t offset,bool add);
+char const *osc_name(void);
+int osc_selftest(void);
+
+// Mix bus, see mix.c; output formats are in libwwvsim.h
+void mix_add(float *bus,int16_t const *in,int n,float gain);
+
+// Lock-free single producer, single consumer sample ring, see ring.c
+struct ring {
+  char *buffer;
+  int size;               // Samples
+  int width;              // Bytes per sample
+  _Atomic uint64_t head;  // Samples ever written
+  _Atomic uint64_t tail;  // Samples ever read
+  atomic_int waiters;     // Threads sleeping on 'cond'
+  pthread_mutex_t mutex;  // Only for sleeping
+  pthread_cond_t cond;
+};
+int ring_init(struct ring *r,int size,int width);
+void ring_free(struct ring *r);
+int ring_count(struct ring *r);
+int ring_space(struct ring *r);
+void *ring_write_space(struct ring *r,int max,int *len);
+void ring_commit(struct ring *r,int len);
+void *ring_read_data(struct ring *r,int max,int *len);
+void ring_consume(struct ring *r,int len);
+
+// Sample rate conversion, see resample.c
+int resample_length(int inlen,int inrate,int outrate);
+int resample(float *out,int outrate,float const *in,int inlen,int inrate);
+int resample_pcm(int16_t **samples,float const *in,int length,int rate);
+double bessel_i0(double x);
+
+#endif